@@ -8,8 +8,25 @@ exec valgrind --quiet --leak-check=full --track-origins=yes "$tmp"
 exit 0
 #endif
 #include <cstd/std.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 #include <cstruct/binary_tree_iterator.h>
 #include "regstore.h"
+#include "regstore_mirror.h"
+
+#define NO_DEADLINE SIZE_MAX
+#define NO_SLOT SIZE_MAX
+/* Longest last notified value kept verbatim, fingerprint::max_verbatim in C++ */
+#define MAX_VERBATIM 16
+/* Longest text form of a typed value, with terminator */
+#define VALUE_TEXT_MAX (REGSTORE_BLOB_MAX * 2 + 1)
 
 const char *regstore_errstr(enum regstore_err error)
 {
@@ -33,6 +50,79 @@ struct reg {
 	regstore_setter *setter;
 	void *setter_arg;
 	struct binary_tree observers; /* observer(remote) */
+	struct regstore_handle *handle; /* Created on first resolve */
+	struct regstore *inst;
+	/* Typed registers: getter/setter above convert, with this reg as arg */
+	enum regstore_type type;
+	regstore_typed_getter *typed_getter;
+	void *typed_getter_arg;
+	regstore_typed_setter *typed_setter;
+	void *typed_setter_arg;
+	struct binary_tree typed_observers; /* typed_sub(remote) */
+	/* Last notified value if suppressing unchanged ones, verbatim if short */
+	bool suppress;
+	bool notified;
+	size_t last_len;
+	union {
+		char verbatim[MAX_VERBATIM];
+		uint64_t hash;
+	} last;
+	/* Getter result kept for cache_max_age_ms if positive */
+	int64_t cache_max_age_ms;
+	bool cache_valid;
+	bool cache_fetching; /* By a reader of a concurrent store */
+	int64_t cache_time_ms;
+	struct fstr cache_value;
+	uint64_t cache_hits;
+	uint64_t cache_misses;
+	/* Polled every sample_period_ms (if positive) while observed, due -1 if not */
+	int64_t sample_period_ms;
+	int64_t sample_due_ms;
+	size_t sample_index; /* In inst->sampled */
+	bool sample_valid;
+	struct fstr sample_last;
+	size_t export_slot; /* In inst->exported, NO_SLOT if not exported */
+	struct reg_stats *stats; /* Set while the store's stats are enabled */
+	struct stat_source *stat_source; /* Set if the register publishes stats */
+	/* Store seq of the last change, in inst's list of registers by it */
+	uint64_t version;
+	struct reg *older;
+	struct reg *newer;
+};
+
+struct regstore_handle {
+	struct reg *reg; /* NULL once deleted */
+	struct regstore *lock_inst; /* Store to lock, if concurrent */
+	atomic_size_t refs; /* The register holds one while it exists */
+};
+
+/* Typed observer */
+struct typed_sub {
+	struct fstr remote;
+	regstore_typed_observer *observer;
+	void *observer_arg;
+};
+
+/* Secondary index of what one remote subscribes to, and its batch */
+struct remote_subs {
+	struct fstr remote;
+	struct regstore *inst;
+	struct binary_tree regs; /* struct reg *, by key */
+	struct binary_tree patterns; /* fstr */
+	regstore_batch_observer *batch; /* Set if batched */
+	void *batch_arg;
+	int64_t interval_ms;
+	int64_t due_ms; /* When the pending batch is flushed, if interval_ms */
+	struct regstore_change *pending;
+	size_t npending;
+	size_t pending_cap;
+	struct binary_tree pending_index; /* batch_slot(key) */
+};
+
+/* Position of a key's change in its batch */
+struct batch_slot {
+	struct fstr key;
+	size_t idx;
 };
 
 /* Observer */
@@ -41,321 +131,3898 @@ struct observer {
 	regstore_observer *observer;
 	void *observer_arg;
 	struct regstore_subscription_info info;
+	/* Newest value held back by min_interval_ms, valid while queued */
+	struct regstore *inst;
+	struct fstr pending;
+	size_t deadline; /* Index in inst->deadlines or NO_DEADLINE */
+	struct reg *reg; /* Observed */
 };
 
-static void destroy_reg(void *p, size_t len)
+/* TODO: Use tempus once it is ready */
+static int64_t now_ms()
 {
-	(void) len;
-	struct reg *reg = p;
-	fstr_destroy(&reg->name);
-	binary_tree_destroy(&reg->observers);
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-static void destroy_observer(void *p, size_t len)
+static uint64_t now_ns()
 {
-	(void) len;
-	struct observer *obs = p;
-	fstr_destroy(&obs->remote);
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-static void destroy_reginfo(void *p, size_t len)
+/* Latency histogram, as struct regstore_histogram */
+struct stats_histogram {
+	_Atomic uint64_t buckets[REGSTORE_HISTOGRAM_BUCKETS];
+};
+
+/*
+ * Counters of a register, updated by readers of a concurrent store in
+ * parallel.  Deferred observer calls hold a reference, as the register may
+ * be deleted before they are made.
+ */
+struct reg_stats {
+	atomic_size_t refs;
+	_Atomic uint64_t gets;
+	_Atomic uint64_t sets;
+	_Atomic uint64_t notifies;
+	_Atomic uint64_t rate_limited;
+	struct stats_histogram get_us;
+	struct stats_histogram set_us;
+	struct stats_histogram observer_us;
+};
+
+struct lock_stats {
+	atomic_bool enabled; /* Checked before the lock is taken */
+	struct stats_histogram wait_us;
+};
+
+/* Stats published as registers, in order of their names' suffixes */
+enum stat_kind {
+	stat_gets,
+	stat_sets,
+	stat_notifies,
+	stat_rate_limited,
+	stat_get_p50,
+	stat_get_p99,
+	stat_set_p50,
+	stat_set_p99,
+	stat_observer_p50,
+	stat_observer_p99,
+	stat_lock_wait_p50,
+	stat_lock_wait_p99
+};
+
+/* Getter arg of a stats register, which looks its register up on each read */
+struct stat_source {
+	struct regstore *inst;
+	struct fstr key; /* Empty for lock waits */
+	enum stat_kind kind;
+};
+
+static void histogram_record(struct stats_histogram *h, uint64_t start_ns)
 {
-	(void) len;
-	struct regstore_reginfo *info = p;
-	fstr_destroy(&info->name);
-	fstr_destroy(&info->value);
+	uint64_t us = (now_ns() - start_ns) / 1000;
+	size_t i = 0;
+	while (us && i < REGSTORE_HISTOGRAM_BUCKETS - 1) {
+		us >>= 1;
+		i++;
+	}
+	atomic_fetch_add_explicit(&h->buckets[i], 1, memory_order_relaxed);
 }
 
-static enum regstore_err call_getter(const struct reg *reg, struct fstr *value)
+static void histogram_load(struct stats_histogram *h, struct regstore_histogram *out)
 {
-	if (!reg->getter) {
-		return regstore_err_not_readable;
+	for (size_t i = 0; i < REGSTORE_HISTOGRAM_BUCKETS; i++) {
+		out->buckets[i] = atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
 	}
-	return reg->getter(reg->setter_arg, value);
 }
 
-static enum regstore_err call_setter(const struct reg *reg, const struct fstr *value)
+static void histogram_clear(struct stats_histogram *h)
 {
-	if (!reg->setter) {
-		return regstore_err_not_writeable;
+	for (size_t i = 0; i < REGSTORE_HISTOGRAM_BUCKETS; i++) {
+		atomic_store_explicit(&h->buckets[i], 0, memory_order_relaxed);
 	}
-	return reg->setter(reg->setter_arg, value);
 }
 
-static void call_observer(const struct observer *obs, const struct fstr *value)
+static void stats_count(_Atomic uint64_t *counter)
 {
-	obs->observer(obs->observer_arg, value);
+	atomic_fetch_add_explicit(counter, 1, memory_order_relaxed);
 }
 
-static void *send_notification_iter(void *arg, struct binary_tree_node *node)
+static struct reg_stats *stats_new()
 {
-	const struct fstr *value = arg;
-	struct observer *obs = (void *) node->data;
-	/* TODO: Check timestamp in reg info to see whether we should send */
-	ssize_t now = 0;
-	if (obs->info.next_ms <= now) {
-		//TODO obs->info.next_ms = now + obs->info.min_interval_ms;
-		call_observer(obs, value);
-	}
-	return NULL;
+	struct reg_stats *stats = calloc(1, sizeof(*stats));
+	atomic_init(&stats->refs, 1);
+	return stats;
 }
 
-static void send_notification(const struct reg *reg, const struct fstr *value)
+static struct reg_stats *stats_acquire(struct reg_stats *stats)
 {
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wdiscarded-qualifiers"
-	binary_tree_each(&reg->observers, send_notification_iter, value);
-#pragma GCC diagnostic pop
+	if (stats) {
+		atomic_fetch_add(&stats->refs, 1);
+	}
+	return stats;
 }
 
-static int first_fstr_cmp(const void *a, size_t al, const void *b, size_t bl, void *arg)
+static void stats_release(struct reg_stats *stats)
 {
-	(void) al;
-	(void) bl;
-	(void) arg;
-	const struct fstr *ra = a;
-	const struct fstr *rb = b;
-	return fstr_cmp(ra, rb);
-
+	if (stats && atomic_fetch_sub(&stats->refs, 1) == 1) {
+		free(stats);
+	}
 }
 
-struct list_closure {
-	struct binary_tree *out;
-	const struct fstr *remote;
-	bool values;
+/* Observer call queued under a concurrent store's write lock, made once it is released */
+struct deferred_call {
+	enum {
+		deferred_observer,
+		deferred_pattern,
+		deferred_typed,
+		deferred_batch
+	} kind;
+	union {
+		regstore_observer *observer;
+		regstore_pattern_observer *pattern;
+		regstore_typed_observer *typed;
+		regstore_batch_observer *batch;
+	} fn;
+	void *arg;
+	/* Copies, as the call is made after the store may have changed them */
+	struct fstr key;
+	struct fstr value;
+	struct regstore_value typed;
+	struct regstore_change *changes;
+	size_t count;
+	struct reg_stats *stats; /* Of the observed register, to time the call */
 };
 
-void *list_iter(void *arg, struct binary_tree_node *node)
+static struct deferred_call *defer(struct regstore *inst, void *arg)
 {
-	const struct list_closure *closure = arg;
-	struct binary_tree *out = closure->out;
-	const struct fstr *remote = closure->remote;
-	bool values = closure->values;
+	if (inst->deferred_len == inst->deferred_cap) {
+		inst->deferred_cap = inst->deferred_cap ? inst->deferred_cap * 2 : 16;
+		inst->deferred = realloc(inst->deferred, inst->deferred_cap * sizeof(*inst->deferred));
+	}
+	struct deferred_call *call = &inst->deferred[inst->deferred_len++];
+	call->arg = arg;
+	fstr_init(&call->key);
+	fstr_init(&call->value);
+	call->changes = NULL;
+	call->count = 0;
+	call->stats = NULL;
+	return call;
+}
 
-	struct reg *reg = (void *) node->data;
+/* Journal slot, a seqlock over the record's fields and its words in data */
+struct journal_slot {
+	_Atomic uint64_t stamp; /* 2 * pos + 1 while record pos is written, 2 * pos + 2 once written */
+	_Atomic uint64_t seq;
+	_Atomic int64_t time_ms;
+	_Atomic uint32_t key_len;
+	_Atomic uint32_t value_len;
+	_Atomic bool truncated;
+};
 
-	struct regstore_reginfo info;
-	fstr_init_copy(&info.name, &reg->name);
-	info.type = (reg->getter ? rt_readable : 0) | (reg->setter ? rt_writeable : 0);
-	fstr_init(&info.value);
+struct regstore_journal {
+	atomic_size_t refs; /* The store's and each cursor's */
+	size_t capacity;
+	size_t words; /* Of key and value per slot */
+	_Atomic uint64_t head; /* Count of records written */
+	struct journal_slot *slots;
+	_Atomic uint64_t *data;
+};
 
-	if (values && reg->getter) {
-		call_getter(reg, &info.value);
-	}
+static void deadline_swap(struct regstore *inst, size_t a, size_t b)
+{
+	struct observer *tmp = inst->deadlines[a];
+	inst->deadlines[a] = inst->deadlines[b];
+	inst->deadlines[b] = tmp;
+	inst->deadlines[a]->deadline = a;
+	inst->deadlines[b]->deadline = b;
+}
 
-	struct observer *obs = binary_tree_get(&reg->observers, remote, sizeof(*remote), NULL);
-	info.subscribed = obs != NULL;
-	if (obs) {
-		info.sub_info = obs->info;
+static void deadline_sift(struct regstore *inst, size_t i)
+{
+	struct observer **h = inst->deadlines;
+	while (i > 0 && h[i]->info.next_ms < h[(i - 1) / 2]->info.next_ms) {
+		deadline_swap(inst, i, (i - 1) / 2);
+		i = (i - 1) / 2;
 	}
-
-	if (!binary_tree_insert(out, &info, sizeof(info), NULL)) {
-		log_error("Unexpected conflict while building register info tree");
-		return (void *) 1;
+	while (true) {
+		size_t min = i;
+		size_t l = i * 2 + 1;
+		size_t r = l + 1;
+		if (l < inst->deadlines_len && h[l]->info.next_ms < h[min]->info.next_ms) {
+			min = l;
+		}
+		if (r < inst->deadlines_len && h[r]->info.next_ms < h[min]->info.next_ms) {
+			min = r;
+		}
+		if (min == i) {
+			break;
+		}
+		deadline_swap(inst, i, min);
+		i = min;
 	}
-	return NULL;
 }
 
-bool regstore_list(struct regstore *inst, struct binary_tree *out, const struct fstr *remote, bool values)
+static void deadline_push(struct regstore *inst, struct observer *obs)
 {
-	struct list_closure closure = {
-		.out = out,
-		.remote = remote,
-		.values = values
-	};
-	binary_tree_init(out, first_fstr_cmp, NULL, destroy_reginfo);
-	if (binary_tree_each(&inst->store, list_iter, &closure)) {
-		binary_tree_destroy(out);
-		return false;
+	if (inst->deadlines_len == inst->deadlines_cap) {
+		inst->deadlines_cap = inst->deadlines_cap ? inst->deadlines_cap * 2 : 16;
+		inst->deadlines = realloc(inst->deadlines, inst->deadlines_cap * sizeof(*inst->deadlines));
 	}
-	return true;
+	obs->deadline = inst->deadlines_len++;
+	inst->deadlines[obs->deadline] = obs;
+	deadline_sift(inst, obs->deadline);
 }
 
-bool regstore_add(struct regstore *inst, const struct fstr *key, regstore_getter *getter, void *getter_arg, regstore_setter *setter, void *setter_arg)
+static void deadline_remove(struct regstore *inst, struct observer *obs)
 {
-	struct reg reg;
-	fstr_init_copy(&reg.name, key);
-	reg.getter = getter;
-	reg.getter_arg = getter_arg;
-	reg.setter = setter;
-	reg.setter_arg = setter_arg;
-	binary_tree_init(&reg.observers, first_fstr_cmp, NULL, destroy_observer);
-	if (!binary_tree_insert_new(&inst->store, &reg, sizeof(reg))) {
-		fstr_destroy(&reg.name);
-		return false;
+	size_t i = obs->deadline;
+	size_t last = --inst->deadlines_len;
+	obs->deadline = NO_DEADLINE;
+	if (i != last) {
+		inst->deadlines[i] = inst->deadlines[last];
+		inst->deadlines[i]->deadline = i;
+		deadline_sift(inst, i);
 	}
-	return true;
 }
 
-bool regstore_add_s(struct regstore *inst, const char *key, regstore_getter *getter, void *getter_arg, regstore_setter *setter, void *setter_arg)
+static void remote_index_remove(struct regstore *inst, const struct fstr *remote, struct reg *reg, bool force);
+
+/* Observers and typed observers both start with the remote */
+static void *unindex_iter(void *arg, struct binary_tree_node *node)
 {
-	struct fstr fs;
-	fstr_init_ref(&fs, key);
-	bool res = regstore_add(inst, &fs, getter, getter_arg, setter, setter_arg);
-	fstr_destroy(&fs);
-	return res;
+	struct reg *reg = arg;
+	remote_index_remove(reg->inst, (const struct fstr *) node->data, reg, true);
+	return NULL;
 }
 
-bool regstore_delete(struct regstore *inst, const struct fstr *key)
+/* Unlink from the list of registers by version */
+static void reg_unlink(struct reg *reg)
 {
-	return binary_tree_remove(&inst->store, key, sizeof(*key));
+	struct regstore *inst = reg->inst;
+	*(reg->older ? &reg->older->newer : &inst->oldest) = reg->newer;
+	*(reg->newer ? &reg->newer->older : &inst->newest) = reg->older;
+	reg->older = NULL;
+	reg->newer = NULL;
 }
 
-enum regstore_err regstore_set(struct regstore *inst, const struct fstr *key, const struct fstr *value)
+static struct regstore_journal *journal_new(size_t capacity, size_t record_size)
 {
-	struct reg *reg = binary_tree_get(&inst->store, key, sizeof(*key), NULL);
-	if (!reg) {
-		return regstore_err_invalid_key;
-	}
-	enum regstore_err err = call_setter(reg, value);
-	if (err == regstore_err_ok) {
-		struct fstr val;
-		fstr_init(&val);
-		if (call_getter(reg, &val) == regstore_err_not_readable) {
-			send_notification(reg, value);
-		} else {
-			send_notification(reg, &val);
-		}
-		fstr_destroy(&val);
+	struct regstore_journal *j = malloc(sizeof(*j));
+	atomic_init(&j->refs, 1);
+	j->capacity = capacity;
+	j->words = (record_size + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+	atomic_init(&j->head, 0);
+	j->slots = calloc(capacity, sizeof(*j->slots));
+	j->data = calloc(capacity * j->words, sizeof(*j->data));
+	return j;
+}
+
+static void journal_release(struct regstore_journal *j)
+{
+	if (j && atomic_fetch_sub(&j->refs, 1) == 1) {
+		free(j->slots);
+		free((void *) j->data);
+		free(j);
 	}
-	return err == regstore_err_no_change ? regstore_err_ok : err;
 }
 
-enum regstore_err regstore_get(struct regstore *inst, const struct fstr *key, struct fstr *value)
+static void journal_write(struct regstore_journal *j, uint64_t seq, const struct fstr *key, const struct fstr *value)
 {
-	struct reg *reg = binary_tree_get(&inst->store, key, sizeof(*key), NULL);
-	if (!reg) {
-		return regstore_err_invalid_key;
+	uint64_t pos = atomic_load_explicit(&j->head, memory_order_relaxed);
+	struct journal_slot *s = &j->slots[pos % j->capacity];
+	_Atomic uint64_t *d = &j->data[pos % j->capacity * j->words];
+	atomic_store_explicit(&s->stamp, 2 * pos + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	size_t size = j->words * sizeof(uint64_t);
+	const char *k = fstr_get(key);
+	const char *v = fstr_get(value);
+	size_t key_len = fstr_len(key) < size ? fstr_len(key) : size;
+	size_t value_len = fstr_len(value) < size - key_len ? fstr_len(value) : size - key_len;
+	atomic_store_explicit(&s->seq, seq, memory_order_relaxed);
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	atomic_store_explicit(&s->time_ms, (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000, memory_order_relaxed);
+	atomic_store_explicit(&s->key_len, key_len, memory_order_relaxed);
+	atomic_store_explicit(&s->value_len, value_len, memory_order_relaxed);
+	atomic_store_explicit(&s->truncated, key_len < fstr_len(key) || value_len < fstr_len(value), memory_order_relaxed);
+	/* Key then value, packed into words */
+	size_t len = key_len + value_len;
+	for (size_t w = 0; w * sizeof(uint64_t) < len; w++) {
+		char buf[sizeof(uint64_t)] = { 0 };
+		size_t begin = w * sizeof(buf);
+		size_t end = len < begin + sizeof(buf) ? len : begin + sizeof(buf);
+		for (size_t i = begin; i < end; i++) {
+			buf[i - begin] = i < key_len ? k[i] : v[i - key_len];
+		}
+		uint64_t word;
+		memcpy(&word, buf, sizeof(word));
+		atomic_store_explicit(&d[w], word, memory_order_relaxed);
 	}
-	return call_getter(reg, value);
+	atomic_store_explicit(&s->stamp, 2 * pos + 2, memory_order_release);
+	atomic_store_explicit(&j->head, pos + 1, memory_order_release);
 }
 
-bool regstore_observe(struct regstore *inst, const struct fstr *key, const struct fstr *remote, regstore_observer *observer, void *observer_arg, int64_t min_interval)
+/* Copy record pos into rec and buf, false if it was overwritten */
+static bool journal_read(struct regstore_journal *j, uint64_t pos, struct regstore_journal_record *rec, char *buf)
 {
-	if (!observer) {
+	struct journal_slot *s = &j->slots[pos % j->capacity];
+	_Atomic uint64_t *d = &j->data[pos % j->capacity * j->words];
+	uint64_t stamp = 2 * pos + 2;
+	if (atomic_load_explicit(&s->stamp, memory_order_acquire) != stamp) {
 		return false;
 	}
-	struct reg *reg = binary_tree_get(&inst->store, key, sizeof(*key), NULL);
-	if (!reg) {
+	rec->seq = atomic_load_explicit(&s->seq, memory_order_relaxed);
+	rec->time_ms = atomic_load_explicit(&s->time_ms, memory_order_relaxed);
+	rec->truncated = atomic_load_explicit(&s->truncated, memory_order_relaxed);
+	/* Lengths may be torn if the record is being overwritten, so bound them */
+	size_t size = j->words * sizeof(uint64_t);
+	size_t key_len = atomic_load_explicit(&s->key_len, memory_order_relaxed);
+	key_len = key_len < size ? key_len : size;
+	size_t value_len = atomic_load_explicit(&s->value_len, memory_order_relaxed);
+	value_len = value_len < size - key_len ? value_len : size - key_len;
+	/* buf holds key, NUL, value, NUL */
+	size_t len = key_len + value_len;
+	for (size_t w = 0; w * sizeof(uint64_t) < len; w++) {
+		uint64_t word = atomic_load_explicit(&d[w], memory_order_relaxed);
+		char bytes[sizeof(word)];
+		memcpy(bytes, &word, sizeof(bytes));
+		size_t begin = w * sizeof(bytes);
+		size_t end = len < begin + sizeof(bytes) ? len : begin + sizeof(bytes);
+		for (size_t i = begin; i < end; i++) {
+			buf[i < key_len ? i : i + 1] = bytes[i - begin];
+		}
+	}
+	buf[key_len] = 0;
+	buf[len + 1] = 0;
+	atomic_thread_fence(memory_order_acquire);
+	if (atomic_load_explicit(&s->stamp, memory_order_relaxed) != stamp) {
 		return false;
 	}
-	struct observer obs;
-	fstr_init_copy(&obs.remote, remote);
-	obs.observer = observer;
-	obs.observer_arg = observer_arg;
-	obs.info.next_ms = 0;
-	obs.info.min_interval_ms = min_interval;
-	binary_tree_replace(&reg->observers, &obs, sizeof(obs));
+	fstr_init_ref(&rec->key, buf);
+	fstr_init_ref(&rec->value, buf + key_len + 1);
 	return true;
 }
 
-bool regstore_unobserve(struct regstore *inst, const struct fstr *key, const struct fstr *remote)
+/* Shared-memory segment registers are exported to, laid out as in regstore_mirror.h */
+struct regstore_export {
+	struct regstore_mirror_header *header;
+	size_t size;
+	char *name;
+};
+
+static size_t round_words(size_t n)
 {
-	struct reg *reg = binary_tree_get(&inst->store, key, sizeof(*key), NULL);
-	if (!reg) {
-		return false;
-	}
-	return binary_tree_remove(&reg->observers, remote, sizeof(*remote));
+	return (n + sizeof(uint64_t) - 1) / sizeof(uint64_t) * sizeof(uint64_t);
 }
 
-bool regstore_query_observer(struct regstore *inst, const struct fstr *key, const struct fstr *remote, struct regstore_subscription_info *out)
+static struct regstore_export *export_new(const char *name, size_t capacity, size_t key_size, size_t value_size)
 {
-	struct reg *reg = binary_tree_get(&inst->store, key, sizeof(*key), NULL);
-	if (!reg) {
-		return false;
+	key_size = round_words(key_size);
+	value_size = round_words(value_size);
+	size_t slot_size = sizeof(struct regstore_mirror_slot) + key_size + value_size;
+	if (capacity > UINT32_MAX || slot_size > UINT32_MAX || capacity > (SIZE_MAX - sizeof(struct regstore_mirror_header)) / slot_size) {
+		return NULL;
 	}
-	struct observer *obs = binary_tree_get(&reg->observers, remote, sizeof(*remote), NULL);
-	if (!obs) {
-		return false;
+	size_t size = sizeof(struct regstore_mirror_header) + capacity * slot_size;
+	/* A new object, so readers of any previous one keep a valid mapping of it */
+	shm_unlink(name);
+	int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+	if (fd < 0) {
+		log_error("Failed to create shared memory \"%s\": %s", name, strerror(errno));
+		return NULL;
 	}
-	*out = obs->info;
-	return true;
+	void *p = MAP_FAILED;
+	if (ftruncate(fd, size) == 0) {
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if (p == MAP_FAILED) {
+		log_error("Failed to map shared memory \"%s\": %s", name, strerror(errno));
+		shm_unlink(name);
+		return NULL;
+	}
+	/* Zero-filled by ftruncate */
+	struct regstore_mirror_header *header = p;
+	header->capacity = capacity;
+	header->slot_size = slot_size;
+	header->key_size = key_size;
+	header->value_size = value_size;
+	atomic_store_explicit(&header->magic, REGSTORE_MIRROR_MAGIC, memory_order_release);
+	struct regstore_export *ex = malloc(sizeof(*ex));
+	ex->header = header;
+	ex->size = size;
+	ex->name = strdup(name);
+	return ex;
 }
 
-enum regstore_err regstore_notify(struct regstore *inst, const struct fstr *key)
+/* Readers' mappings stay valid, and see the segment is no longer written */
+static void export_free(struct regstore_export *ex)
 {
-	struct reg *reg = binary_tree_get(&inst->store, key, sizeof(*key), NULL);
-	if (!reg) {
-		return false;
+	if (!ex) {
+		return;
 	}
-	struct fstr value;
-	fstr_init(&value);
-	enum regstore_err res = call_getter(reg, &value);
-	if (res == regstore_err_ok) {
-		send_notification(reg, &value);
+	atomic_store_explicit(&ex->header->magic, 0, memory_order_release);
+	munmap(ex->header, ex->size);
+	shm_unlink(ex->name);
+	free(ex->name);
+	free(ex);
+}
+
+/* Seqlock write of the slot's value, or of its removal if value is NULL */
+static void export_write(struct regstore_export *ex, size_t slot, const struct fstr *value)
+{
+	struct regstore_mirror_header *header = ex->header;
+	struct regstore_mirror_slot *s = regstore_mirror_slot_at(header, slot);
+	_Atomic uint64_t *d = regstore_mirror_words(header, s);
+	uint64_t seq = atomic_load_explicit(&s->seq, memory_order_relaxed);
+	atomic_store_explicit(&s->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	size_t len = value ? fstr_len(value) : 0;
+	size_t n = len < header->value_size ? len : header->value_size;
+	const char *v = value ? fstr_get(value) : NULL;
+	for (size_t w = 0; w * sizeof(uint64_t) < n; w++) {
+		uint64_t word = 0;
+		size_t begin = w * sizeof(word);
+		memcpy(&word, v + begin, n - begin < sizeof(word) ? n - begin : sizeof(word));
+		atomic_store_explicit(&d[w], word, memory_order_relaxed);
 	}
-	fstr_destroy(&value);
-	return res;
+	uint32_t value_len = !value ? REGSTORE_MIRROR_REMOVED : len < REGSTORE_MIRROR_REMOVED ? len : REGSTORE_MIRROR_REMOVED - 1;
+	atomic_store_explicit(&s->value_len, value_len, memory_order_relaxed);
+	atomic_store_explicit(&s->seq, seq + 2, memory_order_release);
 }
 
-void regstore_init(struct regstore *inst)
+/* Claim the next slot for key, NO_SLOT if full or key is too long */
+static size_t export_add(struct regstore_export *ex, const struct fstr *key)
 {
-	binary_tree_init(&inst->store, first_fstr_cmp, NULL, destroy_reg);
+	struct regstore_mirror_header *header = ex->header;
+	size_t slot = atomic_load_explicit(&header->count, memory_order_relaxed);
+	if (slot == header->capacity || fstr_len(key) > header->key_size) {
+		return NO_SLOT;
+	}
+	struct regstore_mirror_slot *s = regstore_mirror_slot_at(header, slot);
+	s->key_len = fstr_len(key);
+	memcpy(regstore_mirror_key(s), fstr_get(key), fstr_len(key));
+	return slot;
 }
 
-void regstore_destroy(struct regstore *inst)
+/* Publish a slot claimed by export_add, once its initial value is written */
+static void export_publish(struct regstore_export *ex, size_t slot)
 {
-	binary_tree_destroy(&inst->store);
+	atomic_store_explicit(&ex->header->count, slot + 1, memory_order_release);
 }
 
-#if defined TEST_regstore
-static struct fstr rem;
+/* Mark as changed: next version, moved to the newest end of the list */
+static void reg_touch(struct reg *reg)
+{
+	struct regstore *inst = reg->inst;
+	if (reg->version) {
+		reg_unlink(reg);
+	}
+	reg->version = ++inst->seq;
+	reg->older = inst->newest;
+	*(inst->newest ? &inst->newest->newer : &inst->oldest) = reg;
+	inst->newest = reg;
+}
 
-#define nregs 4
+static void sampled_remove(struct reg *reg)
+{
+	struct regstore *inst = reg->inst;
+	struct reg *last = inst->sampled[--inst->sampled_len];
+	inst->sampled[reg->sample_index] = last;
+	last->sample_index = reg->sample_index;
+	reg->sample_period_ms = 0;
+}
 
-static struct testreg {
-	struct fstr k;
-	struct fstr v;
-	struct fstr w;
-} regs[nregs];
+/* Text shared by every reference to it, freed with the last */
+struct interned {
+	struct binary_tree *table;
+	size_t refs;
+	char text[];
+};
 
-static enum regstore_err getter(void *arg, struct fstr *value)
+/* Init out as a reference to the store's one copy of s */
+static void intern(struct regstore *inst, struct fstr *out, const struct fstr *s)
 {
-	fstr_copy(value, (const struct fstr *) arg);
-	return regstore_err_ok;
+	const struct fstr *found = binary_tree_get(&inst->strings, s, sizeof(*s), NULL);
+	struct interned *entry;
+	if (found) {
+		entry = (void *) (fstr_get(found) - offsetof(struct interned, text));
+	} else {
+		size_t len = fstr_len(s);
+		entry = malloc(sizeof(*entry) + len + 1);
+		entry->table = &inst->strings;
+		entry->refs = 0;
+		memcpy(entry->text, fstr_get(s), len);
+		entry->text[len] = 0;
+		struct fstr ref;
+		fstr_init_ref(&ref, entry->text);
+		binary_tree_insert(&inst->strings, &ref, sizeof(ref), NULL);
+	}
+	entry->refs++;
+	fstr_init_ref(out, entry->text);
 }
 
-static enum regstore_err setter(void *arg, const struct fstr *value)
+static void unintern(struct fstr *s)
 {
-	fstr_copy((struct fstr *) arg, value);
-	return regstore_err_ok;
+	struct interned *entry = (void *) (fstr_get(s) - offsetof(struct interned, text));
+	if (--entry->refs == 0) {
+		binary_tree_remove(entry->table, s, sizeof(*s));
+		free(entry);
+	}
+	fstr_init(s);
 }
 
-static void observer(void *arg, const struct fstr *value)
+static void destroy_interned(void *p, size_t len)
 {
-	printf(" * Observer: " PRIfs " = " PRIfs "\n", prifs((struct fstr *) arg), prifs(value));
+	(void) len;
+	unintern(p);
 }
 
-static void list_regs()
+static void destroy_reg(void *p, size_t len)
 {
-	printf("Listing registers\n");
-
-	for (size_t i = 0; i < nregs; i++) {
-		struct testreg *r = &regs[i];
-		printf(" * " PRIfs " = " PRIfs "\n", prifs(&r->k), prifs(&r->v));
+	(void) len;
+	struct reg *reg = p;
+	reg_unlink(reg);
+	if (reg->sample_period_ms > 0) {
+		sampled_remove(reg);
+	}
+	if (reg->export_slot != NO_SLOT) {
+		export_write(reg->inst->exported, reg->export_slot, NULL);
+	}
+	fstr_destroy(&reg->sample_last);
+	stats_release(reg->stats);
+	if (reg->stat_source) {
+		fstr_destroy(&reg->stat_source->key);
+		free(reg->stat_source);
 	}
+	binary_tree_each(&reg->observers, unindex_iter, reg);
+	binary_tree_each(&reg->typed_observers, unindex_iter, reg);
+	if (reg->handle) {
+		reg->handle->reg = NULL;
+		regstore_release(reg->handle);
+	}
+	fstr_destroy(&reg->name);
+	fstr_destroy(&reg->cache_value);
+	binary_tree_destroy(&reg->observers);
+	binary_tree_destroy(&reg->typed_observers);
+}
 
-	printf("\n");
+static void destroy_observer(void *p, size_t len)
+{
+	(void) len;
+	struct observer *obs = p;
+	if (obs->deadline != NO_DEADLINE) {
+		deadline_remove(obs->inst, obs);
+	}
+	unintern(&obs->remote);
+	fstr_destroy(&obs->pending);
 }
 
-static void list_regs_ext(struct regstore *rs)
+static void destroy_typed_sub(void *p, size_t len)
 {
-	printf("Listing registers\n");
+	(void) len;
+	struct typed_sub *sub = p;
+	unintern(&sub->remote);
+}
 
-	struct binary_tree data;
-	regstore_list(rs, &data, &rem, true);
+static void destroy_fstr(void *p, size_t len)
+{
+	(void) len;
+	fstr_destroy(p);
+}
 
-	const struct regstore_reginfo *info;
-	struct binary_tree_iterator it;
-	binary_tree_iter_init(&it, &data, false);
-	while ((info = binary_tree_iter_next(&it, NULL))) {
-		printf(" * " PRIfs " [%c%c]%s = " PRIfs "\n", prifs(&info->name), info->type & rt_readable ? 'r' : '-', info->type & rt_writeable ? 'w' : '-', info->subscribed ? " [sub]" : "", prifs(&info->value));
+static void free_changes(struct regstore_change *changes, size_t count)
+{
+	for (size_t i = 0; i < count; i++) {
+		fstr_destroy(&changes[i].key);
+		fstr_destroy(&changes[i].value);
 	}
-	binary_tree_iter_destroy(&it);
-
-	binary_tree_destroy(&data);
+	free(changes);
+}
 
-	printf("\n");
+static void destroy_remote_subs(void *p, size_t len)
+{
+	(void) len;
+	struct remote_subs *subs = p;
+	unintern(&subs->remote);
+	binary_tree_destroy(&subs->regs);
+	binary_tree_destroy(&subs->patterns);
+	free_changes(subs->pending, subs->npending);
+	binary_tree_destroy(&subs->pending_index);
+}
+
+static void destroy_reginfo(void *p, size_t len)
+{
+	(void) len;
+	struct regstore_reginfo *info = p;
+	fstr_destroy(&info->name);
+	fstr_destroy(&info->value);
+}
+
+/* Typed registers' getters and setters are timed by call_typed_getter/setter */
+static enum regstore_err invoke_getter(struct reg *reg, struct fstr *value)
+{
+	if (!reg->stats || reg->type != regstore_type_string) {
+		return reg->getter(reg->getter_arg, value);
+	}
+	uint64_t start = now_ns();
+	enum regstore_err res = reg->getter(reg->getter_arg, value);
+	stats_count(&reg->stats->gets);
+	histogram_record(&reg->stats->get_us, start);
+	return res;
+}
+
+static enum regstore_err invoke_setter(struct reg *reg, const struct fstr *value)
+{
+	if (!reg->stats || reg->type != regstore_type_string) {
+		return reg->setter(reg->setter_arg, value);
+	}
+	uint64_t start = now_ns();
+	enum regstore_err res = reg->setter(reg->setter_arg, value);
+	stats_count(&reg->stats->sets);
+	histogram_record(&reg->stats->set_us, start);
+	return res;
+}
+
+/* Served from the cache while it is fresh */
+static enum regstore_err call_getter(struct reg *reg, struct fstr *value)
+{
+	if (!reg->getter) {
+		return regstore_err_not_readable;
+	}
+	if (reg->cache_max_age_ms <= 0) {
+		return invoke_getter(reg, value);
+	}
+	/* Readers of a concurrent store share the cache, and wait for a fetch in progress */
+	struct regstore *inst = reg->inst;
+	if (inst->concurrent) {
+		pthread_mutex_lock(&inst->cache_lock);
+		while (reg->cache_fetching) {
+			pthread_cond_wait(&inst->cache_fetched, &inst->cache_lock);
+		}
+	}
+	int64_t now = now_ms();
+	if (reg->cache_valid && now - reg->cache_time_ms < reg->cache_max_age_ms) {
+		reg->cache_hits++;
+		fstr_copy(value, &reg->cache_value);
+		if (inst->concurrent) {
+			pthread_mutex_unlock(&inst->cache_lock);
+		}
+		return regstore_err_ok;
+	}
+	reg->cache_misses++;
+	if (inst->concurrent) {
+		reg->cache_fetching = true;
+		pthread_mutex_unlock(&inst->cache_lock);
+	}
+	enum regstore_err res = invoke_getter(reg, value);
+	if (inst->concurrent) {
+		pthread_mutex_lock(&inst->cache_lock);
+		reg->cache_fetching = false;
+	}
+	reg->cache_valid = res == regstore_err_ok;
+	if (reg->cache_valid) {
+		reg->cache_time_ms = now;
+		fstr_copy(&reg->cache_value, value);
+	}
+	if (inst->concurrent) {
+		pthread_cond_broadcast(&inst->cache_fetched);
+		pthread_mutex_unlock(&inst->cache_lock);
+	}
+	return res;
+}
+
+static enum regstore_err call_setter(struct reg *reg, const struct fstr *value)
+{
+	if (!reg->setter) {
+		return regstore_err_not_writeable;
+	}
+	/* Whether or not it succeeds, the cached value may now be wrong */
+	reg->cache_valid = false;
+	return invoke_setter(reg, value);
+}
+
+/* Format into buf (VALUE_TEXT_MAX bytes), text refers to it */
+static void value_format(const struct regstore_value *value, char *buf, struct fstr *text)
+{
+	static const char digits[] = "0123456789abcdef";
+	switch (value->type) {
+	case regstore_type_int: snprintf(buf, VALUE_TEXT_MAX, "%" PRId64, value->i); break;
+	case regstore_type_uint: snprintf(buf, VALUE_TEXT_MAX, "%" PRIu64, value->u); break;
+	case regstore_type_float: snprintf(buf, VALUE_TEXT_MAX, "%.17g", value->f); break;
+	case regstore_type_blob:
+		for (size_t i = 0; i < value->blob.len; i++) {
+			buf[i * 2] = digits[value->blob.data[i] >> 4];
+			buf[i * 2 + 1] = digits[value->blob.data[i] & 0xf];
+		}
+		buf[value->blob.len * 2] = 0;
+		break;
+	default: buf[0] = 0; break;
+	}
+	fstr_init_ref(text, buf);
+}
+
+static int hex_digit(char c)
+{
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	} else if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	} else if (c >= 'A' && c <= 'F') {
+		return c - 'A' + 10;
+	}
+	return -1;
+}
+
+static bool value_parse(enum regstore_type type, const struct fstr *text, struct regstore_value *value)
+{
+	size_t len = fstr_len(text);
+	if (len == 0 || len >= VALUE_TEXT_MAX) {
+		return false;
+	}
+	char buf[VALUE_TEXT_MAX];
+	memcpy(buf, fstr_get(text), len);
+	buf[len] = 0;
+	char *end = buf;
+	value->type = type;
+	errno = 0;
+	switch (type) {
+	case regstore_type_int: value->i = strtoll(buf, &end, 10); break;
+	case regstore_type_uint:
+		if (buf[0] == '-') {
+			return false;
+		}
+		value->u = strtoull(buf, &end, 10);
+		break;
+	case regstore_type_float: value->f = strtod(buf, &end); break;
+	case regstore_type_blob:
+		if (len % 2) {
+			return false;
+		}
+		value->blob.len = len / 2;
+		for (size_t i = 0; i < len; i += 2) {
+			int hi = hex_digit(buf[i]);
+			int lo = hex_digit(buf[i + 1]);
+			if (hi < 0 || lo < 0) {
+				return false;
+			}
+			value->blob.data[i / 2] = hi << 4 | lo;
+		}
+		end = buf + len;
+		break;
+	default: return false;
+	}
+	return errno == 0 && *end == 0;
+}
+
+/* Blobs longer than REGSTORE_BLOB_MAX would overrun the text buffer when formatted */
+static bool value_valid(const struct regstore_value *value)
+{
+	return value->type != regstore_type_blob || value->blob.len <= REGSTORE_BLOB_MAX;
+}
+
+static enum regstore_err call_typed_getter(const struct reg *reg, struct regstore_value *value)
+{
+	if (reg->type == regstore_type_string) {
+		return regstore_err_invalid_value;
+	}
+	if (!reg->typed_getter) {
+		return regstore_err_not_readable;
+	}
+	value->type = reg->type;
+	enum regstore_err res;
+	if (!reg->stats) {
+		res = reg->typed_getter(reg->typed_getter_arg, value);
+	} else {
+		uint64_t start = now_ns();
+		res = reg->typed_getter(reg->typed_getter_arg, value);
+		stats_count(&reg->stats->gets);
+		histogram_record(&reg->stats->get_us, start);
+	}
+	return res == regstore_err_ok && !value_valid(value) ? regstore_err_invalid_value : res;
+}
+
+static enum regstore_err call_typed_setter(struct reg *reg, const struct regstore_value *value)
+{
+	if (reg->type == regstore_type_string || value->type != reg->type || !value_valid(value)) {
+		return regstore_err_invalid_value;
+	}
+	if (!reg->typed_setter) {
+		return regstore_err_not_writeable;
+	}
+	reg->cache_valid = false;
+	if (!reg->stats) {
+		return reg->typed_setter(reg->typed_setter_arg, value);
+	}
+	uint64_t start = now_ns();
+	enum regstore_err res = reg->typed_setter(reg->typed_setter_arg, value);
+	stats_count(&reg->stats->sets);
+	histogram_record(&reg->stats->set_us, start);
+	return res;
+}
+
+/* String getter/setter of typed registers */
+static enum regstore_err typed_text_getter(void *arg, struct fstr *value)
+{
+	struct regstore_value v;
+	enum regstore_err err = call_typed_getter(arg, &v);
+	if (err == regstore_err_ok) {
+		char buf[VALUE_TEXT_MAX];
+		struct fstr text;
+		value_format(&v, buf, &text);
+		fstr_copy(value, &text);
+	}
+	return err;
+}
+
+static enum regstore_err typed_text_setter(void *arg, const struct fstr *value)
+{
+	struct reg *reg = arg;
+	struct regstore_value v;
+	if (!value_parse(reg->type, value, &v)) {
+		return regstore_err_invalid_value;
+	}
+	return call_typed_setter(reg, &v);
+}
+
+static void call_observer(const struct observer *obs, const struct fstr *value)
+{
+	struct reg_stats *stats = obs->reg->stats;
+	if (obs->inst->concurrent) {
+		struct deferred_call *call = defer(obs->inst, obs->observer_arg);
+		call->kind = deferred_observer;
+		call->fn.observer = obs->observer;
+		fstr_copy(&call->value, value);
+		call->stats = stats_acquire(stats);
+		return;
+	}
+	uint64_t start = stats ? now_ns() : 0;
+	obs->observer(obs->observer_arg, value);
+	if (stats) {
+		histogram_record(&stats->observer_us, start);
+	}
+}
+
+static void pattern_notify(struct regstore *inst, const struct fstr *key, const struct fstr *value);
+static bool pattern_matches(struct regstore *inst, const struct fstr *key);
+static bool pattern_node_empty(const struct pattern_node *node);
+
+/* FNV-1a */
+static uint64_t value_hash(const char *s, size_t len)
+{
+	uint64_t h = 14695981039346656037ULL;
+	for (size_t i = 0; i < len; i++) {
+		h = (h ^ (unsigned char) s[i]) * 1099511628211ULL;
+	}
+	return h;
+}
+
+/* Record value as the register's last, returns false if it matches the previous one */
+static bool reg_fingerprint(struct reg *reg, const struct fstr *value)
+{
+	const char *s = fstr_get(value);
+	size_t len = fstr_len(value);
+	bool verbatim = len <= MAX_VERBATIM;
+	uint64_t h = verbatim ? 0 : value_hash(s, len);
+	if (reg->notified && reg->last_len == len && (verbatim ? memcmp(reg->last.verbatim, s, len) == 0 : reg->last.hash == h)) {
+		return false;
+	}
+	reg->notified = true;
+	reg->last_len = len;
+	if (verbatim) {
+		memcpy(reg->last.verbatim, s, len);
+	} else {
+		reg->last.hash = h;
+	}
+	return true;
+}
+
+static bool batch_queue(struct regstore *inst, const struct fstr *remote, const struct fstr *key, const struct fstr *value);
+
+struct notification_closure {
+	const struct fstr *key;
+	const struct fstr *value;
+	int64_t now;
+	struct reg_stats *stats;
+};
+
+static void *send_notification_iter(void *arg, struct binary_tree_node *node)
+{
+	const struct notification_closure *closure = arg;
+	struct observer *obs = (void *) node->data;
+	if (batch_queue(obs->inst, &obs->remote, closure->key, closure->value)) {
+		return NULL;
+	}
+	if (obs->info.next_ms <= closure->now) {
+		obs->info.next_ms = closure->now + obs->info.min_interval_ms;
+		/* Superseded by this value */
+		if (obs->deadline != NO_DEADLINE) {
+			deadline_remove(obs->inst, obs);
+		}
+		call_observer(obs, closure->value);
+	} else {
+		if (closure->stats) {
+			stats_count(&closure->stats->rate_limited);
+		}
+		fstr_copy(&obs->pending, closure->value);
+		if (obs->deadline == NO_DEADLINE) {
+			deadline_push(obs->inst, obs);
+		}
+	}
+	return NULL;
+}
+
+static void *first_iter(void *arg, struct binary_tree_node *node)
+{
+	(void) arg;
+	return node;
+}
+
+static bool tree_empty(struct binary_tree *tree)
+{
+	return binary_tree_each(tree, first_iter, NULL) == NULL;
+}
+
+struct typed_notification_closure {
+	struct regstore *inst;
+	const struct regstore_value *value;
+	struct reg_stats *stats;
+};
+
+static void *typed_notification_iter(void *arg, struct binary_tree_node *node)
+{
+	const struct typed_notification_closure *closure = arg;
+	const struct typed_sub *sub = (void *) node->data;
+	if (closure->inst->concurrent) {
+		struct deferred_call *call = defer(closure->inst, sub->observer_arg);
+		call->kind = deferred_typed;
+		call->fn.typed = sub->observer;
+		call->typed = *closure->value;
+		call->stats = stats_acquire(closure->stats);
+		return NULL;
+	}
+	uint64_t start = closure->stats ? now_ns() : 0;
+	sub->observer(sub->observer_arg, closure->value);
+	if (closure->stats) {
+		histogram_record(&closure->stats->observer_us, start);
+	}
+	return NULL;
+}
+
+/* Deliver to string observers and pattern subscriptions */
+static void deliver(struct reg *reg, const struct fstr *value)
+{
+	struct notification_closure closure = {
+		.key = &reg->name,
+		.value = value,
+		.now = now_ms(),
+		.stats = reg->stats
+	};
+	binary_tree_each(&reg->observers, send_notification_iter, &closure);
+	pattern_notify(reg->inst, &reg->name, value);
+}
+
+static void send_notification(struct reg *reg, const struct fstr *value)
+{
+	if (reg->suppress && !reg_fingerprint(reg, value)) {
+		return;
+	}
+	if (reg->stats) {
+		stats_count(&reg->stats->notifies);
+	}
+	reg_touch(reg);
+	if (reg->inst->journal) {
+		journal_write(reg->inst->journal, reg->version, &reg->name, value);
+	}
+	if (reg->export_slot != NO_SLOT) {
+		export_write(reg->inst->exported, reg->export_slot, value);
+	}
+	deliver(reg, value);
+	struct regstore_value v;
+	if (reg->type != regstore_type_string && !tree_empty(&reg->typed_observers) && value_parse(reg->type, value, &v)) {
+		struct typed_notification_closure closure = {
+			.inst = reg->inst,
+			.value = &v,
+			.stats = reg->stats
+		};
+		binary_tree_each(&reg->typed_observers, typed_notification_iter, &closure);
+	}
+}
+
+/* Text is only formatted if something other than typed observers needs it */
+static void send_typed_notification(struct reg *reg, const struct regstore_value *value)
+{
+	struct regstore_journal *journal = reg->inst->journal;
+	bool exported = reg->export_slot != NO_SLOT;
+	bool text = reg->suppress || !tree_empty(&reg->observers) || (!pattern_node_empty(reg->inst->patterns) && pattern_matches(reg->inst, &reg->name));
+	char buf[VALUE_TEXT_MAX];
+	struct fstr str;
+	if (text || journal || exported) {
+		value_format(value, buf, &str);
+		if (reg->suppress && !reg_fingerprint(reg, &str)) {
+			return;
+		}
+	}
+	if (reg->stats) {
+		stats_count(&reg->stats->notifies);
+	}
+	reg_touch(reg);
+	if (journal) {
+		journal_write(journal, reg->version, &reg->name, &str);
+	}
+	if (exported) {
+		export_write(reg->inst->exported, reg->export_slot, &str);
+	}
+	if (text) {
+		deliver(reg, &str);
+	}
+	struct typed_notification_closure closure = {
+		.inst = reg->inst,
+		.value = value,
+		.stats = reg->stats
+	};
+	binary_tree_each(&reg->typed_observers, typed_notification_iter, &closure);
+}
+
+static int first_fstr_cmp(const void *a, size_t al, const void *b, size_t bl, void *arg)
+{
+	(void) al;
+	(void) bl;
+	(void) arg;
+	const struct fstr *ra = a;
+	const struct fstr *rb = b;
+	/* Interned strings are equal if they share text */
+	if (fstr_get(ra) == fstr_get(rb) && fstr_len(ra) == fstr_len(rb)) {
+		return 0;
+	}
+	return fstr_cmp(ra, rb);
+
+}
+
+/*
+ * Prefix index: radix tree over key bytes.  Children are sorted by the first
+ * byte of their label, so a depth-first walk visits keys in fstr_cmp order
+ * and a prefix's registers form one subtree.
+ */
+struct prefix_node {
+	struct reg *reg; /* Register whose key ends here, if any */
+	struct prefix_node **children;
+	size_t nchildren;
+	size_t label_len;
+	char label[]; /* Key bytes on the edge from the parent */
+};
+
+static struct prefix_node *prefix_node_new(const char *label, size_t len)
+{
+	struct prefix_node *node = malloc(sizeof(*node) + len);
+	node->reg = NULL;
+	node->children = NULL;
+	node->nchildren = 0;
+	node->label_len = len;
+	memcpy(node->label, label, len);
+	return node;
+}
+
+static void prefix_node_free(struct prefix_node *node)
+{
+	for (size_t i = 0; i < node->nchildren; i++) {
+		prefix_node_free(node->children[i]);
+	}
+	free(node->children);
+	free(node);
+}
+
+/* Binary search children by first byte, *idx is the match or insert point */
+static bool prefix_child(const struct prefix_node *node, char c, size_t *idx)
+{
+	size_t lo = 0;
+	size_t hi = node->nchildren;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		unsigned char m = node->children[mid]->label[0];
+		if (m == (unsigned char) c) {
+			*idx = mid;
+			return true;
+		} else if (m < (unsigned char) c) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	*idx = lo;
+	return false;
+}
+
+static void prefix_child_insert(struct prefix_node *node, size_t idx, struct prefix_node *child)
+{
+	node->children = realloc(node->children, (node->nchildren + 1) * sizeof(*node->children));
+	memmove(&node->children[idx + 1], &node->children[idx], (node->nchildren - idx) * sizeof(*node->children));
+	node->children[idx] = child;
+	node->nchildren++;
+}
+
+static void prefix_insert(struct prefix_node *node, const char *key, size_t len, struct reg *reg)
+{
+	while (len) {
+		size_t idx;
+		if (!prefix_child(node, key[0], &idx)) {
+			struct prefix_node *leaf = prefix_node_new(key, len);
+			leaf->reg = reg;
+			prefix_child_insert(node, idx, leaf);
+			return;
+		}
+		struct prefix_node *child = node->children[idx];
+		size_t common = 1;
+		while (common < child->label_len && common < len && child->label[common] == key[common]) {
+			common++;
+		}
+		if (common < child->label_len) {
+			/* Split the edge, the remainder keeps the child's subtree */
+			struct prefix_node *mid = prefix_node_new(child->label, common);
+			struct prefix_node *rest = prefix_node_new(child->label + common, child->label_len - common);
+			rest->reg = child->reg;
+			rest->children = child->children;
+			rest->nchildren = child->nchildren;
+			free(child);
+			mid->children = malloc(sizeof(*mid->children));
+			mid->children[0] = rest;
+			mid->nchildren = 1;
+			node->children[idx] = mid;
+			child = mid;
+		}
+		node = child;
+		key += common;
+		len -= common;
+	}
+	node->reg = reg;
+}
+
+/* Returns true if the node is left empty, for its parent to free */
+static bool prefix_remove(struct prefix_node *node, const char *key, size_t len)
+{
+	if (!len) {
+		node->reg = NULL;
+	} else {
+		size_t idx;
+		if (!prefix_child(node, key[0], &idx)) {
+			return false;
+		}
+		struct prefix_node *child = node->children[idx];
+		if (child->label_len > len || memcmp(child->label, key, child->label_len) != 0) {
+			return false;
+		}
+		if (prefix_remove(child, key + child->label_len, len - child->label_len)) {
+			prefix_node_free(child);
+			memmove(&node->children[idx], &node->children[idx + 1], (--node->nchildren - idx) * sizeof(*node->children));
+		}
+	}
+	return !node->reg && !node->nchildren;
+}
+
+struct prefix_walk {
+	char *path; /* Key bytes down to the current node */
+	size_t len;
+	size_t cap;
+	const struct fstr *cursor; /* Only visit keys after this, if set */
+	void *(*func)(void *arg, struct reg *reg);
+	void *arg;
+};
+
+static void prefix_walk_push(struct prefix_walk *w, const struct prefix_node *node)
+{
+	if (w->len + node->label_len > w->cap) {
+		w->cap = (w->len + node->label_len) * 2;
+		w->path = realloc(w->path, w->cap);
+	}
+	memcpy(w->path + w->len, node->label, node->label_len);
+	w->len += node->label_len;
+}
+
+/* Find the subtree holding all keys starting with prefix, path left at its root */
+static struct prefix_node *prefix_find(struct prefix_node *node, struct prefix_walk *w, const char *key, size_t len)
+{
+	while (len) {
+		size_t idx;
+		if (!prefix_child(node, key[0], &idx)) {
+			return NULL;
+		}
+		node = node->children[idx];
+		size_t n = node->label_len < len ? node->label_len : len;
+		if (memcmp(node->label, key, n) != 0) {
+			return NULL;
+		}
+		prefix_walk_push(w, node);
+		key += n;
+		len -= n;
+	}
+	return node;
+}
+
+/*
+ * Visit the subtree in key order, skipping whole subtrees which sort before
+ * the cursor.  past is set once every key below sorts after the cursor.
+ */
+static void *prefix_walk_node(struct prefix_node *node, struct prefix_walk *w, bool past)
+{
+	if (!past) {
+		size_t clen = fstr_len(w->cursor);
+		size_t n = w->len < clen ? w->len : clen;
+		int cmp = n ? memcmp(w->path, fstr_get(w->cursor), n) : 0;
+		if (cmp < 0) {
+			return NULL;
+		}
+		past = cmp > 0 || w->len > clen;
+	}
+	void *res;
+	if (node->reg && past && (res = w->func(w->arg, node->reg))) {
+		return res;
+	}
+	for (size_t i = 0; i < node->nchildren; i++) {
+		struct prefix_node *child = node->children[i];
+		size_t len = w->len;
+		prefix_walk_push(w, child);
+		res = prefix_walk_node(child, w, past);
+		w->len = len;
+		if (res) {
+			return res;
+		}
+	}
+	return NULL;
+}
+
+/* Call func for each register with the prefix (may be NULL) after cursor (may be NULL) */
+static void *prefix_each(struct regstore *inst, const struct fstr *prefix, const struct fstr *cursor, void *(*func)(void *arg, struct reg *reg), void *arg)
+{
+	struct prefix_walk w = {
+		.path = NULL,
+		.len = 0,
+		.cap = 0,
+		.cursor = cursor,
+		.func = func,
+		.arg = arg
+	};
+	void *res = NULL;
+	struct prefix_node *node = prefix ? prefix_find(inst->prefixes, &w, fstr_get(prefix), fstr_len(prefix)) : inst->prefixes;
+	if (node) {
+		res = prefix_walk_node(node, &w, cursor == NULL);
+	}
+	free(w.path);
+	return res;
+}
+
+/*
+ * Pattern index: trie over dot-separated segments of subscribed patterns.
+ * "*" segments share one child per node, and a final "**" subscribes at the
+ * node itself, so a key is matched by one walk down its segments.
+ */
+struct pattern_sub {
+	struct fstr remote;
+	regstore_pattern_observer *observer;
+	void *observer_arg;
+};
+
+struct pattern_node {
+	struct pattern_node **children; /* Sorted by segment */
+	size_t nchildren;
+	struct pattern_node *any; /* "*" */
+	struct binary_tree here; /* pattern_sub(remote) of patterns ending here */
+	struct binary_tree rest; /* pattern_sub(remote) of patterns ending "**" here */
+	size_t subs; /* Count of here and rest */
+	size_t seg_len;
+	char seg[];
+};
+
+struct pattern_closure {
+	struct regstore *inst;
+	const struct fstr *key;
+	const struct fstr *value;
+	bool *matched; /* Only record whether any pattern matches, if set */
+};
+
+static void destroy_pattern_sub(void *p, size_t len)
+{
+	(void) len;
+	struct pattern_sub *sub = p;
+	unintern(&sub->remote);
+}
+
+static struct pattern_node *pattern_node_new(const char *seg, size_t len)
+{
+	struct pattern_node *node = malloc(sizeof(*node) + len);
+	node->children = NULL;
+	node->nchildren = 0;
+	node->any = NULL;
+	binary_tree_init(&node->here, first_fstr_cmp, NULL, destroy_pattern_sub);
+	binary_tree_init(&node->rest, first_fstr_cmp, NULL, destroy_pattern_sub);
+	node->subs = 0;
+	node->seg_len = len;
+	memcpy(node->seg, seg, len);
+	return node;
+}
+
+static void pattern_node_free(struct pattern_node *node)
+{
+	for (size_t i = 0; i < node->nchildren; i++) {
+		pattern_node_free(node->children[i]);
+	}
+	if (node->any) {
+		pattern_node_free(node->any);
+	}
+	free(node->children);
+	binary_tree_destroy(&node->here);
+	binary_tree_destroy(&node->rest);
+	free(node);
+}
+
+static bool pattern_node_empty(const struct pattern_node *node)
+{
+	return !node->subs && !node->nchildren && !node->any;
+}
+
+/* Length of the segment at the start of s */
+static size_t pattern_seg(const char *s, size_t len)
+{
+	const char *dot = memchr(s, '.', len);
+	return dot ? (size_t) (dot - s) : len;
+}
+
+/* Binary search children by segment, *idx is the match or insert point */
+static bool pattern_child(const struct pattern_node *node, const char *seg, size_t len, size_t *idx)
+{
+	size_t lo = 0;
+	size_t hi = node->nchildren;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		const struct pattern_node *child = node->children[mid];
+		size_t n = child->seg_len < len ? child->seg_len : len;
+		int cmp = n ? memcmp(child->seg, seg, n) : 0;
+		if (!cmp) {
+			cmp = (child->seg_len > len) - (child->seg_len < len);
+		}
+		if (!cmp) {
+			*idx = mid;
+			return true;
+		} else if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	*idx = lo;
+	return false;
+}
+
+static void *pattern_notify_iter(void *arg, struct binary_tree_node *node)
+{
+	const struct pattern_closure *closure = arg;
+	const struct pattern_sub *sub = (void *) node->data;
+	if (closure->matched) {
+		*closure->matched = true;
+		return (void *) 1;
+	}
+	if (batch_queue(closure->inst, &sub->remote, closure->key, closure->value)) {
+		return NULL;
+	}
+	if (closure->inst->concurrent) {
+		struct deferred_call *call = defer(closure->inst, sub->observer_arg);
+		call->kind = deferred_pattern;
+		call->fn.pattern = sub->observer;
+		fstr_copy(&call->key, closure->key);
+		fstr_copy(&call->value, closure->value);
+		return NULL;
+	}
+	sub->observer(sub->observer_arg, closure->key, closure->value);
+	return NULL;
+}
+
+/* Notify subscriptions matching the rest of the key, done once all segments are consumed */
+static void pattern_match(struct pattern_node *node, const char *key, size_t len, bool done, struct pattern_closure *closure)
+{
+	binary_tree_each(&node->rest, pattern_notify_iter, closure);
+	if (done) {
+		binary_tree_each(&node->here, pattern_notify_iter, closure);
+		return;
+	}
+	size_t n = pattern_seg(key, len);
+	bool last = n == len;
+	size_t skip = last ? n : n + 1;
+	size_t idx;
+	if (pattern_child(node, key, n, &idx)) {
+		pattern_match(node->children[idx], key + skip, len - skip, last, closure);
+	}
+	if (node->any) {
+		pattern_match(node->any, key + skip, len - skip, last, closure);
+	}
+}
+
+static void pattern_notify(struct regstore *inst, const struct fstr *key, const struct fstr *value)
+{
+	struct pattern_closure closure = {
+		.inst = inst,
+		.key = key,
+		.value = value
+	};
+	pattern_match(inst->patterns, fstr_get(key), fstr_len(key), false, &closure);
+}
+
+static bool pattern_matches(struct regstore *inst, const struct fstr *key)
+{
+	bool matched = false;
+	struct pattern_closure closure = {
+		.inst = inst,
+		.key = key,
+		.matched = &matched
+	};
+	pattern_match(inst->patterns, fstr_get(key), fstr_len(key), false, &closure);
+	return matched;
+}
+
+static bool pattern_is(const char *seg, size_t len, const char *wildcard)
+{
+	return len == strlen(wildcard) && memcmp(seg, wildcard, len) == 0;
+}
+
+/* Returns true if the node is left empty, for its parent to free */
+static bool pattern_remove(struct pattern_node *node, const char *pattern, size_t len, const struct fstr *remote, bool *removed)
+{
+	size_t n = pattern_seg(pattern, len);
+	bool last = n == len;
+	if (last && pattern_is(pattern, n, "**")) {
+		if (binary_tree_remove(&node->rest, remote, sizeof(*remote))) {
+			node->subs--;
+			*removed = true;
+		}
+		return pattern_node_empty(node);
+	}
+	bool any = pattern_is(pattern, n, "*");
+	size_t idx = 0;
+	struct pattern_node *child = node->any;
+	if (!any) {
+		child = pattern_child(node, pattern, n, &idx) ? node->children[idx] : NULL;
+	}
+	if (!child) {
+		return pattern_node_empty(node);
+	}
+	if (last) {
+		if (binary_tree_remove(&child->here, remote, sizeof(*remote))) {
+			child->subs--;
+			*removed = true;
+		}
+	} else {
+		pattern_remove(child, pattern + n + 1, len - n - 1, remote, removed);
+	}
+	if (pattern_node_empty(child)) {
+		pattern_node_free(child);
+		if (any) {
+			node->any = NULL;
+		} else {
+			memmove(&node->children[idx], &node->children[idx + 1], (--node->nchildren - idx) * sizeof(*node->children));
+		}
+	}
+	return pattern_node_empty(node);
+}
+
+static int reg_ptr_cmp(const void *a, size_t al, const void *b, size_t bl, void *arg)
+{
+	(void) al;
+	(void) bl;
+	(void) arg;
+	const struct reg *ra = *(struct reg * const *) a;
+	const struct reg *rb = *(struct reg * const *) b;
+	return fstr_cmp(&ra->name, &rb->name);
+}
+
+static struct remote_subs *remote_subs_get(struct regstore *inst, const struct fstr *remote, bool create)
+{
+	struct remote_subs *subs = binary_tree_get(&inst->remotes, remote, sizeof(*remote), NULL);
+	if (subs || !create) {
+		return subs;
+	}
+	struct remote_subs new_subs;
+	new_subs.inst = inst;
+	intern(inst, &new_subs.remote, remote);
+	binary_tree_init(&new_subs.regs, reg_ptr_cmp, NULL, NULL);
+	binary_tree_init(&new_subs.patterns, first_fstr_cmp, NULL, destroy_interned);
+	new_subs.batch = NULL;
+	new_subs.pending = NULL;
+	new_subs.npending = 0;
+	new_subs.pending_cap = 0;
+	binary_tree_init(&new_subs.pending_index, first_fstr_cmp, NULL, destroy_fstr);
+	binary_tree_insert(&inst->remotes, &new_subs, sizeof(new_subs), NULL);
+	return binary_tree_get(&inst->remotes, remote, sizeof(*remote), NULL);
+}
+
+/* Remove the remote's entry once it subscribes to nothing and is not batched */
+static void remote_subs_prune(struct regstore *inst, struct remote_subs *subs)
+{
+	if (subs->batch || !tree_empty(&subs->regs) || !tree_empty(&subs->patterns)) {
+		return;
+	}
+	/* The entry's own remote is released by the removal */
+	struct fstr remote;
+	intern(inst, &remote, &subs->remote);
+	binary_tree_remove(&inst->remotes, &remote, sizeof(remote));
+	unintern(&remote);
+}
+
+static void remote_index_add(struct regstore *inst, const struct fstr *remote, struct reg *reg)
+{
+	struct remote_subs *subs = remote_subs_get(inst, remote, true);
+	binary_tree_insert(&subs->regs, &reg, sizeof(reg), NULL);
+}
+
+/* Drop reg from remote's index unless (or even if forced) it still has a string or typed observer for it */
+static void remote_index_remove(struct regstore *inst, const struct fstr *remote, struct reg *reg, bool force)
+{
+	if (!force && (binary_tree_get(&reg->observers, remote, sizeof(*remote), NULL) || binary_tree_get(&reg->typed_observers, remote, sizeof(*remote), NULL))) {
+		return;
+	}
+	struct remote_subs *subs = remote_subs_get(inst, remote, false);
+	if (!subs) {
+		return;
+	}
+	binary_tree_remove(&subs->regs, &reg, sizeof(reg));
+	remote_subs_prune(inst, subs);
+}
+
+static void batched_add(struct regstore *inst, const struct fstr *remote)
+{
+	if (inst->batches == inst->batched_cap) {
+		inst->batched_cap = inst->batched_cap ? inst->batched_cap * 2 : 4;
+		inst->batched = realloc(inst->batched, inst->batched_cap * sizeof(*inst->batched));
+	}
+	intern(inst, &inst->batched[inst->batches++], remote);
+}
+
+static void batched_remove(struct regstore *inst, const struct fstr *remote)
+{
+	for (size_t i = 0; i < inst->batches; i++) {
+		if (fstr_cmp(&inst->batched[i], remote) == 0) {
+			unintern(&inst->batched[i]);
+			inst->batched[i] = inst->batched[--inst->batches];
+			return;
+		}
+	}
+}
+
+/* Queue the change if remote is batched, returns false if it is not */
+static bool batch_queue(struct regstore *inst, const struct fstr *remote, const struct fstr *key, const struct fstr *value)
+{
+	if (!inst->batches) {
+		return false;
+	}
+	struct remote_subs *subs = remote_subs_get(inst, remote, false);
+	if (!subs || !subs->batch) {
+		return false;
+	}
+	struct batch_slot *slot = binary_tree_get(&subs->pending_index, key, sizeof(*key), NULL);
+	if (slot) {
+		fstr_copy(&subs->pending[slot->idx].value, value);
+		return true;
+	}
+	if (subs->npending == subs->pending_cap) {
+		subs->pending_cap = subs->pending_cap ? subs->pending_cap * 2 : 16;
+		subs->pending = realloc(subs->pending, subs->pending_cap * sizeof(*subs->pending));
+	}
+	struct regstore_change *change = &subs->pending[subs->npending];
+	fstr_init_copy(&change->key, key);
+	fstr_init_copy(&change->value, value);
+	struct batch_slot new_slot;
+	fstr_init_copy(&new_slot.key, key);
+	new_slot.idx = subs->npending++;
+	binary_tree_insert(&subs->pending_index, &new_slot, sizeof(new_slot), NULL);
+	if (subs->npending == 1 && subs->interval_ms > 0) {
+		subs->due_ms = now_ms() + subs->interval_ms;
+	}
+	return true;
+}
+
+static void batch_flush(struct remote_subs *subs)
+{
+	if (!subs->npending) {
+		return;
+	}
+	/* Taken first, as the observer may set registers and start a new batch */
+	struct regstore_change *changes = subs->pending;
+	size_t count = subs->npending;
+	subs->pending = NULL;
+	subs->npending = 0;
+	subs->pending_cap = 0;
+	binary_tree_destroy(&subs->pending_index);
+	binary_tree_init(&subs->pending_index, first_fstr_cmp, NULL, destroy_fstr);
+	if (subs->inst->concurrent) {
+		struct deferred_call *call = defer(subs->inst, subs->batch_arg);
+		call->kind = deferred_batch;
+		call->fn.batch = subs->batch;
+		call->changes = changes;
+		call->count = count;
+		return;
+	}
+	subs->batch(subs->batch_arg, changes, count);
+	free_changes(changes, count);
+}
+
+/* Flush the batches due by now, returns the wait until the next as store_tick */
+static int64_t batch_tick(struct regstore *inst, int64_t now, int64_t wait)
+{
+	/* Batch observers do not change batching, so the list is stable */
+	for (size_t i = 0; i < inst->batches; i++) {
+		struct remote_subs *subs = remote_subs_get(inst, &inst->batched[i], false);
+		if (!subs->npending || subs->interval_ms <= 0) {
+			continue;
+		}
+		if (subs->due_ms <= now) {
+			batch_flush(subs);
+		} else if (wait < 0 || subs->due_ms - now < wait) {
+			wait = subs->due_ms - now;
+		}
+	}
+	return wait;
+}
+
+/* Fill type and subscription fields of register info */
+static void reginfo_fill(struct regstore_reginfo *info, struct reg *reg, const struct fstr *remote)
+{
+	info->type = (reg->getter ? rt_readable : 0) | (reg->setter ? rt_writeable : 0);
+	struct observer *obs = remote ? binary_tree_get(&reg->observers, remote, sizeof(*remote), NULL) : NULL;
+	info->subscribed = obs != NULL;
+	info->version = reg->version;
+	if (reg->inst->concurrent) {
+		pthread_mutex_lock(&reg->inst->cache_lock);
+	}
+	info->cache_hits = reg->cache_hits;
+	info->cache_misses = reg->cache_misses;
+	if (reg->inst->concurrent) {
+		pthread_mutex_unlock(&reg->inst->cache_lock);
+	}
+	if (obs) {
+		info->sub_info = obs->info;
+	}
+}
+
+struct list_closure {
+	struct binary_tree *out;
+	const struct fstr *remote;
+	bool values;
+	bool subscribed; /* Listing the remote's subscriptions, typed ones included */
+};
+
+static void *list_reg(const struct list_closure *closure, struct reg *reg)
+{
+	struct binary_tree *out = closure->out;
+	const struct fstr *remote = closure->remote;
+	bool values = closure->values;
+
+	struct regstore_reginfo info;
+	fstr_init_copy(&info.name, &reg->name);
+	fstr_init(&info.value);
+
+	if (values && reg->getter) {
+		call_getter(reg, &info.value);
+	}
+
+	reginfo_fill(&info, reg, remote);
+	info.subscribed = info.subscribed || closure->subscribed;
+
+	if (!binary_tree_insert(out, &info, sizeof(info), NULL)) {
+		log_error("Unexpected conflict while building register info tree");
+		return (void *) 1;
+	}
+	return NULL;
+}
+
+void *list_iter(void *arg, struct binary_tree_node *node)
+{
+	return list_reg(arg, (void *) node->data);
+}
+
+static void *list_subscription_iter(void *arg, struct binary_tree_node *node)
+{
+	return list_reg(arg, *(struct reg **) node->data);
+}
+
+static void run_deferred(struct deferred_call *calls, size_t count)
+{
+	for (size_t i = 0; i < count; i++) {
+		struct deferred_call *call = &calls[i];
+		uint64_t start = call->stats ? now_ns() : 0;
+		switch (call->kind) {
+		case deferred_observer: call->fn.observer(call->arg, &call->value); break;
+		case deferred_pattern: call->fn.pattern(call->arg, &call->key, &call->value); break;
+		case deferred_typed: call->fn.typed(call->arg, &call->typed); break;
+		case deferred_batch: call->fn.batch(call->arg, call->changes, call->count); break;
+		}
+		if (call->stats) {
+			histogram_record(&call->stats->observer_us, start);
+			stats_release(call->stats);
+		}
+		fstr_destroy(&call->key);
+		fstr_destroy(&call->value);
+		free_changes(call->changes, call->count);
+	}
+	free(calls);
+}
+
+/* No-ops unless the store is concurrent (inst is NULL for handles of other stores) */
+static bool lock_timed(struct regstore *inst)
+{
+	return atomic_load_explicit(&inst->lock_stats->enabled, memory_order_relaxed);
+}
+
+static void read_lock(struct regstore *inst)
+{
+	if (inst && inst->concurrent) {
+		if (!lock_timed(inst)) {
+			pthread_rwlock_rdlock(&inst->lock);
+			return;
+		}
+		uint64_t start = now_ns();
+		pthread_rwlock_rdlock(&inst->lock);
+		histogram_record(&inst->lock_stats->wait_us, start);
+	}
+}
+
+static void read_unlock(struct regstore *inst)
+{
+	if (inst && inst->concurrent) {
+		pthread_rwlock_unlock(&inst->lock);
+	}
+}
+
+static void write_lock(struct regstore *inst)
+{
+	if (inst && inst->concurrent) {
+		if (!lock_timed(inst)) {
+			pthread_rwlock_wrlock(&inst->lock);
+			return;
+		}
+		uint64_t start = now_ns();
+		pthread_rwlock_wrlock(&inst->lock);
+		histogram_record(&inst->lock_stats->wait_us, start);
+	}
+}
+
+/* Store whose queued calls this thread is making, if any */
+static _Thread_local struct regstore *delivering;
+
+/*
+ * Then make the observer calls queued meanwhile, once those of earlier
+ * writes are made.  If sync, wait for those even if none were queued, so
+ * that observers removed by the write are no longer called.  Writes from
+ * within an observer make their calls at once, as the thread's own turn is
+ * in progress.
+ */
+static void write_unlock_sync(struct regstore *inst, bool sync)
+{
+	if (!inst || !inst->concurrent) {
+		return;
+	}
+	struct deferred_call *calls = inst->deferred;
+	size_t count = inst->deferred_len;
+	inst->deferred = NULL;
+	inst->deferred_len = 0;
+	inst->deferred_cap = 0;
+	if (delivering == inst || (!count && !sync)) {
+		pthread_rwlock_unlock(&inst->lock);
+		run_deferred(calls, count);
+		return;
+	}
+	uint64_t ticket = inst->delivery_next++;
+	pthread_rwlock_unlock(&inst->lock);
+	pthread_mutex_lock(&inst->delivery_lock);
+	while (inst->delivery_turn != ticket) {
+		pthread_cond_wait(&inst->delivery_done, &inst->delivery_lock);
+	}
+	pthread_mutex_unlock(&inst->delivery_lock);
+	struct regstore *outer = delivering;
+	delivering = inst;
+	run_deferred(calls, count);
+	delivering = outer;
+	pthread_mutex_lock(&inst->delivery_lock);
+	inst->delivery_turn++;
+	pthread_cond_broadcast(&inst->delivery_done);
+	pthread_mutex_unlock(&inst->delivery_lock);
+}
+
+static void write_unlock(struct regstore *inst)
+{
+	write_unlock_sync(inst, false);
+}
+
+static bool store_list(struct regstore *inst, struct binary_tree *out, const struct fstr *remote, bool values)
+{
+	struct list_closure closure = {
+		.out = out,
+		.remote = remote,
+		.values = values,
+		.subscribed = false
+	};
+	binary_tree_init(out, first_fstr_cmp, NULL, destroy_reginfo);
+	if (binary_tree_each(&inst->store, list_iter, &closure)) {
+		binary_tree_destroy(out);
+		return false;
+	}
+	return true;
+}
+
+bool regstore_list(struct regstore *inst, struct binary_tree *out, const struct fstr *remote, bool values)
+{
+	read_lock(inst);
+	bool res = store_list(inst, out, remote, values);
+	read_unlock(inst);
+	return res;
+}
+
+struct each_closure {
+	const struct fstr *remote;
+	struct fstr *value; /* Reused for every register, NULL if not reading */
+	regstore_visitor *visitor;
+	void *arg;
+	bool stopped;
+};
+
+static void *each_iter(void *arg, struct reg *reg)
+{
+	struct each_closure *closure = arg;
+
+	struct regstore_reginfo info;
+	info.name = reg->name;
+	fstr_init(&info.value);
+	if (closure->value && reg->getter && call_getter(reg, closure->value) == regstore_err_ok) {
+		info.value = *closure->value;
+	}
+	reginfo_fill(&info, reg, closure->remote);
+
+	if (!closure->visitor(closure->arg, &info)) {
+		closure->stopped = true;
+		return (void *) 1;
+	}
+	return NULL;
+}
+
+static bool store_each(struct regstore *inst, const struct fstr *prefix, const struct fstr *cursor, const struct fstr *remote, bool values, regstore_visitor *visitor, void *arg)
+{
+	struct fstr value;
+	fstr_init(&value);
+	struct each_closure closure = {
+		.remote = remote,
+		.value = values ? &value : NULL,
+		.visitor = visitor,
+		.arg = arg,
+		.stopped = false
+	};
+	prefix_each(inst, prefix, cursor, each_iter, &closure);
+	fstr_destroy(&value);
+	return !closure.stopped;
+}
+
+bool regstore_each(struct regstore *inst, const struct fstr *prefix, const struct fstr *cursor, const struct fstr *remote, bool values, regstore_visitor *visitor, void *arg)
+{
+	read_lock(inst);
+	bool res = store_each(inst, prefix, cursor, remote, values, visitor, arg);
+	read_unlock(inst);
+	return res;
+}
+
+static void store_journal_enable(struct regstore *inst, size_t capacity, size_t record_size)
+{
+	journal_release(inst->journal);
+	inst->journal = capacity ? journal_new(capacity, record_size) : NULL;
+}
+
+void regstore_journal_enable(struct regstore *inst, size_t capacity, size_t record_size)
+{
+	write_lock(inst);
+	store_journal_enable(inst, capacity, record_size);
+	write_unlock(inst);
+}
+
+static void journal_cursor(struct regstore *inst, struct regstore_journal_cursor *cursor, bool replay)
+{
+	struct regstore_journal *j = inst->journal;
+	cursor->journal = j;
+	cursor->pos = 0;
+	cursor->lost = 0;
+	cursor->buf = NULL;
+	if (!j) {
+		return;
+	}
+	atomic_fetch_add(&j->refs, 1);
+	cursor->buf = malloc(j->words * sizeof(uint64_t) + 2);
+	uint64_t head = atomic_load_explicit(&j->head, memory_order_relaxed);
+	if (!replay) {
+		cursor->pos = head;
+	} else if (head > j->capacity) {
+		cursor->pos = head - j->capacity;
+	}
+}
+
+void regstore_journal_replay(struct regstore *inst, struct regstore_journal_cursor *cursor)
+{
+	read_lock(inst);
+	journal_cursor(inst, cursor, true);
+	read_unlock(inst);
+}
+
+void regstore_journal_tail(struct regstore *inst, struct regstore_journal_cursor *cursor)
+{
+	read_lock(inst);
+	journal_cursor(inst, cursor, false);
+	read_unlock(inst);
+}
+
+bool regstore_journal_next(struct regstore_journal_cursor *cursor, struct regstore_journal_record *rec)
+{
+	struct regstore_journal *j = cursor->journal;
+	if (!j) {
+		return false;
+	}
+	for (;;) {
+		uint64_t head = atomic_load_explicit(&j->head, memory_order_acquire);
+		if (cursor->pos >= head) {
+			return false;
+		}
+		if (head - cursor->pos > j->capacity) {
+			cursor->lost += head - j->capacity - cursor->pos;
+			cursor->pos = head - j->capacity;
+		}
+		if (journal_read(j, cursor->pos++, rec, cursor->buf)) {
+			return true;
+		}
+		cursor->lost++;
+	}
+}
+
+void regstore_journal_cursor_destroy(struct regstore_journal_cursor *cursor)
+{
+	journal_release(cursor->journal);
+	free(cursor->buf);
+	cursor->journal = NULL;
+	cursor->buf = NULL;
+}
+
+static void *unexport_iter(void *arg, struct binary_tree_node *node)
+{
+	(void) arg;
+	struct reg *reg = (void *) node->data;
+	reg->export_slot = NO_SLOT;
+	return NULL;
+}
+
+static bool store_export_open(struct regstore *inst, const char *name, size_t capacity, size_t key_size, size_t value_size)
+{
+	export_free(inst->exported);
+	inst->exported = NULL;
+	binary_tree_each(&inst->store, unexport_iter, NULL);
+	if (!name) {
+		return true;
+	}
+	inst->exported = export_new(name, capacity, key_size, value_size);
+	return inst->exported != NULL;
+}
+
+bool regstore_export_open(struct regstore *inst, const char *name, size_t capacity, size_t key_size, size_t value_size)
+{
+	write_lock(inst);
+	bool res = store_export_open(inst, name, capacity, key_size, value_size);
+	write_unlock(inst);
+	return res;
+}
+
+static bool store_export_register(struct regstore *inst, const struct fstr *key)
+{
+	struct reg *reg = binary_tree_get(&inst->store, key, sizeof(*key), NULL);
+	if (!reg || !inst->exported || reg->export_slot != NO_SLOT) {
+		return false;
+	}
+	size_t slot = export_add(inst->exported, key);
+	if (slot == NO_SLOT) {
+		return false;
+	}
+	/* Readers find the slot once it holds the current value, if readable */
+	struct fstr value;
+	fstr_init(&value);
+	if (call_getter(reg, &value) == regstore_err_ok) {
+		export_write(inst->exported, slot, &value);
+	}
+	fstr_destroy(&value);
+	export_publish(inst->exported, slot);
+	reg->export_slot = slot;
+	return true;
+}
+
+bool regstore_export_register(struct regstore *inst, const struct fstr *key)
+{
+	write_lock(inst);
+	bool res = store_export_register(inst, key);
+	write_unlock(inst);
+	return res;
+}
+
+uint64_t regstore_seq(const struct regstore *inst)
+{
+	read_lock((struct regstore *) inst);
+	uint64_t seq = inst->seq;
+	read_unlock((struct regstore *) inst);
+	return seq;
+}
+
+/* Oldest register changed after since, walking back from the newest */
+static struct reg *changed_since(struct regstore *inst, uint64_t since)
+{
+	struct reg *reg = inst->newest;
+	while (reg && reg->older && reg->older->version > since) {
+		reg = reg->older;
+	}
+	return reg;
+}
+
+static uint64_t store_changes_since(struct regstore *inst, uint64_t since, const struct fstr *remote, regstore_visitor *visitor, void *arg)
+{
+	struct reg *reg = changed_since(inst, since);
+	struct fstr value;
+	fstr_init(&value);
+	struct each_closure closure = {
+		.remote = remote,
+		.value = &value,
+		.visitor = visitor,
+		.arg = arg,
+		.stopped = false
+	};
+	for (; reg && reg->version > since; reg = reg->newer) {
+		if (reg->getter && each_iter(&closure, reg)) {
+			since = reg->version;
+			break;
+		}
+	}
+	fstr_destroy(&value);
+	return closure.stopped ? since : inst->seq;
+}
+
+uint64_t regstore_changes_since(struct regstore *inst, uint64_t since, const struct fstr *remote, regstore_visitor *visitor, void *arg)
+{
+	read_lock(inst);
+	uint64_t res = store_changes_since(inst, since, remote, visitor, arg);
+	read_unlock(inst);
+	return res;
+}
+
+/* Insert a register, not yet versioned */
+static struct reg *reg_insert(struct regstore *inst, const struct fstr *key, regstore_getter *getter, void *getter_arg, regstore_setter *setter, void *setter_arg)
+{
+	struct reg reg;
+	fstr_init_copy(&reg.name, key);
+	reg.getter = getter;
+	reg.getter_arg = getter_arg;
+	reg.setter = setter;
+	reg.setter_arg = setter_arg;
+	binary_tree_init(&reg.observers, first_fstr_cmp, NULL, destroy_observer);
+	reg.handle = NULL;
+	reg.inst = inst;
+	reg.type = regstore_type_string;
+	reg.typed_getter = NULL;
+	reg.typed_setter = NULL;
+	binary_tree_init(&reg.typed_observers, first_fstr_cmp, NULL, destroy_typed_sub);
+	reg.suppress = false;
+	reg.notified = false;
+	reg.cache_max_age_ms = 0;
+	reg.cache_valid = false;
+	reg.cache_fetching = false;
+	fstr_init(&reg.cache_value);
+	reg.cache_hits = 0;
+	reg.cache_misses = 0;
+	reg.sample_period_ms = 0;
+	reg.sample_due_ms = -1;
+	reg.sample_valid = false;
+	fstr_init(&reg.sample_last);
+	reg.export_slot = NO_SLOT;
+	reg.stats = inst->stats ? stats_new() : NULL;
+	reg.stat_source = NULL;
+	reg.version = 0;
+	reg.older = NULL;
+	reg.newer = NULL;
+	if (!binary_tree_insert_new(&inst->store, &reg, sizeof(reg))) {
+		fstr_destroy(&reg.name);
+		stats_release(reg.stats);
+		return NULL;
+	}
+	inst->count++;
+	struct reg *added = binary_tree_get(&inst->store, key, sizeof(*key), NULL);
+	prefix_insert(inst->prefixes, fstr_get(key), fstr_len(key), added);
+	return added;
+}
+
+static struct reg *reg_add(struct regstore *inst, const struct fstr *key, regstore_getter *getter, void *getter_arg, regstore_setter *setter, void *setter_arg)
+{
+	struct reg *reg = reg_insert(inst, key, getter, getter_arg, setter, setter_arg);
+	if (reg) {
+		reg_touch(reg);
+	}
+	return reg;
+}
+
+static bool store_add(struct regstore *inst, const struct fstr *key, regstore_getter *getter, void *getter_arg, regstore_setter *setter, void *setter_arg)
+{
+	return reg_add(inst, key, getter, getter_arg, setter, setter_arg) != NULL;
+}
+
+bool regstore_add(struct regstore *inst, const struct fstr *key, regstore_getter *getter, void *getter_arg, regstore_setter *setter, void *setter_arg)
+{
+	write_lock(inst);
+	bool res = store_add(inst, key, getter, getter_arg, setter, setter_arg);
+	write_unlock(inst);
+	return res;
+}
+
+/*
+ * Insert sorted defs[lo, hi) median first, so that they build a balanced
+ * tree.  Of a run of repeated keys only the first is inserted, as when
+ * inserting in order.
+ */
+static void insert_balanced(struct regstore *inst, const struct regstore_def *defs, struct reg **regs, size_t lo, size_t hi)
+{
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		const struct regstore_def *def = &defs[mid];
+		bool repeat = mid > 0 && fstr_cmp(&defs[mid - 1].key, &def->key) == 0;
+		regs[mid] = repeat ? NULL : reg_insert(inst, &def->key, def->getter, def->getter_arg, def->setter, def->setter_arg);
+		insert_balanced(inst, defs, regs, lo, mid);
+		lo = mid + 1;
+	}
+}
+
+static size_t store_add_many(struct regstore *inst, size_t count, const struct regstore_def *defs)
+{
+	bool sorted = true;
+	for (size_t i = 1; sorted && i < count; i++) {
+		sorted = fstr_cmp(&defs[i - 1].key, &defs[i].key) <= 0;
+	}
+	struct reg **regs = malloc(count * sizeof(*regs));
+	if (sorted) {
+		insert_balanced(inst, defs, regs, 0, count);
+	} else {
+		for (size_t i = 0; i < count; i++) {
+			const struct regstore_def *def = &defs[i];
+			regs[i] = reg_insert(inst, &def->key, def->getter, def->getter_arg, def->setter, def->setter_arg);
+		}
+	}
+	/* Versioned in the order given, whatever order they were inserted in */
+	size_t added = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (regs[i]) {
+			reg_touch(regs[i]);
+			added++;
+		}
+	}
+	free(regs);
+	return added;
+}
+
+size_t regstore_add_many(struct regstore *inst, size_t count, const struct regstore_def *defs)
+{
+	write_lock(inst);
+	size_t res = store_add_many(inst, count, defs);
+	write_unlock(inst);
+	return res;
+}
+
+static bool store_add_typed(struct regstore *inst, const struct fstr *key, enum regstore_type type, regstore_typed_getter *getter, void *getter_arg, regstore_typed_setter *setter, void *setter_arg)
+{
+	if (type == regstore_type_string) {
+		return false;
+	}
+	struct reg *reg = reg_add(inst, key, getter ? typed_text_getter : NULL, NULL, setter ? typed_text_setter : NULL, NULL);
+	if (!reg) {
+		return false;
+	}
+	reg->getter_arg = reg;
+	reg->setter_arg = reg;
+	reg->type = type;
+	reg->typed_getter = getter;
+	reg->typed_getter_arg = getter_arg;
+	reg->typed_setter = setter;
+	reg->typed_setter_arg = setter_arg;
+	return true;
+}
+
+bool regstore_add_typed(struct regstore *inst, const struct fstr *key, enum regstore_type type, regstore_typed_getter *getter, void *getter_arg, regstore_typed_setter *setter, void *setter_arg)
+{
+	write_lock(inst);
+	bool res = store_add_typed(inst, key, type, getter, getter_arg, setter, setter_arg);
+	write_unlock(inst);
+	return res;
+}
+
+bool regstore_add_s(struct regstore *inst, const char *key, regstore_getter *getter, void *getter_arg, regstore_setter *setter, void *setter_arg)
+{
+	struct fstr fs;
+	fstr_init_ref(&fs, key);
+	bool res = regstore_add(inst, &fs, getter, getter_arg, setter, setter_arg);
+	fstr_destroy(&fs);
+	return res;
+}
+
+static bool store_delete(struct regstore *inst, const struct fstr *key)
+{
+	prefix_remove(inst->prefixes, fstr_get(key), fstr_len(key));
+	if (!binary_tree_remove(&inst->store, key, sizeof(*key))) {
+		return false;
+	}
+	inst->count--;
+	return true;
+}
+
+bool regstore_delete(struct regstore *inst, const struct fstr *key)
+{
+	write_lock(inst);
+	bool res = store_delete(inst, key);
+	write_unlock_sync(inst, true);
+	return res;
+}
+
+struct collect_closure {
+	struct reg **regs;
+	size_t len;
+	size_t cap;
+};
+
+static void *collect_iter(void *arg, struct reg *reg)
+{
+	struct collect_closure *closure = arg;
+	if (closure->len == closure->cap) {
+		closure->cap = closure->cap ? closure->cap * 2 : 16;
+		closure->regs = realloc(closure->regs, closure->cap * sizeof(*closure->regs));
+	}
+	closure->regs[closure->len++] = reg;
+	return NULL;
+}
+
+static size_t store_delete_prefix(struct regstore *inst, const struct fstr *prefix)
+{
+	/* Collect first, as deleting changes the prefix index */
+	struct collect_closure closure = {
+		.regs = NULL,
+		.len = 0,
+		.cap = 0
+	};
+	prefix_each(inst, prefix, NULL, collect_iter, &closure);
+	for (size_t i = 0; i < closure.len; i++) {
+		struct fstr key = closure.regs[i]->name;
+		store_delete(inst, &key);
+	}
+	free(closure.regs);
+	return closure.len;
+}
+
+size_t regstore_delete_prefix(struct regstore *inst, const struct fstr *prefix)
+{
+	write_lock(inst);
+	size_t res = store_delete_prefix(inst, prefix);
+	write_unlock_sync(inst, true);
+	return res;
+}
+
+/* Notify observers of a successful set, with the read-back value if readable */
+static void reg_changed(struct reg *reg, const struct fstr *value)
+{
+	struct fstr val;
+	fstr_init(&val);
+	if (call_getter(reg, &val) == regstore_err_not_readable) {
+		send_notification(reg, value);
+	} else {
+		send_notification(reg, &val);
+	}
+	fstr_destroy(&val);
+}
+
+static enum regstore_err reg_set(struct reg *reg, const struct fstr *value)
+{
+	enum regstore_err err = call_setter(reg, value);
+	if (err == regstore_err_ok) {
+		reg_changed(reg, value);
+	}
+	return err == regstore_err_no_change ? regstore_err_ok : err;
+}
+
+static enum regstore_err reg_set_typed(struct reg *reg, const struct regstore_value *value)
+{
+	enum regstore_err err = call_typed_setter(reg, value);
+	if (err == regstore_err_ok) {
+		/* Notify the value read back if there is one, else the one written */
+		struct regstore_value val;
+		if (call_typed_getter(reg, &val) == regstore_err_ok) {
+			send_typed_notification(reg, &val);
+		} else {
+			send_typed_notification(reg, value);
+		}
+	}
+	return err == regstore_err_no_change ? regstore_err_ok : err;
+}
+
+static enum regstore_err reg_notify(struct reg *reg)
+{
+	if (reg->type != regstore_type_string) {
+		struct regstore_value value;
+		enum regstore_err res = call_typed_getter(reg, &value);
+		if (res == regstore_err_ok) {
+			send_typed_notification(reg, &value);
+		}
+		return res;
+	}
+	struct fstr value;
+	fstr_init(&value);
+	enum regstore_err res = call_getter(reg, &value);
+	if (res == regstore_err_ok) {
+		send_notification(reg, &value);
+	}
+	fstr_destroy(&value);
+	return res;
+}
+
+static enum regstore_err store_set(struct regstore *inst, const struct fstr *key, const struct fstr *value)
+{
+	struct reg *reg = binary_tree_get(&inst->store, key, sizeof(*key), NULL);
+	if (!reg) {
+		return regstore_err_invalid_key;
+	}
+	return reg_set(reg, value);
+}
+
+enum regstore_err regstore_set(struct regstore *inst, const struct fstr *key, const struct fstr *value)
+{
+	write_lock(inst);
+	enum regstore_err res = store_set(inst, key, value);
+	write_unlock(inst);
+	return res;
+}
+
+static enum regstore_err store_get(struct regstore *inst, const struct fstr *key, struct fstr *value)
+{
+	struct reg *reg = binary_tree_get(&inst->store, key, sizeof(*key), NULL);
+	if (!reg) {
+		return regstore_err_invalid_key;
+	}
+	return call_getter(reg, value);
+}
+
+enum regstore_err regstore_get(struct regstore *inst, const struct fstr *key, struct fstr *value)
+{
+	read_lock(inst);
+	enum regstore_err res = store_get(inst, key, value);
+	read_unlock(inst);
+	return res;
+}
+
+static enum regstore_err store_get_typed(struct regstore *inst, const struct fstr *key, struct regstore_value *value)
+{
+	struct reg *reg = binary_tree_get(&inst->store, key, sizeof(*key), NULL);
+	if (!reg) {
+		return regstore_err_invalid_key;
+	}
+	return call_typed_getter(reg, value);
+}
+
+enum regstore_err regstore_get_typed(struct regstore *inst, const struct fstr *key, struct regstore_value *value)
+{
+	read_lock(inst);
+	enum regstore_err res = store_get_typed(inst, key, value);
+	read_unlock(inst);
+	return res;
+}
+
+static enum regstore_err store_set_typed(struct regstore *inst, const struct fstr *key, const struct regstore_value *value)
+{
+	struct reg *reg = binary_tree_get(&inst->store, key, sizeof(*key), NULL);
+	if (!reg) {
+		return regstore_err_invalid_key;
+	}
+	return reg_set_typed(reg, value);
+}
+
+enum regstore_err regstore_set_typed(struct regstore *inst, const struct fstr *key, const struct regstore_value *value)
+{
+	write_lock(inst);
+	enum regstore_err res = store_set_typed(inst, key, value);
+	write_unlock(inst);
+	return res;
+}
+
+static bool store_suppress_unchanged(struct regstore *inst, const struct fstr *key, bool enable)
+{
+	struct reg *reg = binary_tree_get(&inst->store, key, sizeof(*key), NULL);
+	if (!reg) {
+		return false;
+	}
+	reg->suppress = enable;
+	reg->notified = false;
+	return true;
+}
+
+bool regstore_suppress_unchanged(struct regstore *inst, const struct fstr *key, bool enable)
+{
+	write_lock(inst);
+	bool res = store_suppress_unchanged(inst, key, enable);
+	write_unlock(inst);
+	return res;
+}
+
+static bool store_cache(struct regstore *inst, const struct fstr *key, int64_t max_age_ms)
+{
+	struct reg *reg = binary_tree_get(&inst->store, key, sizeof(*key), NULL);
+	if (!reg) {
+		return false;
+	}
+	reg->cache_max_age_ms = max_age_ms;
+	reg->cache_valid = false;
+	return true;
+}
+
+bool regstore_cache(struct regstore *inst, const struct fstr *key, int64_t max_age_ms)
+{
+	write_lock(inst);
+	bool res = store_cache(inst, key, max_age_ms);
+	write_unlock(inst);
+	return res;
+}
+
+static bool store_observe(struct regstore *inst, const struct fstr *key, const struct fstr *remote, regstore_observer *observer, void *observer_arg, int64_t min_interval)
+{
+	if (!observer) {
+		return false;
+	}
+	struct reg *reg = binary_tree_get(&inst->store, key, sizeof(*key), NULL);
+	if (!reg) {
+		return false;
+	}
+	struct observer obs;
+	intern(inst, &obs.remote, remote);
+	obs.observer = observer;
+	obs.observer_arg = observer_arg;
+	obs.info.next_ms = 0;
+	obs.info.min_interval_ms = min_interval;
+	obs.inst = inst;
+	fstr_init(&obs.pending);
+	obs.deadline = NO_DEADLINE;
+	obs.reg = reg;
+	binary_tree_replace(&reg->observers, &obs, sizeof(obs));
+	remote_index_add(inst, remote, reg);
+	return true;
+}
+
+bool regstore_observe(struct regstore *inst, const struct fstr *key, const struct fstr *remote, regstore_observer *observer, void *observer_arg, int64_t min_interval)
+{
+	write_lock(inst);
+	bool res = store_observe(inst, key, remote, observer, observer_arg, min_interval);
+	write_unlock_sync(inst, true);
+	return res;
+}
+
+static bool store_unobserve(struct regstore *inst, const struct fstr *key, const struct fstr *remote)
+{
+	struct reg *reg = binary_tree_get(&inst->store, key, sizeof(*key), NULL);
+	if (!reg || !binary_tree_remove(&reg->observers, remote, sizeof(*remote))) {
+		return false;
+	}
+	remote_index_remove(inst, remote, reg, false);
+	return true;
+}
+
+bool regstore_unobserve(struct regstore *inst, const struct fstr *key, const struct fstr *remote)
+{
+	write_lock(inst);
+	bool res = store_unobserve(inst, key, remote);
+	write_unlock_sync(inst, true);
+	return res;
+}
+
+static bool store_observe_pattern(struct regstore *inst, const struct fstr *pattern, const struct fstr *remote, regstore_pattern_observer *observer, void *observer_arg)
+{
+	if (!observer) {
+		return false;
+	}
+	const char *p = fstr_get(pattern);
+	size_t len = fstr_len(pattern);
+	struct pattern_node *node = inst->patterns;
+	struct binary_tree *subs;
+	while (true) {
+		size_t n = pattern_seg(p, len);
+		bool last = n == len;
+		if (last && pattern_is(p, n, "**")) {
+			subs = &node->rest;
+			break;
+		}
+		size_t idx;
+		if (pattern_is(p, n, "*")) {
+			if (!node->any) {
+				node->any = pattern_node_new(p, n);
+			}
+			node = node->any;
+		} else {
+			if (!pattern_child(node, p, n, &idx)) {
+				node->children = realloc(node->children, (node->nchildren + 1) * sizeof(*node->children));
+				memmove(&node->children[idx + 1], &node->children[idx], (node->nchildren - idx) * sizeof(*node->children));
+				node->children[idx] = pattern_node_new(p, n);
+				node->nchildren++;
+			}
+			node = node->children[idx];
+		}
+		if (last) {
+			subs = &node->here;
+			break;
+		}
+		p += n + 1;
+		len -= n + 1;
+	}
+	struct pattern_sub sub;
+	intern(inst, &sub.remote, remote);
+	sub.observer = observer;
+	sub.observer_arg = observer_arg;
+	if (!binary_tree_remove(subs, remote, sizeof(*remote))) {
+		node->subs++;
+	}
+	binary_tree_insert(subs, &sub, sizeof(sub), NULL);
+	struct remote_subs *rsubs = remote_subs_get(inst, remote, true);
+	struct fstr copy;
+	intern(inst, &copy, pattern);
+	if (!binary_tree_insert(&rsubs->patterns, &copy, sizeof(copy), NULL)) {
+		unintern(&copy);
+	}
+	return true;
+}
+
+bool regstore_observe_pattern(struct regstore *inst, const struct fstr *pattern, const struct fstr *remote, regstore_pattern_observer *observer, void *observer_arg)
+{
+	write_lock(inst);
+	bool res = store_observe_pattern(inst, pattern, remote, observer, observer_arg);
+	write_unlock_sync(inst, true);
+	return res;
+}
+
+static bool store_unobserve_pattern(struct regstore *inst, const struct fstr *pattern, const struct fstr *remote)
+{
+	bool removed = false;
+	pattern_remove(inst->patterns, fstr_get(pattern), fstr_len(pattern), remote, &removed);
+	struct remote_subs *subs = remote_subs_get(inst, remote, false);
+	if (removed && subs) {
+		binary_tree_remove(&subs->patterns, pattern, sizeof(*pattern));
+		remote_subs_prune(inst, subs);
+	}
+	return removed;
+}
+
+bool regstore_unobserve_pattern(struct regstore *inst, const struct fstr *pattern, const struct fstr *remote)
+{
+	write_lock(inst);
+	bool res = store_unobserve_pattern(inst, pattern, remote);
+	write_unlock_sync(inst, true);
+	return res;
+}
+
+static bool store_observe_typed(struct regstore *inst, const struct fstr *key, const struct fstr *remote, regstore_typed_observer *observer, void *observer_arg)
+{
+	if (!observer) {
+		return false;
+	}
+	struct reg *reg = binary_tree_get(&inst->store, key, sizeof(*key), NULL);
+	if (!reg || reg->type == regstore_type_string) {
+		return false;
+	}
+	struct typed_sub sub;
+	intern(inst, &sub.remote, remote);
+	sub.observer = observer;
+	sub.observer_arg = observer_arg;
+	binary_tree_replace(&reg->typed_observers, &sub, sizeof(sub));
+	remote_index_add(inst, remote, reg);
+	return true;
+}
+
+bool regstore_observe_typed(struct regstore *inst, const struct fstr *key, const struct fstr *remote, regstore_typed_observer *observer, void *observer_arg)
+{
+	write_lock(inst);
+	bool res = store_observe_typed(inst, key, remote, observer, observer_arg);
+	write_unlock_sync(inst, true);
+	return res;
+}
+
+static bool store_unobserve_typed(struct regstore *inst, const struct fstr *key, const struct fstr *remote)
+{
+	struct reg *reg = binary_tree_get(&inst->store, key, sizeof(*key), NULL);
+	if (!reg || !binary_tree_remove(&reg->typed_observers, remote, sizeof(*remote))) {
+		return false;
+	}
+	remote_index_remove(inst, remote, reg, false);
+	return true;
+}
+
+bool regstore_unobserve_typed(struct regstore *inst, const struct fstr *key, const struct fstr *remote)
+{
+	write_lock(inst);
+	bool res = store_unobserve_typed(inst, key, remote);
+	write_unlock_sync(inst, true);
+	return res;
+}
+
+struct unobserve_all_closure {
+	struct regstore *inst;
+	const struct fstr *remote;
+	size_t count;
+};
+
+static void *unobserve_reg_iter(void *arg, struct binary_tree_node *node)
+{
+	struct unobserve_all_closure *closure = arg;
+	struct reg *reg = *(struct reg **) node->data;
+	binary_tree_remove(&reg->observers, closure->remote, sizeof(*closure->remote));
+	binary_tree_remove(&reg->typed_observers, closure->remote, sizeof(*closure->remote));
+	closure->count++;
+	return NULL;
+}
+
+static void *unobserve_pattern_iter(void *arg, struct binary_tree_node *node)
+{
+	struct unobserve_all_closure *closure = arg;
+	const struct fstr *pattern = (void *) node->data;
+	bool removed = false;
+	pattern_remove(closure->inst->patterns, fstr_get(pattern), fstr_len(pattern), closure->remote, &removed);
+	closure->count++;
+	return NULL;
+}
+
+static size_t store_unobserve_all(struct regstore *inst, const struct fstr *remote)
+{
+	struct remote_subs *subs = remote_subs_get(inst, remote, false);
+	if (!subs) {
+		return 0;
+	}
+	/* Only the registers' observer trees change, so the index can be walked directly */
+	struct unobserve_all_closure closure = {
+		.inst = inst,
+		.remote = remote,
+		.count = 0
+	};
+	binary_tree_each(&subs->regs, unobserve_reg_iter, &closure);
+	binary_tree_each(&subs->patterns, unobserve_pattern_iter, &closure);
+	if (subs->batch) {
+		batched_remove(inst, remote);
+	}
+	binary_tree_remove(&inst->remotes, remote, sizeof(*remote));
+	return closure.count;
+}
+
+size_t regstore_unobserve_all(struct regstore *inst, const struct fstr *remote)
+{
+	write_lock(inst);
+	size_t res = store_unobserve_all(inst, remote);
+	write_unlock_sync(inst, true);
+	return res;
+}
+
+static bool store_batch(struct regstore *inst, const struct fstr *remote, regstore_batch_observer *observer, void *observer_arg, int64_t interval_ms)
+{
+	if (!observer) {
+		return false;
+	}
+	struct remote_subs *subs = remote_subs_get(inst, remote, true);
+	if (subs->batch) {
+		batch_flush(subs);
+	} else {
+		batched_add(inst, remote);
+	}
+	subs->batch = observer;
+	subs->batch_arg = observer_arg;
+	subs->interval_ms = interval_ms;
+	return true;
+}
+
+bool regstore_batch(struct regstore *inst, const struct fstr *remote, regstore_batch_observer *observer, void *observer_arg, int64_t interval_ms)
+{
+	write_lock(inst);
+	bool res = store_batch(inst, remote, observer, observer_arg, interval_ms);
+	write_unlock_sync(inst, true);
+	return res;
+}
+
+static bool store_unbatch(struct regstore *inst, const struct fstr *remote)
+{
+	struct remote_subs *subs = remote_subs_get(inst, remote, false);
+	if (!subs || !subs->batch) {
+		return false;
+	}
+	batch_flush(subs);
+	subs->batch = NULL;
+	batched_remove(inst, remote);
+	remote_subs_prune(inst, subs);
+	return true;
+}
+
+bool regstore_unbatch(struct regstore *inst, const struct fstr *remote)
+{
+	write_lock(inst);
+	bool res = store_unbatch(inst, remote);
+	write_unlock_sync(inst, true);
+	return res;
+}
+
+static void store_flush(struct regstore *inst, const struct fstr *remote)
+{
+	if (!inst->batches) {
+		return;
+	}
+	if (!remote) {
+		for (size_t i = 0; i < inst->batches; i++) {
+			batch_flush(remote_subs_get(inst, &inst->batched[i], false));
+		}
+		return;
+	}
+	struct remote_subs *subs = remote_subs_get(inst, remote, false);
+	if (subs && subs->batch) {
+		batch_flush(subs);
+	}
+}
+
+void regstore_flush(struct regstore *inst, const struct fstr *remote)
+{
+	write_lock(inst);
+	store_flush(inst, remote);
+	write_unlock(inst);
+}
+
+static bool store_list_subscriptions(struct regstore *inst, struct binary_tree *out, const struct fstr *remote, bool values)
+{
+	struct list_closure closure = {
+		.out = out,
+		.remote = remote,
+		.values = values,
+		.subscribed = true
+	};
+	binary_tree_init(out, first_fstr_cmp, NULL, destroy_reginfo);
+	struct remote_subs *subs = remote_subs_get(inst, remote, false);
+	if (subs && binary_tree_each(&subs->regs, list_subscription_iter, &closure)) {
+		binary_tree_destroy(out);
+		return false;
+	}
+	return true;
+}
+
+bool regstore_list_subscriptions(struct regstore *inst, struct binary_tree *out, const struct fstr *remote, bool values)
+{
+	read_lock(inst);
+	bool res = store_list_subscriptions(inst, out, remote, values);
+	read_unlock(inst);
+	return res;
+}
+
+static bool store_query_observer(struct regstore *inst, const struct fstr *key, const struct fstr *remote, struct regstore_subscription_info *out)
+{
+	struct reg *reg = binary_tree_get(&inst->store, key, sizeof(*key), NULL);
+	if (!reg) {
+		return false;
+	}
+	struct observer *obs = binary_tree_get(&reg->observers, remote, sizeof(*remote), NULL);
+	if (!obs) {
+		return false;
+	}
+	*out = obs->info;
+	return true;
+}
+
+bool regstore_query_observer(struct regstore *inst, const struct fstr *key, const struct fstr *remote, struct regstore_subscription_info *out)
+{
+	read_lock(inst);
+	bool res = store_query_observer(inst, key, remote, out);
+	read_unlock(inst);
+	return res;
+}
+
+static enum regstore_err store_notify(struct regstore *inst, const struct fstr *key)
+{
+	struct reg *reg = binary_tree_get(&inst->store, key, sizeof(*key), NULL);
+	if (!reg) {
+		return regstore_err_invalid_key;
+	}
+	return reg_notify(reg);
+}
+
+enum regstore_err regstore_notify(struct regstore *inst, const struct fstr *key)
+{
+	write_lock(inst);
+	enum regstore_err res = store_notify(inst, key);
+	write_unlock(inst);
+	return res;
+}
+
+/*
+ * Look up many keys.  When keys are sorted and numerous enough that count
+ * lookups would cost more than walking the whole store, merge them against
+ * an in-order walk instead.
+ */
+static void resolve_many(struct regstore *inst, size_t count, const struct fstr *keys, struct reg **regs)
+{
+	size_t depth = 1;
+	while (depth < sizeof(size_t) * CHAR_BIT - 1 && ((size_t) 1 << depth) < inst->count) {
+		depth++;
+	}
+	bool sorted = count * depth > inst->count;
+	for (size_t i = 1; sorted && i < count; i++) {
+		sorted = fstr_cmp(&keys[i - 1], &keys[i]) <= 0;
+	}
+	if (!sorted) {
+		for (size_t i = 0; i < count; i++) {
+			regs[i] = binary_tree_get(&inst->store, &keys[i], sizeof(keys[i]), NULL);
+		}
+		return;
+	}
+	struct binary_tree_iterator it;
+	binary_tree_iter_init(&it, &inst->store, false);
+	struct reg *reg = (void *) binary_tree_iter_next(&it, NULL);
+	for (size_t i = 0; i < count; i++) {
+		while (reg && fstr_cmp(&reg->name, &keys[i]) < 0) {
+			reg = (void *) binary_tree_iter_next(&it, NULL);
+		}
+		regs[i] = reg && fstr_cmp(&reg->name, &keys[i]) == 0 ? reg : NULL;
+	}
+	binary_tree_iter_destroy(&it);
+}
+
+static void store_get_many(struct regstore *inst, size_t count, const struct fstr *keys, struct fstr *values, enum regstore_err *results)
+{
+	struct reg **regs = malloc(count * sizeof(*regs));
+	resolve_many(inst, count, keys, regs);
+	for (size_t i = 0; i < count; i++) {
+		results[i] = regs[i] ? call_getter(regs[i], &values[i]) : regstore_err_invalid_key;
+	}
+	free(regs);
+}
+
+void regstore_get_many(struct regstore *inst, size_t count, const struct fstr *keys, struct fstr *values, enum regstore_err *results)
+{
+	read_lock(inst);
+	store_get_many(inst, count, keys, values, results);
+	read_unlock(inst);
+}
+
+static void store_set_many(struct regstore *inst, size_t count, const struct fstr *keys, const struct fstr *values, enum regstore_err *results)
+{
+	struct reg **regs = malloc(count * sizeof(*regs));
+	resolve_many(inst, count, keys, regs);
+	for (size_t i = 0; i < count; i++) {
+		results[i] = regs[i] ? call_setter(regs[i], &values[i]) : regstore_err_invalid_key;
+	}
+	for (size_t i = 0; i < count; i++) {
+		if (results[i] == regstore_err_ok) {
+			reg_changed(regs[i], &values[i]);
+		} else if (results[i] == regstore_err_no_change) {
+			results[i] = regstore_err_ok;
+		}
+	}
+	free(regs);
+	store_flush(inst, NULL);
+}
+
+void regstore_set_many(struct regstore *inst, size_t count, const struct fstr *keys, const struct fstr *values, enum regstore_err *results)
+{
+	write_lock(inst);
+	store_set_many(inst, count, keys, values, results);
+	write_unlock(inst);
+}
+
+/*
+ * Snapshot file: SNAPSHOT_MAGIC, then one record per saved value, later ones
+ * replacing earlier ones for the same key.  A record is the key and value
+ * lengths (uint32_t, native byte order), then the key and the value, each
+ * followed by a NUL so that restore can refer to them where they lie.
+ */
+#define SNAPSHOT_MAGIC "regsnap1"
+#define SNAPSHOT_MAGIC_LEN 8
+
+struct snapshot_record {
+	struct fstr key;
+	struct fstr value;
+	size_t order; /* In the file */
+};
+
+/* Registers which cannot be both read and written back are skipped */
+static bool snapshot_write(FILE *f, struct reg *reg, struct fstr *value)
+{
+	if (!reg->getter || !reg->setter || call_getter(reg, value) != regstore_err_ok) {
+		return true;
+	}
+	uint32_t len[2] = { fstr_len(&reg->name), fstr_len(value) };
+	return fwrite(len, sizeof(len), 1, f) == 1 &&
+		fwrite(fstr_get(&reg->name), 1, len[0], f) == len[0] && fputc(0, f) == 0 &&
+		fwrite(fstr_get(value), 1, len[1], f) == len[1] && fputc(0, f) == 0;
+}
+
+static uint64_t store_snapshot_save(struct regstore *inst, const char *path, uint64_t since)
+{
+	/*
+	 * Append to the file the last save wrote, or if there is none, write a
+	 * new one beside it and rename it into place
+	 */
+	char *tmp = NULL;
+	int fd = since ? open(path, O_WRONLY | O_APPEND) : -1;
+	if (fd < 0) {
+		since = 0;
+		size_t size = strlen(path) + 5;
+		tmp = malloc(size);
+		if (!tmp) {
+			log_error("Failed to save snapshot \"%s\": out of memory", path);
+			return 0;
+		}
+		snprintf(tmp, size, "%s.tmp", path);
+		fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	}
+	FILE *f = fd < 0 ? NULL : fdopen(fd, "w");
+	bool ok = f != NULL;
+	if (!f && fd >= 0) {
+		close(fd);
+	}
+	struct fstr value;
+	fstr_init(&value);
+	if (ok && since) {
+		for (struct reg *reg = changed_since(inst, since); ok && reg && reg->version > since; reg = reg->newer) {
+			ok = snapshot_write(f, reg, &value);
+		}
+	} else if (ok) {
+		ok = fwrite(SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN, 1, f) == 1;
+		struct binary_tree_iterator it;
+		binary_tree_iter_init(&it, &inst->store, false);
+		struct reg *reg;
+		while (ok && (reg = (void *) binary_tree_iter_next(&it, NULL))) {
+			ok = snapshot_write(f, reg, &value);
+		}
+		binary_tree_iter_destroy(&it);
+	}
+	fstr_destroy(&value);
+	ok = ok && fflush(f) == 0 && fsync(fileno(f)) == 0;
+	if (f && fclose(f) != 0) {
+		ok = false;
+	}
+	if (tmp) {
+		ok = ok && rename(tmp, path) == 0;
+		if (!ok) {
+			unlink(tmp);
+		}
+		free(tmp);
+	}
+	if (!ok) {
+		log_error("Failed to save snapshot \"%s\": %s", path, strerror(errno));
+	}
+	return ok ? inst->seq : 0;
+}
+
+uint64_t regstore_snapshot_save(struct regstore *inst, const char *path, uint64_t since)
+{
+	read_lock(inst);
+	uint64_t res = store_snapshot_save(inst, path, since);
+	read_unlock(inst);
+	return res;
+}
+
+/* By key, then file order */
+static int snapshot_record_cmp(const void *a, const void *b)
+{
+	const struct snapshot_record *x = a;
+	const struct snapshot_record *y = b;
+	int res = fstr_cmp(&x->key, &y->key);
+	return res ? res : (x->order > y->order) - (x->order < y->order);
+}
+
+/* Parse records from data into recs (if not NULL), returns their count */
+static size_t snapshot_parse(const char *data, size_t size, struct snapshot_record *recs)
+{
+	size_t count = 0;
+	size_t pos = SNAPSHOT_MAGIC_LEN;
+	uint32_t len[2];
+	/* A record cut short by an interrupted save ends the file */
+	while (size - pos >= sizeof(len)) {
+		memcpy(len, data + pos, sizeof(len));
+		const char *key = data + pos + sizeof(len);
+		const char *value = key + len[0] + 1;
+		if ((size_t) len[0] + len[1] + 2 > size - pos - sizeof(len) || key[len[0]] || value[len[1]]) {
+			break;
+		}
+		if (recs) {
+			fstr_init_ref(&recs[count].key, key);
+			fstr_init_ref(&recs[count].value, value);
+			recs[count].order = count;
+		}
+		count++;
+		pos += sizeof(len) + len[0] + len[1] + 2;
+	}
+	return count;
+}
+
+static bool store_snapshot_restore(struct regstore *inst, const char *path, size_t *restored)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		log_error("Failed to open snapshot \"%s\": %s", path, strerror(errno));
+		return false;
+	}
+	struct stat st;
+	void *p = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && (size_t) st.st_size >= SNAPSHOT_MAGIC_LEN) {
+		p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	} else {
+		errno = EINVAL;
+	}
+	close(fd);
+	if (p == MAP_FAILED) {
+		log_error("Failed to read snapshot \"%s\": %s", path, strerror(errno));
+		return false;
+	}
+	if (memcmp(p, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN) != 0) {
+		log_error("Not a snapshot: \"%s\"", path);
+		munmap(p, st.st_size);
+		return false;
+	}
+	size_t count = snapshot_parse(p, st.st_size, NULL);
+	struct snapshot_record *recs = malloc(count * sizeof(*recs));
+	snapshot_parse(p, st.st_size, recs);
+	/*
+	 * The full save which starts the file is in key order: sort what was
+	 * appended and merge it in
+	 */
+	size_t full = 1;
+	while (full < count && fstr_cmp(&recs[full - 1].key, &recs[full].key) < 0) {
+		full++;
+	}
+	if (full < count) {
+		qsort(recs + full, count - full, sizeof(*recs), snapshot_record_cmp);
+		struct snapshot_record *merged = malloc(count * sizeof(*merged));
+		for (size_t i = 0, a = 0, b = full; i < count; i++) {
+			merged[i] = b == count || (a < full && snapshot_record_cmp(&recs[a], &recs[b]) < 0) ? recs[a++] : recs[b++];
+		}
+		free(recs);
+		recs = merged;
+	}
+	/* Each key's last value is the one set */
+	struct fstr *keys = malloc(2 * count * sizeof(*keys));
+	struct fstr *values = keys + count;
+	size_t n = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (i + 1 < count && fstr_cmp(&recs[i].key, &recs[i + 1].key) == 0) {
+			continue;
+		}
+		keys[n] = recs[i].key;
+		values[n] = recs[i].value;
+		n++;
+	}
+	free(recs);
+	enum regstore_err *results = malloc(n * sizeof(*results));
+	store_set_many(inst, n, keys, values, results);
+	size_t ok = 0;
+	for (size_t i = 0; i < n; i++) {
+		ok += results[i] == regstore_err_ok;
+	}
+	if (restored) {
+		*restored = ok;
+	}
+	free(results);
+	free(keys);
+	munmap(p, st.st_size);
+	return true;
+}
+
+bool regstore_snapshot_restore(struct regstore *inst, const char *path, size_t *restored)
+{
+	write_lock(inst);
+	bool res = store_snapshot_restore(inst, path, restored);
+	write_unlock(inst);
+	return res;
+}
+
+void regstore_txn_init(struct regstore_txn *txn)
+{
+	txn->keys = NULL;
+	txn->values = NULL;
+	txn->count = 0;
+	txn->cap = 0;
+}
+
+void regstore_txn_destroy(struct regstore_txn *txn)
+{
+	for (size_t i = 0; i < txn->count; i++) {
+		fstr_destroy(&txn->keys[i]);
+		fstr_destroy(&txn->values[i]);
+	}
+	free(txn->keys);
+	free(txn->values);
+	regstore_txn_init(txn);
+}
+
+void regstore_txn_set(struct regstore_txn *txn, const struct fstr *key, const struct fstr *value)
+{
+	if (txn->count == txn->cap) {
+		txn->cap = txn->cap ? txn->cap * 2 : 8;
+		txn->keys = realloc(txn->keys, txn->cap * sizeof(*txn->keys));
+		txn->values = realloc(txn->values, txn->cap * sizeof(*txn->values));
+	}
+	fstr_init_copy(&txn->keys[txn->count], key);
+	fstr_init_copy(&txn->values[txn->count], value);
+	txn->count++;
+}
+
+/* Per staged set: index of the first set of the same register, and (for firsts) its prior value and last set */
+struct txn_write {
+	size_t first;
+	struct fstr old;
+	size_t last;
+	bool applied;
+	bool changed;
+};
+
+static enum regstore_err txn_prepare(struct reg **regs, struct txn_write *w, size_t count, size_t *failed)
+{
+	for (size_t i = 0; i < count; i++) {
+		/* Transactions are short, so a linear search for repeats will do */
+		w[i].first = 0;
+		while (w[i].first < i && regs[w[i].first] != regs[i]) {
+			w[i].first++;
+		}
+		enum regstore_err res = regstore_err_ok;
+		if (!regs[i]) {
+			res = regstore_err_invalid_key;
+		} else if (!regs[i]->setter) {
+			res = regstore_err_not_writeable;
+		} else if (w[i].first == i) {
+			res = call_getter(regs[i], &w[i].old);
+		}
+		if (res != regstore_err_ok) {
+			*failed = i;
+			return res;
+		}
+	}
+	return regstore_err_ok;
+}
+
+static enum regstore_err txn_apply(struct reg **regs, struct txn_write *w, const struct fstr *values, size_t count, size_t *failed)
+{
+	for (size_t i = 0; i < count; i++) {
+		*failed = i;
+		enum regstore_err res = call_setter(regs[i], &values[i]);
+		if (res != regstore_err_ok && res != regstore_err_no_change) {
+			/* Restore what was written, most recent first */
+			while (i--) {
+				if (w[i].first == i && w[i].applied) {
+					call_setter(regs[i], &w[i].old);
+				}
+			}
+			return res;
+		}
+		struct txn_write *first = &w[w[i].first];
+		first->last = i;
+		first->applied = true;
+		first->changed = first->changed || res == regstore_err_ok;
+	}
+	return regstore_err_ok;
+}
+
+static enum regstore_err store_txn_commit(struct regstore *inst, const struct regstore_txn *txn, size_t *failed)
+{
+	size_t count = txn->count;
+	struct reg **regs = malloc(count * sizeof(*regs));
+	struct txn_write *w = malloc(count * sizeof(*w));
+	for (size_t i = 0; i < count; i++) {
+		fstr_init(&w[i].old);
+		w[i].applied = false;
+		w[i].changed = false;
+	}
+	resolve_many(inst, count, txn->keys, regs);
+	size_t index = 0;
+	enum regstore_err res = txn_prepare(regs, w, count, &index);
+	if (res == regstore_err_ok) {
+		res = txn_apply(regs, w, txn->values, count, &index);
+	}
+	if (res == regstore_err_ok) {
+		/* One notification per changed register, with the last value written to it */
+		for (size_t i = 0; i < count; i++) {
+			if (w[i].changed) {
+				send_notification(regs[i], &txn->values[w[i].last]);
+			}
+		}
+		store_flush(inst, NULL);
+	} else if (failed) {
+		*failed = index;
+	}
+	for (size_t i = 0; i < count; i++) {
+		fstr_destroy(&w[i].old);
+	}
+	free(w);
+	free(regs);
+	return res;
+}
+
+enum regstore_err regstore_txn_commit(struct regstore *inst, const struct regstore_txn *txn, size_t *failed)
+{
+	write_lock(inst);
+	enum regstore_err res = store_txn_commit(inst, txn, failed);
+	write_unlock(inst);
+	return res;
+}
+
+static void *notify_iter(void *arg, struct reg *reg)
+{
+	size_t *count = arg;
+	reg_notify(reg);
+	(*count)++;
+	return NULL;
+}
+
+static size_t store_notify_prefix(struct regstore *inst, const struct fstr *prefix)
+{
+	size_t count = 0;
+	prefix_each(inst, prefix, NULL, notify_iter, &count);
+	return count;
+}
+
+size_t regstore_notify_prefix(struct regstore *inst, const struct fstr *prefix)
+{
+	write_lock(inst);
+	size_t res = store_notify_prefix(inst, prefix);
+	write_unlock(inst);
+	return res;
+}
+
+static struct regstore_handle *store_resolve(struct regstore *inst, const struct fstr *key)
+{
+	struct reg *reg = binary_tree_get(&inst->store, key, sizeof(*key), NULL);
+	if (!reg) {
+		return NULL;
+	}
+	if (!reg->handle) {
+		reg->handle = malloc(sizeof(*reg->handle));
+		reg->handle->reg = reg;
+		reg->handle->lock_inst = inst->concurrent ? inst : NULL;
+		atomic_init(&reg->handle->refs, 1);
+	}
+	atomic_fetch_add(&reg->handle->refs, 1);
+	return reg->handle;
+}
+
+struct regstore_handle *regstore_resolve(struct regstore *inst, const struct fstr *key)
+{
+	write_lock(inst);
+	struct regstore_handle *res = store_resolve(inst, key);
+	write_unlock(inst);
+	return res;
+}
+
+void regstore_release(struct regstore_handle *handle)
+{
+	if (atomic_fetch_sub(&handle->refs, 1) == 1) {
+		free(handle);
+	}
+}
+
+static enum regstore_err store_set_h(struct regstore_handle *handle, const struct fstr *value)
+{
+	if (!handle->reg) {
+		return regstore_err_invalid_key;
+	}
+	return reg_set(handle->reg, value);
+}
+
+enum regstore_err regstore_set_h(struct regstore_handle *handle, const struct fstr *value)
+{
+	struct regstore *inst = handle->lock_inst;
+	write_lock(inst);
+	enum regstore_err res = store_set_h(handle, value);
+	write_unlock(inst);
+	return res;
+}
+
+static enum regstore_err store_get_h(struct regstore_handle *handle, struct fstr *value)
+{
+	if (!handle->reg) {
+		return regstore_err_invalid_key;
+	}
+	return call_getter(handle->reg, value);
+}
+
+enum regstore_err regstore_get_h(struct regstore_handle *handle, struct fstr *value)
+{
+	struct regstore *inst = handle->lock_inst;
+	read_lock(inst);
+	enum regstore_err res = store_get_h(handle, value);
+	read_unlock(inst);
+	return res;
+}
+
+static enum regstore_err store_set_typed_h(struct regstore_handle *handle, const struct regstore_value *value)
+{
+	if (!handle->reg) {
+		return regstore_err_invalid_key;
+	}
+	return reg_set_typed(handle->reg, value);
+}
+
+enum regstore_err regstore_set_typed_h(struct regstore_handle *handle, const struct regstore_value *value)
+{
+	struct regstore *inst = handle->lock_inst;
+	write_lock(inst);
+	enum regstore_err res = store_set_typed_h(handle, value);
+	write_unlock(inst);
+	return res;
+}
+
+static enum regstore_err store_get_typed_h(struct regstore_handle *handle, struct regstore_value *value)
+{
+	if (!handle->reg) {
+		return regstore_err_invalid_key;
+	}
+	return call_typed_getter(handle->reg, value);
+}
+
+enum regstore_err regstore_get_typed_h(struct regstore_handle *handle, struct regstore_value *value)
+{
+	struct regstore *inst = handle->lock_inst;
+	read_lock(inst);
+	enum regstore_err res = store_get_typed_h(handle, value);
+	read_unlock(inst);
+	return res;
+}
+
+static enum regstore_err store_notify_h(struct regstore_handle *handle)
+{
+	if (!handle->reg) {
+		return regstore_err_invalid_key;
+	}
+	return reg_notify(handle->reg);
+}
+
+enum regstore_err regstore_notify_h(struct regstore_handle *handle)
+{
+	struct regstore *inst = handle->lock_inst;
+	write_lock(inst);
+	enum regstore_err res = store_notify_h(handle);
+	write_unlock(inst);
+	return res;
+}
+
+static bool store_sample(struct regstore *inst, const struct fstr *key, int64_t period_ms)
+{
+	struct reg *reg = binary_tree_get(&inst->store, key, sizeof(*key), NULL);
+	if (!reg) {
+		return false;
+	}
+	if (reg->sample_period_ms > 0) {
+		sampled_remove(reg);
+	}
+	reg->sample_due_ms = -1;
+	reg->sample_valid = false;
+	if (period_ms > 0) {
+		if (inst->sampled_len == inst->sampled_cap) {
+			inst->sampled_cap = inst->sampled_cap ? inst->sampled_cap * 2 : 16;
+			inst->sampled = realloc(inst->sampled, inst->sampled_cap * sizeof(*inst->sampled));
+		}
+		reg->sample_index = inst->sampled_len++;
+		inst->sampled[reg->sample_index] = reg;
+		reg->sample_period_ms = period_ms;
+	}
+	return true;
+}
+
+bool regstore_sample(struct regstore *inst, const struct fstr *key, int64_t period_ms)
+{
+	write_lock(inst);
+	bool res = store_sample(inst, key, period_ms);
+	write_unlock(inst);
+	return res;
+}
+
+static void *sample_interval_iter(void *arg, struct binary_tree_node *node)
+{
+	int64_t *interval = arg;
+	const struct observer *obs = (void *) node->data;
+	if (obs->info.min_interval_ms > 0 && obs->info.min_interval_ms < *interval) {
+		*interval = obs->info.min_interval_ms;
+	}
+	return NULL;
+}
+
+/* How often to poll the register, -1 if nobody observes it */
+static int64_t sample_interval(struct reg *reg)
+{
+	int64_t interval = reg->sample_period_ms;
+	if (!tree_empty(&reg->observers)) {
+		binary_tree_each(&reg->observers, sample_interval_iter, &interval);
+	} else if (tree_empty(&reg->typed_observers) && (pattern_node_empty(reg->inst->patterns) || !pattern_matches(reg->inst, &reg->name))) {
+		return -1;
+	}
+	return interval;
+}
+
+/* Poll the register, notifying if its value changed */
+static void reg_sample(struct reg *reg)
+{
+	struct fstr value;
+	fstr_init(&value);
+	if (call_getter(reg, &value) == regstore_err_ok && (!reg->sample_valid || fstr_cmp(&value, &reg->sample_last) != 0)) {
+		reg->sample_valid = true;
+		fstr_copy(&reg->sample_last, &value);
+		send_notification(reg, &value);
+	}
+	fstr_destroy(&value);
+}
+
+static int64_t sample_tick(struct regstore *inst, int64_t now, int64_t wait)
+{
+	for (size_t i = 0; i < inst->sampled_len; i++) {
+		struct reg *reg = inst->sampled[i];
+		int64_t interval = sample_interval(reg);
+		if (interval < 0) {
+			reg->sample_due_ms = -1;
+			continue;
+		}
+		bool due = reg->sample_due_ms >= 0 && reg->sample_due_ms <= now;
+		if (reg->sample_due_ms < 0 || due) {
+			reg->sample_due_ms = now + interval;
+		}
+		if (wait < 0 || reg->sample_due_ms - now < wait) {
+			wait = reg->sample_due_ms - now;
+		}
+		/* Last, as observers may remove the register */
+		if (due) {
+			reg_sample(reg);
+		}
+	}
+	return wait;
+}
+
+static int64_t store_tick(struct regstore *inst)
+{
+	int64_t now = now_ms();
+	int64_t wait = -1;
+	while (inst->deadlines_len) {
+		struct observer *obs = inst->deadlines[0];
+		if (obs->info.next_ms > now) {
+			wait = obs->info.next_ms - now;
+			break;
+		}
+		deadline_remove(inst, obs);
+		obs->info.next_ms = now + obs->info.min_interval_ms;
+		/* Observer may set the register again, which refills pending */
+		struct fstr value = obs->pending;
+		fstr_init(&obs->pending);
+		call_observer(obs, &value);
+		fstr_destroy(&value);
+	}
+	if (inst->batches) {
+		wait = batch_tick(inst, now, wait);
+	}
+	if (inst->sampled_len) {
+		wait = sample_tick(inst, now, wait);
+	}
+	return wait;
+}
+
+int64_t regstore_tick(struct regstore *inst)
+{
+	write_lock(inst);
+	int64_t res = store_tick(inst);
+	write_unlock(inst);
+	return res;
+}
+
+uint64_t regstore_histogram_count(const struct regstore_histogram *h)
+{
+	uint64_t count = 0;
+	for (size_t i = 0; i < REGSTORE_HISTOGRAM_BUCKETS; i++) {
+		count += h->buckets[i];
+	}
+	return count;
+}
+
+uint64_t regstore_histogram_quantile(const struct regstore_histogram *h, double q)
+{
+	uint64_t count = regstore_histogram_count(h);
+	if (!count) {
+		return 0;
+	}
+	/* Rank of the quantile, rounded up */
+	double pos = q * count;
+	uint64_t rank = pos <= 1 ? 1 : pos >= count ? count : (uint64_t) pos + ((uint64_t) pos < pos);
+	uint64_t seen = 0;
+	size_t i = 0;
+	for (; i < REGSTORE_HISTOGRAM_BUCKETS - 1; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank) {
+			break;
+		}
+	}
+	return (uint64_t) 1 << i;
+}
+
+static void *stats_enable_iter(void *arg, struct binary_tree_node *node)
+{
+	struct reg *reg = (void *) node->data;
+	if (arg && !reg->stats) {
+		reg->stats = stats_new();
+	} else if (!arg) {
+		stats_release(reg->stats);
+		reg->stats = NULL;
+	}
+	return NULL;
+}
+
+static void store_stats_enable(struct regstore *inst, bool enable)
+{
+	inst->stats = enable;
+	binary_tree_each(&inst->store, stats_enable_iter, enable ? inst : NULL);
+	if (inst->lock_stats) {
+		atomic_store(&inst->lock_stats->enabled, enable);
+		if (!enable) {
+			histogram_clear(&inst->lock_stats->wait_us);
+		}
+	}
+}
+
+void regstore_stats_enable(struct regstore *inst, bool enable)
+{
+	write_lock(inst);
+	store_stats_enable(inst, enable);
+	write_unlock(inst);
+}
+
+static bool store_stats(struct regstore *inst, const struct fstr *key, struct regstore_stats *out)
+{
+	struct reg *reg = binary_tree_get(&inst->store, key, sizeof(*key), NULL);
+	if (!reg || !reg->stats) {
+		return false;
+	}
+	out->gets = atomic_load_explicit(&reg->stats->gets, memory_order_relaxed);
+	out->sets = atomic_load_explicit(&reg->stats->sets, memory_order_relaxed);
+	out->notifies = atomic_load_explicit(&reg->stats->notifies, memory_order_relaxed);
+	out->rate_limited = atomic_load_explicit(&reg->stats->rate_limited, memory_order_relaxed);
+	histogram_load(&reg->stats->get_us, &out->get_us);
+	histogram_load(&reg->stats->set_us, &out->set_us);
+	histogram_load(&reg->stats->observer_us, &out->observer_us);
+	return true;
+}
+
+bool regstore_stats(struct regstore *inst, const struct fstr *key, struct regstore_stats *out)
+{
+	read_lock(inst);
+	bool res = store_stats(inst, key, out);
+	read_unlock(inst);
+	return res;
+}
+
+bool regstore_lock_stats(struct regstore *inst, struct regstore_histogram *out)
+{
+	if (!inst->lock_stats || !atomic_load(&inst->lock_stats->enabled)) {
+		return false;
+	}
+	histogram_load(&inst->lock_stats->wait_us, out);
+	return true;
+}
+
+static const char *const stat_names[] = {
+	"gets",
+	"sets",
+	"notifies",
+	"rate_limited",
+	"get_p50_us",
+	"get_p99_us",
+	"set_p50_us",
+	"set_p99_us",
+	"observer_p50_us",
+	"observer_p99_us",
+	"lock_wait_p50_us",
+	"lock_wait_p99_us"
+};
+
+static enum regstore_err stat_getter(void *arg, struct fstr *value)
+{
+	const struct stat_source *src = arg;
+	struct regstore_stats stats = { 0 };
+	struct regstore_histogram wait = { { 0 } };
+	if (src->kind >= stat_lock_wait_p50) {
+		if (!regstore_lock_stats(src->inst, &wait)) {
+			return regstore_err_not_readable;
+		}
+	} else if (!store_stats(src->inst, &src->key, &stats)) {
+		return regstore_err_not_readable;
+	}
+	uint64_t n;
+	switch (src->kind) {
+	case stat_gets: n = stats.gets; break;
+	case stat_sets: n = stats.sets; break;
+	case stat_notifies: n = stats.notifies; break;
+	case stat_rate_limited: n = stats.rate_limited; break;
+	case stat_get_p50: n = regstore_histogram_quantile(&stats.get_us, 0.5); break;
+	case stat_get_p99: n = regstore_histogram_quantile(&stats.get_us, 0.99); break;
+	case stat_set_p50: n = regstore_histogram_quantile(&stats.set_us, 0.5); break;
+	case stat_set_p99: n = regstore_histogram_quantile(&stats.set_us, 0.99); break;
+	case stat_observer_p50: n = regstore_histogram_quantile(&stats.observer_us, 0.5); break;
+	case stat_observer_p99: n = regstore_histogram_quantile(&stats.observer_us, 0.99); break;
+	case stat_lock_wait_p50: n = regstore_histogram_quantile(&wait, 0.5); break;
+	case stat_lock_wait_p99: n = regstore_histogram_quantile(&wait, 0.99); break;
+	default: return regstore_err_unknown;
+	}
+	char buf[24];
+	snprintf(buf, sizeof(buf), "%" PRIu64, n);
+	struct fstr text;
+	fstr_init_ref(&text, buf);
+	fstr_copy(value, &text);
+	return regstore_err_ok;
+}
+
+/* "_stats.<key>.<stat>", or "_stats.<stat>" if key is NULL */
+static void stat_name(struct fstr *out, const struct fstr *key, enum stat_kind kind)
+{
+	size_t len = (key ? fstr_len(key) + 1 : 0) + strlen(stat_names[kind]) + 8;
+	char *buf = malloc(len);
+	if (key) {
+		snprintf(buf, len, "_stats.%.*s.%s", (int) fstr_len(key), fstr_get(key), stat_names[kind]);
+	} else {
+		snprintf(buf, len, "_stats.%s", stat_names[kind]);
+	}
+	struct fstr name;
+	fstr_init_ref(&name, buf);
+	fstr_init_copy(out, &name);
+	free(buf);
+}
+
+static bool store_stats_publish(struct regstore *inst, const struct fstr *key)
+{
+	if (!key && !inst->lock_stats) {
+		return false;
+	}
+	enum stat_kind first = key ? stat_gets : stat_lock_wait_p50;
+	enum stat_kind last = key ? stat_observer_p99 : stat_lock_wait_p99;
+	struct fstr names[stat_lock_wait_p99 + 1];
+	bool exists = false;
+	for (enum stat_kind kind = first; kind <= last; kind++) {
+		stat_name(&names[kind], key, kind);
+		exists = exists || binary_tree_get(&inst->store, &names[kind], sizeof(names[kind]), NULL);
+	}
+	for (enum stat_kind kind = first; kind <= last; kind++) {
+		struct reg *reg = exists ? NULL : reg_add(inst, &names[kind], stat_getter, NULL, NULL, NULL);
+		if (reg) {
+			struct stat_source *src = malloc(sizeof(*src));
+			src->inst = inst;
+			if (key) {
+				fstr_init_copy(&src->key, key);
+			} else {
+				fstr_init(&src->key);
+			}
+			src->kind = kind;
+			reg->getter_arg = src;
+			reg->stat_source = src;
+		}
+		fstr_destroy(&names[kind]);
+	}
+	return !exists;
+}
+
+bool regstore_stats_publish(struct regstore *inst, const struct fstr *key)
+{
+	write_lock(inst);
+	bool res = store_stats_publish(inst, key);
+	write_unlock(inst);
+	return res;
+}
+
+void regstore_init(struct regstore *inst)
+{
+	binary_tree_init(&inst->store, first_fstr_cmp, NULL, destroy_reg);
+	inst->count = 0;
+	inst->prefixes = prefix_node_new("", 0);
+	inst->patterns = pattern_node_new("", 0);
+	binary_tree_init(&inst->remotes, first_fstr_cmp, NULL, destroy_remote_subs);
+	binary_tree_init(&inst->strings, first_fstr_cmp, NULL, NULL);
+	inst->batched = NULL;
+	inst->batches = 0;
+	inst->batched_cap = 0;
+	inst->seq = 0;
+	inst->oldest = NULL;
+	inst->newest = NULL;
+	inst->journal = NULL;
+	inst->exported = NULL;
+	inst->stats = false;
+	inst->lock_stats = NULL;
+	inst->sampled = NULL;
+	inst->sampled_len = 0;
+	inst->sampled_cap = 0;
+	inst->deadlines = NULL;
+	inst->deadlines_len = 0;
+	inst->deadlines_cap = 0;
+	inst->concurrent = false;
+	inst->deferred = NULL;
+	inst->deferred_len = 0;
+	inst->deferred_cap = 0;
+	inst->delivery_next = 0;
+	inst->delivery_turn = 0;
+}
+
+void regstore_init_concurrent(struct regstore *inst)
+{
+	regstore_init(inst);
+	inst->concurrent = true;
+	pthread_rwlockattr_t attr;
+	pthread_rwlockattr_init(&attr);
+#if defined __GLIBC__
+	/* glibc prefers readers by default, so a steady stream of reads would starve writers */
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+	pthread_rwlock_init(&inst->lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+	pthread_mutex_init(&inst->cache_lock, NULL);
+	pthread_cond_init(&inst->cache_fetched, NULL);
+	pthread_mutex_init(&inst->delivery_lock, NULL);
+	pthread_cond_init(&inst->delivery_done, NULL);
+	inst->lock_stats = calloc(1, sizeof(*inst->lock_stats));
+}
+
+void regstore_destroy(struct regstore *inst)
+{
+	/* Registers remove themselves from the remote index */
+	binary_tree_destroy(&inst->store);
+	binary_tree_destroy(&inst->remotes);
+	for (size_t i = 0; i < inst->batches; i++) {
+		unintern(&inst->batched[i]);
+	}
+	free(inst->batched);
+	prefix_node_free(inst->prefixes);
+	pattern_node_free(inst->patterns);
+	/* Empty once everything referring to it is gone */
+	binary_tree_destroy(&inst->strings);
+	journal_release(inst->journal);
+	export_free(inst->exported);
+	free(inst->sampled);
+	free(inst->deadlines);
+	free(inst->deferred);
+	free(inst->lock_stats);
+	if (inst->concurrent) {
+		pthread_rwlock_destroy(&inst->lock);
+		pthread_mutex_destroy(&inst->cache_lock);
+		pthread_cond_destroy(&inst->cache_fetched);
+		pthread_mutex_destroy(&inst->delivery_lock);
+		pthread_cond_destroy(&inst->delivery_done);
+	}
+}
+
+#if defined TEST_regstore
+static struct fstr rem;
+
+#define nregs 4
+
+static struct testreg {
+	struct fstr k;
+	struct fstr v;
+	struct fstr w;
+} regs[nregs];
+
+static enum regstore_err getter(void *arg, struct fstr *value)
+{
+	fstr_copy(value, (const struct fstr *) arg);
+	return regstore_err_ok;
+}
+
+static enum regstore_err setter(void *arg, const struct fstr *value)
+{
+	fstr_copy((struct fstr *) arg, value);
+	return regstore_err_ok;
+}
+
+/* Sleep for a wait returned by regstore_tick */
+static void sleep_ms(int64_t ms)
+{
+	struct timespec ts = { .tv_sec = ms / 1000, .tv_nsec = ms % 1000 * 1000000 };
+	nanosleep(&ts, NULL);
+}
+
+static void observer(void *arg, const struct fstr *value)
+{
+	printf(" * Observer: " PRIfs " = " PRIfs "\n", prifs((struct fstr *) arg), prifs(value));
+}
+
+static void pattern_observer(void *arg, const struct fstr *key, const struct fstr *value)
+{
+	printf(" * Pattern observer %s: " PRIfs " = " PRIfs "\n", (const char *) arg, prifs(key), prifs(value));
+}
+
+static enum regstore_err typed_getter(void *arg, struct regstore_value *value)
+{
+	*value = *(struct regstore_value *) arg;
+	return regstore_err_ok;
+}
+
+static enum regstore_err typed_setter(void *arg, const struct regstore_value *value)
+{
+	*(struct regstore_value *) arg = *value;
+	return regstore_err_ok;
+}
+
+static enum regstore_err failing_typed_getter(void *arg, struct regstore_value *value)
+{
+	(void) arg;
+	(void) value;
+	return regstore_err_unknown;
+}
+
+static void typed_observer(void *arg, const struct regstore_value *value)
+{
+	printf(" * Typed observer: %s = %g\n", (const char *) arg, value->f);
+}
+
+static void batch_observer(void *arg, const struct regstore_change *changes, size_t count)
+{
+	(void) arg;
+	printf(" * Batch of %zu:", count);
+	for (size_t i = 0; i < count; i++) {
+		printf(" " PRIfs " = " PRIfs, prifs(&changes[i].key), prifs(&changes[i].value));
+	}
+	printf("\n");
+}
+
+static void counting_batch_observer(void *arg, const struct regstore_change *changes, size_t count)
+{
+	(void) changes;
+	*(size_t *) arg += count;
+}
+
+static void list_regs()
+{
+	printf("Listing registers\n");
+
+	for (size_t i = 0; i < nregs; i++) {
+		struct testreg *r = &regs[i];
+		printf(" * " PRIfs " = " PRIfs "\n", prifs(&r->k), prifs(&r->v));
+	}
+
+	printf("\n");
+}
+
+static void list_regs_ext(struct regstore *rs)
+{
+	printf("Listing registers\n");
+
+	struct binary_tree data;
+	regstore_list(rs, &data, &rem, true);
+
+	const struct regstore_reginfo *info;
+	struct binary_tree_iterator it;
+	binary_tree_iter_init(&it, &data, false);
+	while ((info = binary_tree_iter_next(&it, NULL))) {
+		printf(" * " PRIfs " [%c%c]%s = " PRIfs "\n", prifs(&info->name), info->type & rt_readable ? 'r' : '-', info->type & rt_writeable ? 'w' : '-', info->subscribed ? " [sub]" : "", prifs(&info->value));
+	}
+	binary_tree_iter_destroy(&it);
+
+	binary_tree_destroy(&data);
+
+	printf("\n");
+}
+
+static bool page_visitor(void *arg, const struct regstore_reginfo *info)
+{
+	struct fstr *last = arg;
+	printf(" * " PRIfs " = " PRIfs "\n", prifs(&info->name), prifs(&info->value));
+	fstr_copy(last, &info->name);
+	return false;
+}
+
+/* One register per page */
+static void page_regs(struct regstore *rs)
+{
+	printf("Paging registers\n");
+
+	struct fstr cursor = FSTR_INIT;
+	bool more = true;
+	for (size_t page = 0; more; page++) {
+		more = !regstore_each(rs, NULL, page ? &cursor : NULL, &rem, true, page_visitor, &cursor);
+	}
+	fstr_destroy(&cursor);
+
+	printf("\n");
 }
 
 #define testres(i, expr) \
@@ -366,127 +4033,1099 @@ static void list_regs_ext(struct regstore *rs)
 		} \
 	} while (0)
 
-static void init_test_data()
-{
-	fstr_init_ref(&rem, "test node");
+static void init_test_data()
+{
+	fstr_init_ref(&rem, "test node");
+
+	fstr_init_ref(&regs[0].k, "color");
+	fstr_init_ref(&regs[1].k, "size");
+	fstr_init_ref(&regs[2].k, "shape");
+	fstr_init_ref(&regs[3].k, "count");
+
+	fstr_init_ref(&regs[0].v, "red");
+	fstr_init_ref(&regs[1].v, "big");
+	fstr_init_ref(&regs[2].v, "round");
+	fstr_init_ref(&regs[3].v, "many");
+
+	fstr_init_ref(&regs[0].w, "blue");
+	fstr_init_ref(&regs[1].w, "small");
+	fstr_init_ref(&regs[2].w, "square");
+	fstr_init_ref(&regs[3].w, "few");
+}
+
+#define header(s) printf("\x1b[1m" s "\x1b[0m")
+
+static void test_list()
+{
+	header("List test\n");
+
+	struct regstore rs;
+
+	regstore_init(&rs);
+
+	/* Add registers */
+	for (size_t i = 0; i < nregs; i++) {
+		struct testreg *r = &regs[i];
+		if (!regstore_add(&rs, &r->k, i & 1 ? getter : NULL, &r->v, i & 2 ? setter : NULL, &r->v)) {
+			log_error("Failed to create register " PRIfs, prifs(&r->k));
+		}
+	}
+
+	list_regs_ext(&rs);
+
+	page_regs(&rs);
+
+	regstore_destroy(&rs);
+
+	printf("\n");
+}
+
+static void test_access()
+{
+	header("Access test\n");
+
+	struct regstore rs;
+
+	regstore_init(&rs);
+
+	/* Add registers */
+	for (size_t i = 0; i < nregs; i++) {
+		struct testreg *r = &regs[i];
+		if (!regstore_add(&rs, &r->k, i & 1 ? getter : NULL, &r->v, i & 2 ? setter : NULL, &r->v)) {
+			log_error("Failed to create register " PRIfs, prifs(&r->k));
+		}
+	}
+
+	list_regs(&rs);
+
+	printf("Reading registers\n");
+	for (size_t i = 0; i < nregs; i++) {
+		struct fstr v = FSTR_INIT;
+		testres(i, regstore_get(&rs, &regs[i].k, &v));
+		fstr_destroy(&v);
+	}
+	printf("\n");
+
+	printf("Reading registers in one batch\n");
+	struct fstr keys[nregs];
+	struct fstr values[nregs];
+	enum regstore_err results[nregs];
+	for (size_t i = 0; i < nregs; i++) {
+		keys[i] = regs[i].k;
+		fstr_init(&values[i]);
+	}
+	regstore_get_many(&rs, nregs, keys, values, results);
+	for (size_t i = 0; i < nregs; i++) {
+		printf(" * " PRIfs ": %s " PRIfs "\n", prifs(&keys[i]), regstore_errstr(results[i]), prifs(&values[i]));
+		fstr_destroy(&values[i]);
+	}
+	printf("\n");
+
+	printf("Writing registers\n");
+	for (size_t i = 0; i < nregs; i++) {
+		testres(i, regstore_set(&rs, &regs[i].k, &regs[i].w));
+	}
+	printf("\n");
+
+	list_regs(&rs);
+
+	regstore_destroy(&rs);
+
+	printf("\n");
+}
+
+static void test_obs()
+{
+	header("Observer test\n");
+
+	struct regstore rs;
+
+	regstore_init(&rs);
+
+	/* Add registers */
+	for (size_t i = 0; i < nregs; i++) {
+		struct testreg *r = &regs[i];
+		if (!regstore_add(&rs, &r->k, getter, &r->v, setter, &r->v)) {
+			log_error("Failed to create register " PRIfs, prifs(&r->k));
+		}
+	}
+
+	for (size_t i = 0; i < nregs; i++) {
+		struct testreg *r = &regs[i];
+		regstore_observe(&rs, &r->k, &rem, observer, &r->k, 1);
+	}
+
+	list_regs(&rs);
+
+	/* Test registers */
+	for (size_t i = 0; i < nregs; i++) {
+		testres(i, regstore_set(&rs, &regs[i].k, &regs[i].w));
+		struct fstr v = FSTR_INIT;
+		testres(i, regstore_get(&rs, &regs[i].k, &v));
+		fstr_destroy(&v);
+	}
+	printf("\n");
+
+	list_regs(&rs);
+
+	regstore_destroy(&rs);
+
+	fstr_destroy(&rem);
+
+	printf("\n");
+}
+
+static void test_throttle()
+{
+	header("Throttle test\n");
+
+	struct regstore rs;
+
+	regstore_init(&rs);
+
+	struct testreg *r = &regs[0];
+	if (!regstore_add(&rs, &r->k, getter, &r->v, setter, &r->v)) {
+		log_error("Failed to create register " PRIfs, prifs(&r->k));
+	}
+	regstore_observe(&rs, &r->k, &rem, observer, &r->k, 50);
+
+	/* First is sent, rest are coalesced into the last */
+	testres(0, regstore_set(&rs, &r->k, &regs[1].v));
+	testres(0, regstore_set(&rs, &r->k, &regs[2].v));
+	testres(0, regstore_set(&rs, &r->k, &regs[3].v));
+
+	int64_t wait;
+	while ((wait = regstore_tick(&rs)) >= 0) {
+		sleep_ms(wait);
+	}
+
+	regstore_destroy(&rs);
+
+	printf("\n");
+}
+
+static void test_handle()
+{
+	header("Handle test\n");
+
+	struct regstore rs;
+
+	regstore_init(&rs);
+
+	struct testreg *r = &regs[1];
+	if (!regstore_add(&rs, &r->k, getter, &r->v, setter, &r->v)) {
+		log_error("Failed to create register " PRIfs, prifs(&r->k));
+	}
+	regstore_observe(&rs, &r->k, &rem, observer, &r->k, 0);
+
+	struct regstore_handle *h = regstore_resolve(&rs, &r->k);
+	testres(1, regstore_set_h(h, &r->w));
+	testres(1, regstore_notify_h(h));
+
+	regstore_delete(&rs, &r->k);
+	if (regstore_set_h(h, &r->v) != regstore_err_invalid_key) {
+		log_error("Handle to deleted register " PRIfs " is still usable", prifs(&r->k));
+	}
+	regstore_release(h);
+
+	regstore_destroy(&rs);
+
+	printf("\n");
+}
+
+static void test_suppress()
+{
+	header("Suppress test\n");
+
+	struct regstore rs;
+
+	regstore_init(&rs);
+
+	struct testreg *r = &regs[2];
+	if (!regstore_add(&rs, &r->k, getter, &r->v, setter, &r->v)) {
+		log_error("Failed to create register " PRIfs, prifs(&r->k));
+	}
+	regstore_observe(&rs, &r->k, &rem, observer, &r->k, 0);
+	regstore_suppress_unchanged(&rs, &r->k, true);
+
+	/* Only the first set of each value is sent */
+	testres(2, regstore_set(&rs, &r->k, &r->w));
+	testres(2, regstore_set(&rs, &r->k, &r->w));
+	testres(2, regstore_notify(&rs, &r->k));
+	testres(2, regstore_set(&rs, &r->k, &regs[0].v));
+
+	regstore_destroy(&rs);
+
+	printf("\n");
+}
+
+static void test_typed()
+{
+	header("Typed test\n");
+
+	struct regstore rs;
+
+	regstore_init(&rs);
+
+	struct regstore_value gyro = { .type = regstore_type_float, .f = 0.5 };
+	struct fstr key;
+	fstr_init_ref(&key, "gyro");
+	regstore_add_typed(&rs, &key, regstore_type_float, typed_getter, &gyro, typed_setter, &gyro);
+	regstore_observe_typed(&rs, &key, &rem, typed_observer, "gyro");
+
+	/* Raw value to the typed observer, text only once a string observer exists */
+	struct regstore_value v = { .type = regstore_type_float, .f = 1.25 };
+	testres(0, regstore_set_typed(&rs, &key, &v));
+	regstore_observe(&rs, &key, &rem, observer, &key, 0);
+	v.f = -3;
+	testres(0, regstore_set_typed(&rs, &key, &v));
+
+	/* Parsed from text */
+	struct fstr text;
+	fstr_init_ref(&text, "2.5");
+	testres(0, regstore_set(&rs, &key, &text));
+	fstr_init_ref(&text, "2.5x");
+	if (regstore_set(&rs, &key, &text) != regstore_err_invalid_value) {
+		log_error("Invalid text accepted by typed register");
+	}
+	v.type = regstore_type_int;
+	if (regstore_set_typed(&rs, &key, &v) != regstore_err_invalid_value) {
+		log_error("Value of wrong type accepted by typed register");
+	}
+
+	/* Text is decimal, leading zeros included */
+	struct regstore_value count = { .type = regstore_type_int, .i = 0 };
+	struct fstr count_key;
+	fstr_init_ref(&count_key, "count");
+	regstore_add_typed(&rs, &count_key, regstore_type_int, typed_getter, &count, typed_setter, &count);
+	fstr_init_ref(&text, "010");
+	testres(0, regstore_set(&rs, &count_key, &text));
+	printf("010 = %" PRId64 "\n", count.i);
+	fstr_init_ref(&text, "08");
+	testres(0, regstore_set(&rs, &count_key, &text));
+	printf("08 = %" PRId64 "\n", count.i);
+
+	/* Observers get the value written if it cannot be read back */
+	struct fstr broken;
+	fstr_init_ref(&broken, "broken");
+	regstore_add_typed(&rs, &broken, regstore_type_float, failing_typed_getter, NULL, typed_setter, &gyro);
+	regstore_observe_typed(&rs, &broken, &rem, typed_observer, "broken");
+	v.type = regstore_type_float;
+	v.f = 7;
+	testres(0, regstore_set_typed(&rs, &broken, &v));
+
+	/* Blobs longer than REGSTORE_BLOB_MAX are rejected, not formatted */
+	struct regstore_value blob = { .type = regstore_type_blob, .blob = { .len = 2 } };
+	struct fstr blob_key;
+	fstr_init_ref(&blob_key, "blob");
+	regstore_add_typed(&rs, &blob_key, regstore_type_blob, typed_getter, &blob, typed_setter, &blob);
+	v.type = regstore_type_blob;
+	v.blob.len = REGSTORE_BLOB_MAX + 1;
+	if (regstore_set_typed(&rs, &blob_key, &v) != regstore_err_invalid_value) {
+		log_error("Oversized blob accepted by typed register");
+	}
+	blob.blob.len = REGSTORE_BLOB_MAX * 4;
+	if (regstore_get_typed(&rs, &blob_key, &v) != regstore_err_invalid_value) {
+		log_error("Oversized blob returned by typed getter");
+	}
+
+	fstr_init(&text);
+	testres(0, regstore_get(&rs, &key, &text));
+	printf("Text: " PRIfs "\n", prifs(&text));
+	fstr_destroy(&text);
+
+	regstore_destroy(&rs);
+
+	printf("\n");
+}
+
+static void test_remote()
+{
+	header("Remote index test\n");
+
+	struct regstore rs;
+
+	regstore_init(&rs);
+
+	for (size_t i = 0; i < nregs; i++) {
+		struct testreg *r = &regs[i];
+		if (!regstore_add(&rs, &r->k, getter, &r->v, setter, &r->v)) {
+			log_error("Failed to create register " PRIfs, prifs(&r->k));
+		}
+		if (i != 1) {
+			regstore_observe(&rs, &r->k, &rem, observer, &r->k, 0);
+		}
+	}
+	struct fstr other, all;
+	fstr_init_ref(&other, "other node");
+	fstr_init_ref(&all, "**");
+	regstore_observe(&rs, &regs[1].k, &other, observer, &regs[1].k, 0);
+	regstore_observe_pattern(&rs, &all, &rem, pattern_observer, "**");
+	regstore_delete(&rs, &regs[2].k);
+
+	/* Listed without visiting unsubscribed registers */
+	struct binary_tree data;
+	regstore_list_subscriptions(&rs, &data, &rem, false);
+	const struct regstore_reginfo *info;
+	struct binary_tree_iterator it;
+	binary_tree_iter_init(&it, &data, false);
+	while ((info = binary_tree_iter_next(&it, NULL))) {
+		printf(" * Subscribed: " PRIfs "\n", prifs(&info->name));
+	}
+	binary_tree_iter_destroy(&it);
+	binary_tree_destroy(&data);
+
+	size_t n = regstore_unobserve_all(&rs, &rem);
+	if (n != 3 || regstore_unobserve_all(&rs, &rem) != 0) {
+		log_error("Unexpected subscription count %zu after disconnect", n);
+	}
+	/* Only the other node is notified */
+	regstore_notify_prefix(&rs, NULL);
+
+	fstr_destroy(&other);
+	fstr_destroy(&all);
+
+	regstore_destroy(&rs);
+
+	printf("\n");
+}
+
+static void test_batch()
+{
+	header("Batch test\n");
+
+	struct regstore rs;
+
+	regstore_init(&rs);
+
+	for (size_t i = 0; i < nregs; i++) {
+		struct testreg *r = &regs[i];
+		if (!regstore_add(&rs, &r->k, getter, &r->v, setter, &r->v)) {
+			log_error("Failed to create register " PRIfs, prifs(&r->k));
+		}
+		regstore_observe(&rs, &r->k, &rem, observer, &r->k, 0);
+	}
+	regstore_batch(&rs, &rem, batch_observer, NULL, 20);
+
+	/* Both sets of the first register coalesce into one change */
+	testres(0, regstore_set(&rs, &regs[0].k, &regs[0].w));
+	testres(1, regstore_set(&rs, &regs[1].k, &regs[1].w));
+	testres(0, regstore_set(&rs, &regs[0].k, &regs[2].w));
+	regstore_flush(&rs, &rem);
+
+	/* Flushed by tick once the interval has passed */
+	testres(3, regstore_set(&rs, &regs[3].k, &regs[3].w));
+	int64_t wait;
+	while ((wait = regstore_tick(&rs)) >= 0) {
+		sleep_ms(wait);
+	}
+
+	/* Pending changes are flushed, then delivered individually */
+	testres(2, regstore_set(&rs, &regs[2].k, &regs[2].w));
+	regstore_unbatch(&rs, &rem);
+	testres(2, regstore_set(&rs, &regs[2].k, &regs[1].w));
+
+	/* Disconnecting discards the queued change, the other batch is kept */
+	struct fstr other;
+	fstr_init_ref(&other, "other node");
+	size_t dropped = 0, kept = 0;
+	regstore_observe(&rs, &regs[1].k, &other, observer, &regs[1].k, 0);
+	regstore_batch(&rs, &rem, counting_batch_observer, &dropped, 0);
+	regstore_batch(&rs, &other, counting_batch_observer, &kept, 0);
+	testres(1, regstore_set(&rs, &regs[1].k, &regs[1].w));
+	regstore_unobserve_all(&rs, &rem);
+	regstore_flush(&rs, NULL);
+	if (dropped != 0 || kept != 1) {
+		log_error("Batch not discarded on disconnect, %zu and %zu delivered", dropped, kept);
+	}
+	fstr_destroy(&other);
+
+	regstore_destroy(&rs);
+
+	printf("\n");
+}
+
+static void test_txn()
+{
+	header("Transaction test\n");
+
+	struct regstore rs;
+
+	regstore_init(&rs);
+
+	for (size_t i = 0; i < 2; i++) {
+		struct testreg *r = &regs[i];
+		regstore_add(&rs, &r->k, getter, &r->v, setter, &r->v);
+		regstore_observe(&rs, &r->k, &rem, observer, &r->k, 0);
+	}
+	struct regstore_value gain = { .type = regstore_type_int, .i = 5 };
+	struct fstr key;
+	fstr_init_ref(&key, "gain");
+	regstore_add_typed(&rs, &key, regstore_type_int, typed_getter, &gain, typed_setter, &gain);
+	regstore_observe(&rs, &key, &rem, observer, &key, 0);
+	/* Reads back something other than what was written */
+	struct fstr echo, stale, written = FSTR_INIT;
+	fstr_init_ref(&echo, "echo");
+	fstr_init_ref(&stale, "stale");
+	regstore_add(&rs, &echo, getter, &stale, setter, &written);
+	regstore_observe(&rs, &echo, &rem, observer, &echo, 0);
+
+	/* One notification per register, with the last value staged for it, not read back */
+	struct regstore_txn txn;
+	regstore_txn_init(&txn);
+	regstore_txn_set(&txn, &regs[0].k, &regs[1].w);
+	regstore_txn_set(&txn, &regs[1].k, &regs[1].w);
+	regstore_txn_set(&txn, &regs[0].k, &regs[0].w);
+	regstore_txn_set(&txn, &echo, &regs[2].w);
+	size_t failed;
+	if (regstore_txn_commit(&rs, &txn, &failed) != regstore_err_ok) {
+		log_error("Transaction failed at %zu", failed);
+	}
+	regstore_txn_destroy(&txn);
+
+	/* Invalid value for gain, nothing is applied or notified */
+	struct fstr text;
+	fstr_init_ref(&text, "x");
+	regstore_txn_set(&txn, &regs[0].k, &regs[2].w);
+	regstore_txn_set(&txn, &key, &text);
+	if (regstore_txn_commit(&rs, &txn, &failed) != regstore_err_invalid_value || failed != 1) {
+		log_error("Invalid transaction was not refused");
+	}
+	if (fstr_cmp(&regs[0].v, &regs[0].w) != 0 || gain.i != 5) {
+		log_error("Failed transaction was not rolled back");
+	}
+	regstore_txn_destroy(&txn);
 
-	fstr_init_ref(&regs[0].k, "color");
-	fstr_init_ref(&regs[1].k, "size");
-	fstr_init_ref(&regs[2].k, "shape");
-	fstr_init_ref(&regs[3].k, "count");
+	/* Missing key, refused before anything is set */
+	fstr_init_ref(&text, "nope");
+	regstore_txn_set(&txn, &regs[1].k, &regs[2].w);
+	regstore_txn_set(&txn, &text, &text);
+	if (regstore_txn_commit(&rs, &txn, NULL) != regstore_err_invalid_key || fstr_cmp(&regs[1].v, &regs[1].w) != 0) {
+		log_error("Transaction with missing key was not refused");
+	}
+	regstore_txn_destroy(&txn);
 
-	fstr_init_ref(&regs[0].v, "red");
-	fstr_init_ref(&regs[1].v, "big");
-	fstr_init_ref(&regs[2].v, "round");
-	fstr_init_ref(&regs[3].v, "many");
+	regstore_destroy(&rs);
+	fstr_destroy(&written);
 
-	fstr_init_ref(&regs[0].w, "blue");
-	fstr_init_ref(&regs[1].w, "small");
-	fstr_init_ref(&regs[2].w, "square");
-	fstr_init_ref(&regs[3].w, "few");
+	printf("\n");
 }
 
-#define header(s) printf("\x1b[1m" s "\x1b[0m")
+static bool change_visitor(void *arg, const struct regstore_reginfo *info)
+{
+	(void) arg;
+	printf(" * " PRIfs " v%" PRIu64 " = " PRIfs "\n", prifs(&info->name), info->version, prifs(&info->value));
+	return true;
+}
 
-static void test_list()
+static void test_versions()
 {
-	header("List test\n");
+	header("Version test\n");
 
 	struct regstore rs;
 
 	regstore_init(&rs);
 
-	/* Add registers */
 	for (size_t i = 0; i < nregs; i++) {
 		struct testreg *r = &regs[i];
-		if (!regstore_add(&rs, &r->k, i & 1 ? getter : NULL, &r->v, i & 2 ? setter : NULL, &r->v)) {
-			log_error("Failed to create register " PRIfs, prifs(&r->k));
-		}
+		regstore_add(&rs, &r->k, getter, &r->v, setter, &r->v);
+	}
+	uint64_t seq = regstore_seq(&rs);
+	if (seq != nregs) {
+		log_error("Unexpected sequence number %" PRIu64, seq);
 	}
 
-	list_regs_ext(&rs);
+	/* Only the registers changed since, oldest first, each once */
+	testres(2, regstore_set(&rs, &regs[2].k, &regs[2].w));
+	testres(0, regstore_set(&rs, &regs[0].k, &regs[0].w));
+	testres(2, regstore_notify(&rs, &regs[2].k));
+	seq = regstore_changes_since(&rs, seq, NULL, change_visitor, NULL);
+	if (seq != regstore_seq(&rs) || regstore_changes_since(&rs, seq, NULL, change_visitor, NULL) != seq) {
+		log_error("Changes reported twice");
+	}
+
+	/* Removed registers leave the list */
+	regstore_delete(&rs, &regs[0].k);
+	testres(1, regstore_notify(&rs, &regs[1].k));
+	regstore_changes_since(&rs, seq, NULL, change_visitor, NULL);
 
 	regstore_destroy(&rs);
 
 	printf("\n");
 }
 
-static void test_access()
+static void test_add_many()
 {
-	header("Access test\n");
+	header("Add many test\n");
 
 	struct regstore rs;
 
 	regstore_init(&rs);
 
-	/* Add registers */
+	regstore_add(&rs, &regs[3].k, getter, &regs[3].v, setter, &regs[3].v);
+	uint64_t seq = regstore_seq(&rs);
+
+	/* Sorted, so inserted median first, but versioned in this order; count is skipped */
+	const size_t order[nregs] = { 0, 3, 2, 1 };
+	struct regstore_def defs[nregs];
 	for (size_t i = 0; i < nregs; i++) {
-		struct testreg *r = &regs[i];
-		if (!regstore_add(&rs, &r->k, i & 1 ? getter : NULL, &r->v, i & 2 ? setter : NULL, &r->v)) {
-			log_error("Failed to create register " PRIfs, prifs(&r->k));
-		}
+		struct testreg *r = &regs[order[i]];
+		defs[i] = (struct regstore_def) { r->k, getter, &r->v, setter, &r->v };
 	}
+	size_t added = regstore_add_many(&rs, nregs, defs);
+	printf(" * Added %zu registers\n", added);
+	regstore_changes_since(&rs, seq, NULL, change_visitor, NULL);
 
-	list_regs(&rs);
-
-	printf("Reading registers\n");
-	for (size_t i = 0; i < nregs; i++) {
+	/* The first of repeated keys is added, whether or not they are sorted */
+	struct fstr key, first, later;
+	fstr_init_ref(&key, "repeated");
+	fstr_init_ref(&first, "first");
+	fstr_init_ref(&later, "later");
+	for (size_t sorted = 0; sorted < 2; sorted++) {
+		struct regstore_def repeats[] = {
+			{ sorted ? regs[3].k : key, getter, &first, setter, &first },
+			{ key, getter, &first, setter, &first },
+			{ key, getter, &later, setter, &later },
+			{ key, getter, &later, setter, &later },
+			{ sorted ? key : regs[3].k, getter, &later, setter, &later }
+		};
+		regstore_delete(&rs, &key);
+		added = regstore_add_many(&rs, sizeof(repeats) / sizeof(repeats[0]), repeats);
 		struct fstr v = FSTR_INIT;
-		testres(i, regstore_get(&rs, &regs[i].k, &v));
+		regstore_get(&rs, &key, &v);
+		if (added != 1 || fstr_cmp(&v, &first) != 0) {
+			log_error("Repeated key resolved to " PRIfs " with %zu added", prifs(&v), added);
+		}
 		fstr_destroy(&v);
 	}
+
+	regstore_destroy(&rs);
+
 	printf("\n");
+}
 
-	printf("Writing registers\n");
-	for (size_t i = 0; i < nregs; i++) {
-		testres(i, regstore_set(&rs, &regs[i].k, &regs[i].w));
+static void print_journal(struct regstore_journal_cursor *cursor)
+{
+	struct regstore_journal_record rec;
+	while (regstore_journal_next(cursor, &rec)) {
+		printf(" * %" PRIu64 " " PRIfs " = " PRIfs "%s\n", rec.seq, prifs(&rec.key), prifs(&rec.value), rec.truncated ? " (truncated)" : "");
+	}
+	printf("Lost %" PRIu64 "\n", cursor->lost);
+}
+
+static void test_journal()
+{
+	header("Journal test\n");
+
+	struct regstore rs;
+
+	regstore_init(&rs);
+
+	struct testreg *r = &regs[0];
+	regstore_add(&rs, &r->k, getter, &r->v, setter, &r->v);
+	struct regstore_value gain = { .type = regstore_type_int, .i = 5 };
+	struct fstr key;
+	fstr_init_ref(&key, "gain");
+	regstore_add_typed(&rs, &key, regstore_type_int, typed_getter, &gain, typed_setter, &gain);
+	regstore_journal_enable(&rs, 4, 12);
+
+	/* Typed values are journaled as text, long ones cut short */
+	testres(0, regstore_set(&rs, &r->k, &regs[1].w));
+	testres(0, regstore_notify(&rs, &r->k));
+	gain.i = -12;
+	regstore_notify(&rs, &key);
+	struct fstr text;
+	fstr_init_ref(&text, "a value too long for the journal");
+	testres(0, regstore_set(&rs, &r->k, &text));
+	struct regstore_journal_cursor replay, tail;
+	regstore_journal_replay(&rs, &replay);
+	regstore_journal_tail(&rs, &tail);
+	print_journal(&replay);
+
+	/* A reader falling behind by more than the capacity loses the oldest */
+	for (size_t i = 0; i < nregs + 2; i++) {
+		testres(0, regstore_set(&rs, &r->k, &regs[i % nregs].w));
 	}
+	print_journal(&tail);
+
+	/* Cursors outlive the journal they read */
+	regstore_journal_enable(&rs, 0, 0);
+	print_journal(&replay);
+	regstore_journal_cursor_destroy(&replay);
+	regstore_journal_cursor_destroy(&tail);
+
+	regstore_destroy(&rs);
+
 	printf("\n");
+}
 
-	list_regs(&rs);
+static size_t slow_reads;
+
+static enum regstore_err slow_getter(void *arg, struct fstr *value)
+{
+	slow_reads++;
+	return getter(arg, value);
+}
+
+static void test_cache()
+{
+	header("Cache test\n");
+
+	struct regstore rs;
+
+	regstore_init(&rs);
+
+	struct testreg *r = &regs[0];
+	regstore_add(&rs, &r->k, slow_getter, &r->v, setter, &r->v);
+	regstore_observe(&rs, &r->k, &rem, observer, &r->k, 0);
+	regstore_cache(&rs, &r->k, 1000);
+
+	/* One read fills the cache for get and notify, set empties it */
+	struct fstr v = FSTR_INIT;
+	testres(0, regstore_get(&rs, &r->k, &v));
+	testres(0, regstore_get(&rs, &r->k, &v));
+	testres(0, regstore_notify(&rs, &r->k));
+	testres(0, regstore_set(&rs, &r->k, &regs[1].w));
+	testres(0, regstore_get(&rs, &r->k, &v));
+	if (slow_reads != 2 || fstr_cmp(&v, &regs[1].w) != 0) {
+		log_error("Unexpected getter calls (%zu) or stale value", slow_reads);
+	}
+	fstr_destroy(&v);
+
+	struct binary_tree data;
+	regstore_list(&rs, &data, NULL, true);
+	const struct regstore_reginfo *info = binary_tree_get(&data, &r->k, sizeof(r->k), NULL);
+	printf("Hits %" PRIu64 ", misses %" PRIu64 "\n", info->cache_hits, info->cache_misses);
+	binary_tree_destroy(&data);
 
 	regstore_destroy(&rs);
 
 	printf("\n");
 }
 
-static void test_obs()
+static void print_stat(struct regstore *rs, const char *name)
 {
-	header("Observer test\n");
+	struct fstr key;
+	fstr_init_ref(&key, name);
+	struct fstr v = FSTR_INIT;
+	enum regstore_err err = regstore_get(rs, &key, &v);
+	if (err == regstore_err_ok) {
+		printf("%s = " PRIfs "\n", name, prifs(&v));
+	} else {
+		printf("%s: %s\n", name, regstore_errstr(err));
+	}
+	fstr_destroy(&v);
+}
+
+static void test_stats()
+{
+	header("Stats test\n");
+
+	struct regstore rs;
+
+	regstore_init(&rs);
+
+	struct testreg *r = &regs[0];
+	struct fstr val = FSTR_INIT;
+	fstr_copy(&val, &r->v);
+	regstore_add(&rs, &r->k, getter, &val, setter, &val);
+	regstore_observe(&rs, &r->k, &rem, observer, &r->k, 1000);
+	regstore_stats_enable(&rs, true);
+	if (!regstore_stats_publish(&rs, &r->k) || regstore_stats_publish(&rs, &r->k) || regstore_stats_publish(&rs, NULL)) {
+		log_error("Unexpected stats publish result");
+	}
+
+	/* The second notification is held back by min_interval */
+	struct fstr v = FSTR_INIT;
+	testres(0, regstore_get(&rs, &r->k, &v));
+	testres(0, regstore_notify(&rs, &r->k));
+	testres(0, regstore_set(&rs, &r->k, &r->w));
+	fstr_destroy(&v);
+
+	struct regstore_stats stats;
+	if (!regstore_stats(&rs, &r->k, &stats)) {
+		log_error("No stats");
+	}
+	printf("Gets %" PRIu64 ", sets %" PRIu64 ", notifies %" PRIu64 ", rate limited %" PRIu64 ", observer calls %" PRIu64 "\n", stats.gets, stats.sets, stats.notifies, stats.rate_limited, regstore_histogram_count(&stats.observer_us));
+	print_stat(&rs, "_stats.color.sets");
+	print_stat(&rs, "_stats.color.rate_limited");
+
+	/* Published stats outlive their register, but are not readable */
+	regstore_delete(&rs, &r->k);
+	print_stat(&rs, "_stats.color.gets");
+	regstore_add(&rs, &r->k, getter, &val, setter, &val);
+	print_stat(&rs, "_stats.color.gets");
+	regstore_stats_enable(&rs, false);
+	print_stat(&rs, "_stats.color.gets");
+
+	regstore_destroy(&rs);
+	fstr_destroy(&val);
+
+	/* Concurrent stores also time waits for the lock */
+	regstore_init_concurrent(&rs);
+	regstore_stats_enable(&rs, true);
+	regstore_stats_publish(&rs, NULL);
+	struct fstr key;
+	fstr_init_ref(&key, "_stats.lock_wait_p99_us");
+	testres(0, regstore_get(&rs, &key, &v));
+	fstr_destroy(&v);
+	struct regstore_histogram wait;
+	if (!regstore_lock_stats(&rs, &wait) || regstore_histogram_count(&wait) == 0) {
+		log_error("Lock waits not recorded");
+	}
+	regstore_destroy(&rs);
+
+	printf("\n");
+}
+
+static void test_sample()
+{
+	header("Sample test\n");
+
+	struct regstore rs;
+
+	regstore_init(&rs);
+
+	struct testreg *r = &regs[0];
+	regstore_add(&rs, &r->k, slow_getter, &r->v, NULL, NULL);
+	regstore_sample(&rs, &r->k, 10);
+
+	/* Nothing is polled until observed */
+	slow_reads = 0;
+	if (regstore_tick(&rs) != -1 || slow_reads) {
+		log_error("Unobserved register sampled");
+	}
+	regstore_observe(&rs, &r->k, &rem, observer, &r->k, 0);
+
+	/* The first sample is notified, then only changes */
+	for (int i = 0; i < 6; i++) {
+		if (i == 3) {
+			fstr_copy(&r->v, fstr_cmp(&r->v, &regs[2].w) ? &regs[2].w : &regs[3].w);
+		}
+		int64_t wait = regstore_tick(&rs);
+		sleep_ms(wait);
+	}
+	printf("Samples taken: %zu\n", slow_reads);
+
+	regstore_unobserve(&rs, &r->k, &rem);
+	if (regstore_tick(&rs) != -1) {
+		log_error("Sampling continued after unsubscribe");
+	}
+
+	regstore_destroy(&rs);
+
+	printf("\n");
+}
+
+static void print_mirrored(const struct regstore_mirror *mirror, const struct fstr *key)
+{
+	char buf[16];
+	struct regstore_mirror_value value;
+	ptrdiff_t slot = regstore_mirror_find(mirror, fstr_get(key), fstr_len(key));
+	if (slot < 0 || !regstore_mirror_read(mirror, slot, buf, sizeof(buf), &value)) {
+		printf(" * Mirror: " PRIfs " not available\n", prifs(key));
+		return;
+	}
+	printf(" * Mirror: " PRIfs " v%" PRIu64 " = %.*s%s\n", prifs(key), value.version, (int) value.len, buf, value.truncated ? " (truncated)" : "");
+}
+
+static void test_export()
+{
+	header("Export test\n");
 
 	struct regstore rs;
 
 	regstore_init(&rs);
 
-	/* Add registers */
 	for (size_t i = 0; i < nregs; i++) {
 		struct testreg *r = &regs[i];
-		if (!regstore_add(&rs, &r->k, getter, &r->v, setter, &r->v)) {
-			log_error("Failed to create register " PRIfs, prifs(&r->k));
-		}
+		regstore_add(&rs, &r->k, getter, &r->v, setter, &r->v);
+	}
+	if (!regstore_export_open(&rs, "/regstore_test", 2, 8, 8)) {
+		log_error("Failed to export registers");
+		regstore_destroy(&rs);
+		return;
+	}
+	testres(0, regstore_set(&rs, &regs[0].k, &regs[0].w));
+	regstore_export_register(&rs, &regs[0].k);
+	regstore_export_register(&rs, &regs[1].k);
+	if (regstore_export_register(&rs, &regs[2].k)) {
+		log_error("Exported more registers than the segment holds");
+	}
+
+	struct regstore_mirror mirror;
+	if (!regstore_mirror_open(&mirror, "/regstore_test")) {
+		log_error("Failed to open mirror");
+		regstore_destroy(&rs);
+		return;
+	}
+	/* Current on export, then updated by sets and cut short to the slot */
+	print_mirrored(&mirror, &regs[0].k);
+	print_mirrored(&mirror, &regs[2].k);
+	struct fstr long_value;
+	fstr_init_ref(&long_value, "a value too long for its slot");
+	testres(1, regstore_set(&rs, &regs[1].k, &long_value));
+	print_mirrored(&mirror, &regs[1].k);
+	testres(1, regstore_set(&rs, &regs[1].k, &regs[1].w));
+	print_mirrored(&mirror, &regs[1].k);
+
+	regstore_delete(&rs, &regs[0].k);
+	print_mirrored(&mirror, &regs[0].k);
+	regstore_export_open(&rs, NULL, 0, 0, 0);
+	if (regstore_mirror_valid(&mirror)) {
+		log_error("Mirror still valid after export stopped");
+	}
+	regstore_mirror_close(&mirror);
+
+	regstore_destroy(&rs);
+
+	printf("\n");
+}
+
+static void test_snapshot()
+{
+	header("Snapshot test\n");
+
+	const char *path = "/tmp/regstore_test.snap";
+	struct fstr saved[nregs];
+	struct fstr loaded[nregs];
+
+	struct regstore rs;
+
+	regstore_init(&rs);
+
+	for (size_t i = 0; i < nregs; i++) {
+		struct testreg *r = &regs[i];
+		fstr_init_copy(&saved[i], &r->v);
+		regstore_add(&rs, &r->k, getter, &saved[i], setter, &saved[i]);
+	}
+	/* Read-only, so not saved */
+	struct fstr serial;
+	fstr_init_ref(&serial, "serial");
+	regstore_add(&rs, &serial, getter, &serial, NULL, NULL);
+
+	/* One full save, then appends of what changed */
+	uint64_t seq = regstore_snapshot_save(&rs, path, 0);
+	testres(0, regstore_set(&rs, &regs[0].k, &regs[0].w));
+	seq = regstore_snapshot_save(&rs, path, seq);
+	struct fstr green;
+	fstr_init_ref(&green, "green");
+	testres(1, regstore_set(&rs, &regs[1].k, &regs[1].w));
+	testres(0, regstore_set(&rs, &regs[0].k, &green));
+	seq = regstore_snapshot_save(&rs, path, seq);
+	if (!seq) {
+		log_error("Failed to save snapshot");
 	}
 
+	regstore_destroy(&rs);
+
+	/* Restored into a new store, each register taking its last value */
+	regstore_init(&rs);
+
 	for (size_t i = 0; i < nregs; i++) {
 		struct testreg *r = &regs[i];
-		regstore_observe(&rs, &r->k, &rem, observer, &r->k, 1);
+		fstr_init(&loaded[i]);
+		regstore_add(&rs, &r->k, getter, &loaded[i], setter, &loaded[i]);
+	}
+	regstore_add(&rs, &serial, getter, &serial, NULL, NULL);
+	size_t restored = 0;
+	if (!regstore_snapshot_restore(&rs, path, &restored)) {
+		log_error("Failed to restore snapshot");
+	}
+	printf(" * Restored %zu registers\n", restored);
+	for (size_t i = 0; i < nregs; i++) {
+		printf(" * " PRIfs " = " PRIfs "\n", prifs(&regs[i].k), prifs(&loaded[i]));
+	}
+	if (regstore_snapshot_restore(&rs, "/tmp/regstore_test.missing", NULL)) {
+		log_error("Restored a missing snapshot");
 	}
 
-	list_regs(&rs);
+	regstore_destroy(&rs);
+	unlink(path);
 
-	/* Test registers */
 	for (size_t i = 0; i < nregs; i++) {
-		testres(i, regstore_set(&rs, &regs[i].k, &regs[i].w));
-		struct fstr v = FSTR_INIT;
-		testres(i, regstore_get(&rs, &regs[i].k, &v));
-		fstr_destroy(&v);
+		fstr_destroy(&saved[i]);
+		fstr_destroy(&loaded[i]);
 	}
+
 	printf("\n");
+}
 
-	list_regs(&rs);
+static void *count_iter(void *arg, struct binary_tree_node *node)
+{
+	(void) node;
+	(*(size_t *) arg)++;
+	return NULL;
+}
+
+static void test_intern()
+{
+	header("Intern test\n");
+
+	struct regstore rs;
+
+	regstore_init(&rs);
+
+	/* One copy of the remote name however many subscriptions use it */
+	for (size_t i = 0; i < nregs; i++) {
+		struct testreg *r = &regs[i];
+		regstore_add(&rs, &r->k, getter, &r->v, NULL, NULL);
+		regstore_observe(&rs, &r->k, &rem, observer, &r->k, 0);
+	}
+	struct fstr pattern;
+	fstr_init_ref(&pattern, "**");
+	regstore_observe_pattern(&rs, &pattern, &rem, pattern_observer, "**");
+	size_t count = 0;
+	binary_tree_each(&rs.strings, count_iter, &count);
+	printf("Strings held: %zu\n", count);
+
+	/* Released with the last subscription */
+	regstore_unobserve_all(&rs, &rem);
+	count = 0;
+	binary_tree_each(&rs.strings, count_iter, &count);
+	printf("Strings held: %zu\n", count);
 
 	regstore_destroy(&rs);
 
-	fstr_destroy(&rem);
+	printf("\n");
+}
+
+struct concurrent_test {
+	struct regstore *rs;
+	struct testreg *r;
+	atomic_size_t notified;
+	atomic_bool done;
+	struct fstr last; /* Calls are made in turn, so unguarded */
+};
+
+/* Reads back through the store, which would deadlock under the write lock */
+static void concurrent_observer(void *arg, const struct fstr *value)
+{
+	struct concurrent_test *t = arg;
+	struct fstr v = FSTR_INIT;
+	testres(0, regstore_get(t->rs, &t->r->k, &v));
+	fstr_destroy(&v);
+	fstr_copy(&t->last, value);
+	atomic_fetch_add(&t->notified, 1);
+}
+
+/* Arg is freed once unobserved, so a later call is a use after free */
+static void counting_observer(void *arg, const struct fstr *value)
+{
+	(void) value;
+	(*(size_t *) arg)++;
+}
+
+static void *concurrent_reader(void *arg)
+{
+	struct concurrent_test *t = arg;
+	struct fstr v = FSTR_INIT;
+	while (!atomic_load(&t->done)) {
+		testres(0, regstore_get(t->rs, &t->r->k, &v));
+	}
+	fstr_destroy(&v);
+	return NULL;
+}
+
+static void *concurrent_writer(void *arg)
+{
+	struct concurrent_test *t = arg;
+	for (int i = 0; i < 1000; i++) {
+		testres(0, regstore_set(t->rs, &t->r->k, i & 1 ? &regs[1].w : &regs[2].w));
+	}
+	return NULL;
+}
+
+static void test_concurrent()
+{
+	header("Concurrent test\n");
+
+	struct regstore rs;
+
+	regstore_init_concurrent(&rs);
+
+	struct testreg *r = &regs[0];
+	struct fstr store = FSTR_INIT;
+	fstr_copy(&store, &r->v);
+	regstore_add(&rs, &r->k, getter, &store, setter, &store);
+	regstore_cache(&rs, &r->k, 1);
+
+	struct concurrent_test t = {
+		.rs = &rs,
+		.r = r,
+		.notified = 0,
+		.done = false,
+		.last = FSTR_INIT
+	};
+	regstore_observe(&rs, &r->k, &rem, concurrent_observer, &t, 0);
+	struct fstr counter_remote;
+	fstr_init_ref(&counter_remote, "counter");
+	size_t *counted = calloc(1, sizeof(*counted));
+	regstore_observe(&rs, &r->k, &counter_remote, counting_observer, counted, 0);
+
+	pthread_t readers[4];
+	pthread_t writers[2];
+	for (size_t i = 0; i < 4; i++) {
+		pthread_create(&readers[i], NULL, concurrent_reader, &t);
+	}
+	for (size_t i = 0; i < 2; i++) {
+		pthread_create(&writers[i], NULL, concurrent_writer, &t);
+	}
+	regstore_unobserve(&rs, &r->k, &counter_remote);
+	free(counted);
+	for (size_t i = 0; i < 2; i++) {
+		pthread_join(writers[i], NULL);
+	}
+	atomic_store(&t.done, true);
+	for (size_t i = 0; i < 4; i++) {
+		pthread_join(readers[i], NULL);
+	}
+	printf("Notifications: %zu\n", atomic_load(&t.notified));
+	if (fstr_cmp(&t.last, &store) != 0) {
+		log_error("Observer left with a stale value");
+	}
+
+	regstore_destroy(&rs);
+	fstr_destroy(&store);
+	fstr_destroy(&t.last);
+
+	printf("\n");
+}
+
+static void test_pattern()
+{
+	header("Pattern test\n");
+
+	struct regstore rs;
+
+	regstore_init(&rs);
+
+	static const char *keys[] = { "eps.bat1.v", "eps.bat1.i", "eps.bat2.v", "eps" };
+	struct fstr v;
+	fstr_init_ref(&v, "1");
+	for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+		regstore_add_s(&rs, keys[i], getter, &v, setter, &v);
+	}
+
+	struct fstr one, all;
+	fstr_init_ref(&one, "eps.*.v");
+	fstr_init_ref(&all, "eps.**");
+	regstore_observe_pattern(&rs, &one, &rem, pattern_observer, "eps.*.v");
+	regstore_observe_pattern(&rs, &all, &rem, pattern_observer, "eps.**");
+
+	/* Both match bat1.v, only "**" matches bat1.i and eps itself */
+	regstore_notify_prefix(&rs, NULL);
+
+	if (!regstore_unobserve_pattern(&rs, &all, &rem) || regstore_unobserve_pattern(&rs, &all, &rem)) {
+		log_error("Failed to unsubscribe pattern " PRIfs, prifs(&all));
+	}
+	regstore_notify_prefix(&rs, NULL);
+
+	fstr_destroy(&one);
+	fstr_destroy(&all);
+	fstr_destroy(&v);
+
+	regstore_destroy(&rs);
 
 	printf("\n");
 }
@@ -501,6 +5140,24 @@ int main(int argc, char *argv[])
 	test_list();
 	test_access();
 	test_obs();
+	test_throttle();
+	test_handle();
+	test_pattern();
+	test_suppress();
+	test_typed();
+	test_remote();
+	test_batch();
+	test_txn();
+	test_versions();
+	test_add_many();
+	test_journal();
+	test_cache();
+	test_stats();
+	test_sample();
+	test_intern();
+	test_export();
+	test_snapshot();
+	test_concurrent();
 
 	return 0;
 }
@@ -1,4 +1,19 @@
+#if 0
+(
+set -euo pipefail
+declare -r tmp="$(mktemp)"
+g++ -I./c_modules -DSIMPLE_LOGGING -std=c++14 -DBENCH_regstore -O2 -pthread -Wall -Wextra -Werror regstore.cpp -o "$tmp"
+exec "$tmp" "$@"
+)
+exit 0
+#endif
 #include "regstore.hpp"
+#include <cmath>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace mark {
 
@@ -11,149 +26,2269 @@ const char *regstore::errstr(regstore::err error)
 	case err::unknown: return "Unknown error";
 	case err::not_readable: return "Not readable";
 	case err::not_writeable: return "Not writeable";
+	case err::no_change: return "No change";
 	default: return "Unknown error code";
 	}
 }
 
-regstore::register_list regstore::_list(const std::string& remote = nullptr) const
+std::size_t regstore::read_domain::this_slot()
 {
+	static std::atomic<std::size_t> next_slot{0};
+	thread_local const std::size_t slot = next_slot++ % nslots;
+	return slot;
+}
+
+regstore::read_domain::read_domain()
+{
+	for (auto& s : slots) {
+		s.readers[0] = 0;
+		s.readers[1] = 0;
+	}
+}
+
+unsigned regstore::read_domain::enter()
+{
+	const auto s = this_slot();
+	const unsigned p = phase.load();
+	slots[s].readers[p].fetch_add(1);
+	return (s << 1) | p;
+}
+
+void regstore::read_domain::leave(unsigned token)
+{
+	slots[token >> 1].readers[token & 1].fetch_sub(1);
+}
+
+void regstore::read_domain::drain(unsigned p) const
+{
+	for (const auto& s : slots) {
+		while (s.readers[p].load() != 0) {
+			std::this_thread::yield();
+		}
+	}
+}
+
+/*
+ * Wait out stragglers which read the phase just before the previous flip,
+ * then flip and wait for every reader which may hold the old table
+ */
+void regstore::read_domain::synchronize()
+{
+	const unsigned p = phase.load();
+	drain(p ^ 1);
+	phase.store(p ^ 1);
+	drain(p);
+}
+
+void regstore::store_mutex::lock()
+{
+	if (!timed.load(std::memory_order_relaxed)) {
+		m.lock();
+		return;
+	}
+	const auto start = std::chrono::steady_clock::now();
+	m.lock();
+	waits.record(start);
+}
+
+regstore::read_guard::read_guard(const regstore& rs) :
+	rs(rs)
+{
+	if (rs.mode == concurrency::serialized) {
+		lock = std::unique_lock<store_mutex>(rs.mx);
+	} else {
+		token = rs.readers.enter();
+	}
+	tab = rs.current.load();
+}
+
+regstore::read_guard::~read_guard()
+{
+	if (!lock.owns_lock()) {
+		rs.readers.leave(token);
+	}
+}
+
+regstore::dispatcher::dispatcher(std::size_t workers)
+{
+	for (std::size_t i = 0; i < std::max<std::size_t>(workers, 1); i++) {
+		this->workers.emplace_back([this] { run(); });
+	}
+}
+
+regstore::dispatcher::~dispatcher()
+{
+	{
+		std::lock_guard<std::mutex> lock(mx);
+		stopping = true;
+	}
+	cv.notify_all();
+	for (auto& worker : workers) {
+		worker.join();
+	}
+}
+
+void regstore::dispatcher::_post(strand& s, std::function<void()> job)
+{
+	s.jobs.emplace_back(std::move(job));
+	if (!s.scheduled) {
+		s.scheduled = true;
+		ready.push_back(&s);
+		cv.notify_one();
+	}
+}
+
+void regstore::dispatcher::post(std::function<void()> job)
+{
+	std::lock_guard<std::mutex> lock(mx);
+	_post(fan_out, std::move(job));
+}
+
+void regstore::dispatcher::post(const std::string& remote, std::function<void()> job)
+{
+	std::lock_guard<std::mutex> lock(mx);
+	auto& s = remotes[remote];
+	if (!s) {
+		s.reset(new strand());
+		s->name = remote;
+	}
+	_post(*s, std::move(job));
+}
+
+/*
+ * A strand is in the ready queue or held by exactly one worker while it has
+ * jobs, so jobs for one strand never run concurrently or out of order
+ */
+void regstore::dispatcher::run()
+{
+	std::unique_lock<std::mutex> lock(mx);
+	while (true) {
+		cv.wait(lock, [this] { return stopping || !ready.empty(); });
+		if (ready.empty()) {
+			return;
+		}
+		strand *s = ready.front();
+		ready.pop_front();
+		auto job = std::move(s->jobs.front());
+		s->jobs.pop_front();
+		lock.unlock();
+		job();
+		lock.lock();
+		if (!s->jobs.empty()) {
+			ready.push_back(s);
+		} else if (s == &fan_out) {
+			s->scheduled = false;
+		} else {
+			remotes.erase(s->name);
+		}
+	}
+}
+
+regstore::scheduler::scheduler() :
+	thread([this] { run(); })
+{
+}
+
+regstore::scheduler::~scheduler()
+{
+	stop();
+}
+
+void regstore::scheduler::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(mx);
+		stopping = true;
+	}
+	cv.notify_all();
+	if (thread.joinable()) {
+		thread.join();
+	}
+}
+
+void regstore::scheduler::at(clock::time_point when, std::function<void()> job)
+{
+	std::lock_guard<std::mutex> lock(mx);
+	timers.push_back({ when, std::move(job) });
+	std::push_heap(timers.begin(), timers.end());
+	if (timers.front().when == when) {
+		cv.notify_one();
+	}
+}
+
+void regstore::scheduler::run()
+{
+	std::unique_lock<std::mutex> lock(mx);
+	while (!stopping) {
+		if (timers.empty()) {
+			cv.wait(lock);
+			continue;
+		}
+		const auto when = timers.front().when;
+		if (clock::now() < when) {
+			cv.wait_until(lock, when);
+			continue;
+		}
+		std::pop_heap(timers.begin(), timers.end());
+		auto job = std::move(timers.back().job);
+		timers.pop_back();
+		lock.unlock();
+		job();
+		lock.lock();
+	}
+}
+
+regstore::regstore(concurrency mode) :
+	mode(mode), current(new table())
+{
+}
+
+/*
+ * Dispatcher jobs may arm timers and timer jobs may post to the dispatcher,
+ * so both are stopped and joined while the store is intact: the dispatcher
+ * first, after which timer jobs deliver inline.
+ */
+regstore::~regstore()
+{
+	stopping = true;
+	stop_dispatcher();
+	if (timers) {
+		timers->stop();
+	}
+	timers.reset();
+	delete current.load();
+}
+
+void regstore::_swap_dispatcher(std::unique_ptr<dispatcher>& d)
+{
+	{
+		std::lock_guard<store_mutex> lock(mx);
+		std::swap(async, d);
+	}
+	/* Old dispatcher drains outside the lock, as fan-out jobs take it */
+	d.reset();
+}
+
+void regstore::start_dispatcher(std::size_t workers)
+{
+	std::unique_ptr<dispatcher> d(new dispatcher(workers));
+	_swap_dispatcher(d);
+}
+
+void regstore::stop_dispatcher()
+{
+	std::unique_ptr<dispatcher> d;
+	_swap_dispatcher(d);
+}
+
+const regstore::table& regstore::_table() const
+{
+	return staged ? *staged : *current.load();
+}
+
+regstore::table& regstore::_writable()
+{
+	if (mode == concurrency::serialized) {
+		return *current.load();
+	}
+	if (!staged) {
+		staged.reset(new table(*current.load()));
+	}
+	return *staged;
+}
+
+void regstore::_publish()
+{
+	if (!staged) {
+		return;
+	}
+	table *old = current.exchange(staged.release());
+	readers.synchronize();
+	delete old;
+}
+
+std::shared_ptr<regstore::reg_entry> regstore::_find(const table& t, const std::string& key)
+{
+	if (!t.mounted.empty()) {
+		auto e = _find_mounted(t, key);
+		if (e) {
+			return e;
+		}
+	}
+	const auto it = t.store.find(key);
+	return it == t.store.end() ? nullptr : it->second;
+}
+
+/* Entry of a mounted register, sharing ownership of its table's block */
+std::shared_ptr<regstore::reg_entry> regstore::_find_mounted(const table& t, const std::string& key)
+{
+	for (const auto& m : t.mounted) {
+		if (key < m.first || m.last < key) {
+			continue;
+		}
+		auto& entries = *m.entries;
+		const auto i = m.find(m.table, key);
+		if (i < entries.size() && !entries[i].removed) {
+			return std::shared_ptr<reg_entry>(m.entries, &entries[i]);
+		}
+	}
+	return nullptr;
+}
+
+std::shared_ptr<const regstore::remote_map> regstore::_observers(const reg_entry& e)
+{
+	return std::atomic_load(&e.observers);
+}
+
+std::shared_ptr<regstore::stats_entry> regstore::_stats(const reg_entry& e)
+{
+	return e.timed.load(std::memory_order_relaxed) ? std::atomic_load(&e.stats) : nullptr;
+}
+
+regstore::order_range regstore::_range(const table& t, const std::string& prefix)
+{
+	auto begin = t.order.lower_bound(prefix);
+	auto end = begin;
+	while (end != t.order.end() && (*end)->name.compare(0, prefix.size(), prefix) == 0) {
+		++end;
+	}
+	return { begin, end };
+}
+
+regstore::register_list regstore::_list(const table& t, const std::string& remote, const std::string& prefix)
+{
+	register_list res;
+	_each(t, prefix, "", remote, [&res] (const std::string& name, const register_info& info) {
+		res.emplace(name, info);
+		return true;
+	});
+	return res;
+}
+
+regstore::register_info regstore::_info(const reg_entry& e, const std::string& remote)
+{
+	register_info info;
+	reg_type& rt = info.type;
+	rt = rt_none;
+	if (e.get != nullptr) {
+		rt |= rt_readable;
+	}
+	if (e.set != nullptr) {
+		rt |= rt_writeable;
+	}
+	if (!remote.empty()) {
+		const auto observers = _observers(e);
+		const auto for_rem = observers->find(remote);
+		if (for_rem != observers->end()) {
+			const auto& rec = *for_rem->second;
+			info.subscribed = true;
+			info.sub_info.next = std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(rec.next.load()));
+			info.sub_info.min_interval = rec.min_interval;
+		}
+	}
+	info.version = e.version;
+	const auto c = std::atomic_load(&e.cache);
+	if (c) {
+		std::lock_guard<std::mutex> lock(c->mx);
+		info.cache_hits = c->hits;
+		info.cache_misses = c->misses;
+	}
+	return info;
+}
+
+bool regstore::_each(const table& t, const std::string& prefix, const std::string& cursor, const std::string& remote, const visitor& v)
+{
+	auto it = cursor.empty() || cursor < prefix ? t.order.lower_bound(prefix) : t.order.upper_bound(cursor);
+	for (; it != t.order.end(); ++it) {
+		const auto& e = **it;
+		/* Keys with the prefix are contiguous */
+		if (e.name.compare(0, prefix.size(), prefix) != 0) {
+			break;
+		}
+		if (!v(e.name, _info(e, remote))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+std::shared_ptr<regstore::reg_entry> regstore::_add(const std::string& key, const regstore::getter& get, const regstore::setter& set, std::unique_ptr<const typed_base> typed)
+{
+	if (_find(_table(), key)) {
+		throw std::logic_error("Attempted to add key \"" + key + "\" to register store twice");
+	}
+	auto entry = std::make_shared<reg_entry>();
+	entry->name = key;
+	entry->get = get;
+	entry->set = set;
+	entry->observers = std::make_shared<const remote_map>();
+	entry->typed = std::move(typed);
+	if (stats_enabled) {
+		entry->stats = std::make_shared<stats_entry>();
+		entry->timed = true;
+	}
+	_touch(entry);
+	auto& t = _writable();
+	t.order.insert(entry);
+	t.store.emplace(key, entry);
+	return entry;
+}
+
+void regstore::add_many(const std::vector<definition>& regs)
+{
+	std::lock_guard<store_mutex> lock(mx);
+	auto& t = _writable();
+	t.store.reserve(t.store.size() + regs.size());
+	std::vector<std::shared_ptr<reg_entry>> added;
+	added.reserve(regs.size());
+	for (const auto& def : regs) {
+		auto entry = std::make_shared<reg_entry>();
+		entry->name = def.key;
+		entry->get = def.get;
+		entry->set = def.set;
+		entry->observers = std::make_shared<const remote_map>();
+		if (stats_enabled) {
+			entry->stats = std::make_shared<stats_entry>();
+			entry->timed = true;
+		}
+		if ((!t.mounted.empty() && _find_mounted(t, def.key)) || !t.store.emplace(def.key, entry).second) {
+			for (const auto& e : added) {
+				t.store.erase(e->name);
+			}
+			throw std::logic_error("Attempted to add key \"" + def.key + "\" to register store twice");
+		}
+		added.push_back(std::move(entry));
+	}
+	for (const auto& e : added) {
+		_touch(e);
+		t.order.insert(t.order.end(), e);
+	}
+	_publish();
+}
+
+void regstore::_remove(const std::string& key)
+{
+	const auto e = _find(_table(), key);
+	if (!e) {
+		return;
+	}
+	e->removed = true;
+	for (const auto& rem : *_observers(*e)) {
+		_cancel(*rem.second);
+		remote_regs[rem.first].erase(e);
+		if (remote_regs[rem.first].empty()) {
+			remote_regs.erase(rem.first);
+		}
+	}
+	if (e->typed) {
+		for (const auto& remote : e->typed->remotes()) {
+			remote_regs[remote].erase(e);
+			if (remote_regs[remote].empty()) {
+				remote_regs.erase(remote);
+			}
+		}
+	}
+	_unlink(*e);
+	if (e->export_slot != export_segment::npos) {
+		mirror->write(e->export_slot, nullptr);
+	}
+	if (e->sampler) {
+		e->sampler = nullptr;
+		sampled.erase(e);
+	}
+	auto& t = _writable();
+	t.order.erase(e);
+	t.store.erase(key);
+}
+
+std::size_t regstore::_remove_prefix(const std::string& prefix)
+{
+	const auto range = _range(_table(), prefix);
+	/* Copy the keys, as removing changes the index */
+	std::vector<std::string> keys;
+	for (auto it = range.first; it != range.second; ++it) {
+		keys.push_back((*it)->name);
+	}
+	for (const auto& key : keys) {
+		_remove(key);
+	}
+	return keys.size();
+}
+
+std::size_t regstore::notify_prefix(const std::string& prefix) const
+{
+	std::lock_guard<store_mutex> lock(mx);
+	const auto range = _range(_table(), prefix);
+	std::size_t count = 0;
+	for (auto it = range.first; it != range.second; ++it, ++count) {
+		_notify(*it);
+	}
+	return count;
+}
+
+regstore::err regstore::set(const std::string& key, const std::string& value)
+{
+	std::lock_guard<store_mutex> lock(mx);
+	const auto e = _find(_table(), key);
+	if (!e) {
+		return err::invalid_key;
+	}
+	return _set(e, value);
+}
+
+regstore::err regstore::get(const std::string& key, std::string& value) const
+{
+	read_guard t(*this);
+	const auto e = _find(*t, key);
+	if (!e) {
+		return err::invalid_key;
+	}
+	return _get(*e, value);
+}
+
+bool regstore::suppress_unchanged(const std::string& key, bool enable)
+{
+	std::lock_guard<store_mutex> lock(mx);
+	const auto e = _find(_table(), key);
+	if (!e) {
+		return false;
+	}
+	e->suppress = enable;
+	e->last = fingerprint();
+	return true;
+}
+
+bool regstore::cache(const std::string& key, std::chrono::steady_clock::duration max_age)
+{
+	std::lock_guard<store_mutex> lock(mx);
+	const auto e = _find(_table(), key);
+	if (!e) {
+		return false;
+	}
+	std::atomic_store(&e->cache, max_age > std::chrono::steady_clock::duration::zero() ? std::make_shared<value_cache>(max_age) : nullptr);
+	return true;
+}
+
+void regstore::add_async(const std::string& key, async_getter get, async_setter set)
+{
+	getter sync_get;
+	if (get != nullptr) {
+		sync_get = [get] (std::string& value) {
+			std::promise<get_result> p;
+			auto f = p.get_future();
+			get([&p] (err res, const std::string& value) { p.set_value({ res, value }); });
+			auto r = f.get();
+			value = std::move(r.value);
+			return r.res;
+		};
+	}
+	setter sync_set;
+	if (set != nullptr) {
+		sync_set = [set] (const std::string& value) {
+			std::promise<err> p;
+			auto f = p.get_future();
+			set(value, [&p] (err res) { p.set_value(res); });
+			return f.get();
+		};
+	}
+	std::lock_guard<store_mutex> lock(mx);
+	const auto e = _add(key, sync_get, sync_set);
+	e->async_get = std::move(get);
+	e->async_set = std::move(set);
+	_publish();
+}
+
+void regstore::get_async(const std::string& key, get_callback done) const
+{
+	std::shared_ptr<reg_entry> e;
+	err res = err::invalid_key;
+	std::string value;
+	{
+		read_guard t(*this);
+		e = _find(*t, key);
+		if (e && e->async_get == nullptr) {
+			res = _get(*e, value);
+		}
+	}
+	if (e && e->async_get != nullptr) {
+		e->async_get(done);
+	} else {
+		done(res, value);
+	}
+}
+
+void regstore::set_async(const std::string& key, const std::string& value, set_callback done)
+{
+	std::shared_ptr<reg_entry> e;
+	err res = err::invalid_key;
+	{
+		std::lock_guard<store_mutex> lock(mx);
+		e = _find(_table(), key);
+		if (e && e->async_set == nullptr) {
+			res = _set(e, value);
+		}
+	}
+	if (!e || e->async_set == nullptr) {
+		done(res);
+		return;
+	}
+	e->async_set(value, [this, e, value, done] (err res) {
+		{
+			std::lock_guard<store_mutex> lock(mx);
+			_invalidate(*e);
+			if (res == err::ok && !e->removed) {
+				_send_notification(e, value);
+			}
+		}
+		done(res == err::no_change ? err::ok : res);
+	});
+}
+
+std::future<regstore::get_result> regstore::get_async(const std::string& key) const
+{
+	auto p = std::make_shared<std::promise<get_result>>();
+	auto f = p->get_future();
+	get_async(key, [p] (err res, const std::string& value) { p->set_value({ res, value }); });
+	return f;
+}
+
+std::future<regstore::err> regstore::set_async(const std::string& key, const std::string& value)
+{
+	auto p = std::make_shared<std::promise<err>>();
+	auto f = p->get_future();
+	set_async(key, value, [p] (err res) { p->set_value(res); });
+	return f;
+}
+
+bool regstore::sample(const std::string& key, std::chrono::steady_clock::duration period)
+{
+	std::lock_guard<store_mutex> lock(mx);
+	const auto e = _find(_table(), key);
+	if (!e) {
+		return false;
+	}
+	if (period > std::chrono::steady_clock::duration::zero()) {
+		e->sampler = std::make_shared<sampler_entry>(period);
+		sampled.insert(e);
+		_arm_sampler(e);
+	} else {
+		e->sampler = nullptr;
+		sampled.erase(e);
+	}
+	return true;
+}
+
+std::vector<regstore::err> regstore::get_many(const std::vector<std::string>& keys, std::vector<std::string>& values) const
+{
+	std::vector<err> res(keys.size(), err::invalid_key);
+	values.resize(keys.size());
+	read_guard t(*this);
+	for (std::size_t i = 0; i < keys.size(); i++) {
+		const auto e = _find(*t, keys[i]);
+		if (e) {
+			res[i] = _get(*e, values[i]);
+		}
+	}
+	return res;
+}
+
+std::vector<regstore::err> regstore::set_many(const std::vector<std::pair<std::string, std::string>>& values)
+{
+	std::vector<err> res(values.size(), err::invalid_key);
+	std::vector<std::shared_ptr<reg_entry>> changed(values.size());
+	std::lock_guard<store_mutex> lock(mx);
+	const auto& t = _table();
+	for (std::size_t i = 0; i < values.size(); i++) {
+		const auto e = _find(t, values[i].first);
+		if (e) {
+			res[i] = _apply(*e, values[i].second);
+			if (res[i] == err::ok) {
+				changed[i] = e;
+			} else if (res[i] == err::no_change) {
+				res[i] = err::ok;
+			}
+		}
+	}
+	for (std::size_t i = 0; i < values.size(); i++) {
+		if (changed[i]) {
+			_send_notification(changed[i], values[i].second);
+		}
+	}
+	_flush_all();
+	return res;
+}
+
+regstore::err regstore::commit(const transaction& t, std::string *failed)
+{
+	struct touched {
+		std::shared_ptr<reg_entry> entry;
+		std::string old;
+		const std::string *value = nullptr;
+		bool changed = false;
+	};
+	std::lock_guard<store_mutex> lock(mx);
+	const auto& tab = _table();
+	/* Registers in first-write order, with their values before the commit */
+	std::vector<touched> regs;
+	std::vector<std::size_t> slot(t.writes.size());
+	std::unordered_map<const reg_entry *, std::size_t> index;
+	for (std::size_t i = 0; i < t.writes.size(); i++) {
+		const auto& key = t.writes[i].first;
+		const auto e = _find(tab, key);
+		err res = err::ok;
+		if (!e) {
+			res = err::invalid_key;
+		} else if (e->set == nullptr) {
+			res = err::not_writeable;
+		} else if (!index.count(e.get())) {
+			index.emplace(e.get(), regs.size());
+			regs.push_back(touched{e, std::string(), nullptr, false});
+			res = _get(*e, regs.back().old);
+		}
+		if (res != err::ok) {
+			if (failed) {
+				*failed = key;
+			}
+			return res;
+		}
+		slot[i] = index[e.get()];
+	}
+	for (std::size_t i = 0; i < t.writes.size(); i++) {
+		auto& reg = regs[slot[i]];
+		const auto res = _apply(*reg.entry, t.writes[i].second);
+		if (res == err::ok || res == err::no_change) {
+			reg.value = &t.writes[i].second;
+			reg.changed = reg.changed || res == err::ok;
+			continue;
+		}
+		/* Restore those already written, in reverse order */
+		for (auto it = regs.rbegin(); it != regs.rend(); ++it) {
+			if (it->value) {
+				_apply(*it->entry, it->old);
+			}
+		}
+		if (failed) {
+			*failed = t.writes[i].first;
+		}
+		return res;
+	}
+	for (const auto& reg : regs) {
+		if (reg.changed) {
+			_send_notification(reg.entry, *reg.value);
+		}
+	}
+	_flush_all();
+	return err::ok;
+}
+
+regstore::handle regstore::resolve(const std::string& key) const
+{
+	read_guard t(*this);
+	handle h;
+	h.entry = _find(*t, key);
+	return h;
+}
+
+regstore::err regstore::set(const handle& h, const std::string& value)
+{
+	std::lock_guard<store_mutex> lock(mx);
+	if (!h.entry || h.entry->removed) {
+		return err::invalid_key;
+	}
+	return _set(h.entry, value);
+}
+
+regstore::err regstore::get(const handle& h, std::string& value) const
+{
+	read_guard t(*this);
+	if (!h.entry || h.entry->removed) {
+		return err::invalid_key;
+	}
+	return _get(*h.entry, value);
+}
+
+regstore::err regstore::notify(const handle& h) const
+{
+	std::lock_guard<store_mutex> lock(mx);
+	if (!h.entry || h.entry->removed) {
+		return err::invalid_key;
+	}
+	return _notify(h.entry);
+}
+
+regstore::err regstore::_set(const std::shared_ptr<reg_entry>& e, const std::string& value)
+{
+	const auto res = _apply(*e, value);
+	if (res == err::ok) {
+		_send_notification(e, value);
+	}
+	return res == err::no_change ? err::ok : res;
+}
+
+regstore::err regstore::_apply(reg_entry& e, const std::string& value)
+{
+	/* Could be const, but intentionally not */
+	const auto& func = e.set;
+	if (func == nullptr) {
+		return err::not_writeable;
+	}
+	const auto stats = _stats(e);
+	const auto start = stats ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+	err res;
+	try {
+		res = func(value);
+	} catch (const std::invalid_argument&) {
+		res = err::invalid_value;
+	}
+	if (stats) {
+		stats->sets++;
+		stats->set_us.record(start);
+	}
+	/* Whether or not it succeeded, a cached value may now be wrong */
+	_invalidate(e);
+	return res;
+}
+
+regstore::err regstore::_get(const reg_entry& e, std::string& value)
+{
+	const auto c = std::atomic_load(&e.cache);
+	return c ? _cached_get(e, *c, value) : _call_get(e, value);
+}
+
+regstore::err regstore::_cached_get(const reg_entry& e, value_cache& c, std::string& value)
+{
+	std::unique_lock<std::mutex> lock(c.mx);
+	auto now = std::chrono::steady_clock::now();
+	for (;;) {
+		if (c.valid && now - c.time < c.max_age) {
+			c.hits++;
+			value = c.value;
+			return err::ok;
+		}
+		if (!c.fetching) {
+			break;
+		}
+		if (c.fetcher == std::this_thread::get_id()) {
+			/* From within the getter, which would otherwise wait on itself */
+			lock.unlock();
+			return _call_get(e, value);
+		}
+		/* Share the result of the fetch in progress, unless a set overtook it */
+		const auto fetches = c.fetches;
+		c.fetched.wait(lock, [&c, fetches] { return c.fetches != fetches; });
+		if (c.current) {
+			c.hits++;
+			if (c.result == err::ok) {
+				value = c.value;
+			}
+			return c.result;
+		}
+		now = std::chrono::steady_clock::now();
+	}
+	c.misses++;
+	c.fetching = true;
+	c.fetcher = std::this_thread::get_id();
+	const auto epoch = c.epoch;
+	lock.unlock();
+	std::string fetched;
+	err res;
+	try {
+		res = _call_get(e, fetched);
+	} catch (...) {
+		lock.lock();
+		c.fetching = false;
+		c.fetches++;
+		c.result = err::not_readable;
+		c.valid = false;
+		c.current = c.epoch == epoch;
+		c.fetched.notify_all();
+		throw;
+	}
+	lock.lock();
+	c.fetching = false;
+	c.fetches++;
+	c.result = res;
+	c.value = fetched;
+	c.time = now;
+	c.current = c.epoch == epoch;
+	c.valid = res == err::ok && c.current;
+	c.fetched.notify_all();
+	lock.unlock();
+	if (res == err::ok) {
+		value = std::move(fetched);
+	}
+	return res;
+}
+
+void regstore::_invalidate(const reg_entry& e)
+{
+	const auto c = std::atomic_load(&e.cache);
+	if (c) {
+		std::lock_guard<std::mutex> lock(c->mx);
+		c->valid = false;
+		c->epoch++;
+	}
+}
+
+regstore::err regstore::_call_get(const reg_entry& e, std::string& value)
+{
+	const auto& func = e.get;
+	if (func == nullptr) {
+		return err::not_readable;
+	}
+	const auto stats = _stats(e);
+	const auto start = stats ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+	err res;
+	try {
+		res = func(value);
+	} catch (const std::invalid_argument&) {
+		res = err::invalid_value;
+	}
+	if (stats) {
+		stats->gets++;
+		stats->get_us.record(start);
+	}
+	return res;
+}
+
+bool regstore::_observe(const std::string& key, const std::string& remote, const regstore::observer& obs, const std::chrono::steady_clock::duration& min_interval)
+{
+	if (obs == nullptr) {
+		_unobserve(key, remote);
+		return true;
+	}
+	const auto e = _find(_table(), key);
+	if (!e) {
+		return false;
+	}
+	auto observers = std::make_shared<remote_map>(*_observers(*e));
+	auto& ob = (*observers)[remote];
+	if (ob) {
+		_cancel(*ob);
+	}
+	ob = std::make_shared<observer_entry>();
+	ob->func = obs;
+	ob->min_interval = min_interval;
+	std::atomic_store(&e->observers, std::shared_ptr<const remote_map>(std::move(observers)));
+	remote_regs[remote].insert(e);
+	_arm_sampler(e);
+	return true;
+}
+
+void regstore::_unobserve(const std::string& key, const std::string& remote)
+{
+	const auto e = _find(_table(), key);
+	if (e) {
+		_unobserve(e, remote);
+	}
+}
+
+void regstore::_unobserve(const std::shared_ptr<reg_entry>& e, const std::string& remote)
+{
+	const auto& current = *_observers(*e);
+	const auto for_rem = current.find(remote);
+	if (for_rem == current.end()) {
+		return;
+	}
+	_cancel(*for_rem->second);
+	auto observers = std::make_shared<remote_map>(current);
+	observers->erase(remote);
+	std::atomic_store(&e->observers, std::shared_ptr<const remote_map>(std::move(observers)));
+	_unindex(e, remote);
+}
+
+/* Drop e from remote's index unless it still has a string or typed observer for it */
+void regstore::_unindex(const std::shared_ptr<reg_entry>& e, const std::string& remote)
+{
+	if (_observers(*e)->count(remote) || (e->typed && e->typed->observes(remote))) {
+		return;
+	}
+	const auto it = remote_regs.find(remote);
+	if (it == remote_regs.end()) {
+		return;
+	}
+	it->second.erase(e);
+	if (it->second.empty()) {
+		remote_regs.erase(it);
+	}
+}
+
+std::size_t regstore::unobserve_all(const std::string& remote)
+{
+	std::lock_guard<store_mutex> lock(mx);
+	std::size_t count = 0;
+	const auto regs = remote_regs.find(remote);
+	if (regs != remote_regs.end()) {
+		const auto entries = std::move(regs->second);
+		remote_regs.erase(regs);
+		for (const auto& e : entries) {
+			if (e->typed) {
+				e->typed->unobserve(remote);
+			}
+			_unobserve(e, remote);
+		}
+		count += entries.size();
+	}
+	std::lock_guard<std::mutex> patterns_lock(patterns_mx);
+	const auto pats = remote_patterns.find(remote);
+	if (pats != remote_patterns.end()) {
+		for (const auto& pattern : pats->second) {
+			_unobserve_pattern(patterns, pattern, 0, remote);
+		}
+		count += pats->second.size();
+		remote_patterns.erase(pats);
+		patterns_gen++;
+	}
+	std::lock_guard<std::mutex> batches_lock(batches_mx);
+	const auto b = batches.find(remote);
+	if (b != batches.end()) {
+		/* Emptied too, as a timer or queued flush may still hold it */
+		b->second->pending.clear();
+		b->second->index.clear();
+		batches.erase(b);
+		batching = !batches.empty();
+	}
+	return count;
+}
+
+regstore::journal_ring::journal_ring(std::size_t capacity, std::size_t record_size) :
+	words((record_size + sizeof(std::uint64_t) - 1) / sizeof(std::uint64_t)),
+	slots(new slot[capacity]),
+	data(new std::atomic<std::uint64_t>[capacity * words]()),
+	capacity(capacity)
+{
+}
+
+void regstore::journal_ring::write(std::uint64_t seq, const std::string& key, const std::string& value)
+{
+	const auto pos = head.load(std::memory_order_relaxed);
+	slot& s = slots[pos % capacity];
+	std::atomic<std::uint64_t> *d = &data[pos % capacity * words];
+	s.stamp.store(2 * pos + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	const std::size_t size = words * sizeof(std::uint64_t);
+	const std::size_t key_len = std::min(key.size(), size);
+	const std::size_t value_len = std::min(value.size(), size - key_len);
+	s.seq.store(seq, std::memory_order_relaxed);
+	s.time.store(std::chrono::system_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+	s.key_len.store(key_len, std::memory_order_relaxed);
+	s.value_len.store(value_len, std::memory_order_relaxed);
+	s.truncated.store(key_len < key.size() || value_len < value.size(), std::memory_order_relaxed);
+	/* Key then value, packed into words */
+	const std::size_t len = key_len + value_len;
+	for (std::size_t w = 0; w * sizeof(std::uint64_t) < len; w++) {
+		char buf[sizeof(std::uint64_t)] = {};
+		const std::size_t begin = w * sizeof(buf);
+		const std::size_t end = std::min(len, begin + sizeof(buf));
+		for (std::size_t i = begin; i < end; i++) {
+			buf[i - begin] = i < key_len ? key[i] : value[i - key_len];
+		}
+		std::uint64_t word;
+		std::memcpy(&word, buf, sizeof(word));
+		d[w].store(word, std::memory_order_relaxed);
+	}
+	s.stamp.store(2 * pos + 2, std::memory_order_release);
+	head.store(pos + 1, std::memory_order_release);
+}
+
+bool regstore::journal_ring::read(std::uint64_t pos, journal_record& rec) const
+{
+	const slot& s = slots[pos % capacity];
+	const std::atomic<std::uint64_t> *d = &data[pos % capacity * words];
+	const auto stamp = 2 * pos + 2;
+	if (s.stamp.load(std::memory_order_acquire) != stamp) {
+		return false;
+	}
+	rec.seq = s.seq.load(std::memory_order_relaxed);
+	rec.time = std::chrono::system_clock::time_point(std::chrono::system_clock::duration(s.time.load(std::memory_order_relaxed)));
+	rec.truncated = s.truncated.load(std::memory_order_relaxed);
+	/* Lengths may be torn if the record is being overwritten, so bound them */
+	const std::size_t size = words * sizeof(std::uint64_t);
+	const std::size_t key_len = std::min<std::size_t>(s.key_len.load(std::memory_order_relaxed), size);
+	const std::size_t value_len = std::min<std::size_t>(s.value_len.load(std::memory_order_relaxed), size - key_len);
+	rec.key.resize(key_len);
+	rec.value.resize(value_len);
+	const std::size_t len = key_len + value_len;
+	for (std::size_t w = 0; w * sizeof(std::uint64_t) < len; w++) {
+		const std::uint64_t word = d[w].load(std::memory_order_relaxed);
+		char buf[sizeof(word)];
+		std::memcpy(buf, &word, sizeof(buf));
+		const std::size_t begin = w * sizeof(buf);
+		const std::size_t end = std::min(len, begin + sizeof(buf));
+		for (std::size_t i = begin; i < end; i++) {
+			(i < key_len ? rec.key[i] : rec.value[i - key_len]) = buf[i - begin];
+		}
+	}
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return s.stamp.load(std::memory_order_relaxed) == stamp;
+}
+
+bool regstore::journal_cursor::next(journal_record& rec)
+{
+	if (!ring) {
+		return false;
+	}
+	for (;;) {
+		const auto head = ring->head.load(std::memory_order_acquire);
+		if (pos >= head) {
+			return false;
+		}
+		if (head - pos > ring->capacity) {
+			skipped += head - ring->capacity - pos;
+			pos = head - ring->capacity;
+		}
+		if (ring->read(pos++, rec)) {
+			return true;
+		}
+		skipped++;
+	}
+}
+
+void regstore::enable_journal(std::size_t capacity, std::size_t record_size)
+{
+	std::lock_guard<store_mutex> lock(mx);
+	journal = capacity ? std::make_shared<journal_ring>(capacity, record_size) : nullptr;
+}
+
+regstore::journal_cursor regstore::journal_replay() const
+{
+	journal_cursor c;
+	std::lock_guard<store_mutex> lock(mx);
+	c.ring = journal;
+	if (c.ring) {
+		const auto head = c.ring->head.load(std::memory_order_relaxed);
+		c.pos = head > c.ring->capacity ? head - c.ring->capacity : 0;
+	}
+	return c;
+}
+
+regstore::journal_cursor regstore::journal_tail() const
+{
+	journal_cursor c;
+	std::lock_guard<store_mutex> lock(mx);
+	c.ring = journal;
+	if (c.ring) {
+		c.pos = c.ring->head.load(std::memory_order_relaxed);
+	}
+	return c;
+}
+
+std::unique_ptr<regstore::export_segment> regstore::export_segment::create(const std::string& name, std::size_t capacity, std::size_t key_size, std::size_t value_size)
+{
+	const auto round = [] (std::size_t n) { return (n + sizeof(std::uint64_t) - 1) / sizeof(std::uint64_t) * sizeof(std::uint64_t); };
+	key_size = round(key_size);
+	value_size = round(value_size);
+	const std::size_t slot_size = sizeof(regstore_mirror_slot) + key_size + value_size;
+	const std::size_t limit = std::numeric_limits<std::uint32_t>::max();
+	if (capacity > limit || slot_size > limit || capacity > (std::numeric_limits<std::size_t>::max() - sizeof(regstore_mirror_header)) / slot_size) {
+		return nullptr;
+	}
+	const std::size_t size = sizeof(regstore_mirror_header) + capacity * slot_size;
+	/* A new object, so readers of any previous one keep a valid mapping of it */
+	shm_unlink(name.c_str());
+	const int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+	if (fd < 0) {
+		log_error("Failed to create shared memory \"%s\": %s", name.c_str(), std::strerror(errno));
+		return nullptr;
+	}
+	void *p = MAP_FAILED;
+	if (ftruncate(fd, size) == 0) {
+		p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if (p == MAP_FAILED) {
+		log_error("Failed to map shared memory \"%s\": %s", name.c_str(), std::strerror(errno));
+		shm_unlink(name.c_str());
+		return nullptr;
+	}
+	std::unique_ptr<export_segment> seg(new export_segment());
+	seg->size = size;
+	seg->name = name;
+	/* Zero-filled by ftruncate */
+	auto header = seg->header = new (p) regstore_mirror_header;
+	for (std::size_t i = 0; i < capacity; i++) {
+		new (regstore_mirror_slot_at(header, i)) regstore_mirror_slot;
+	}
+	header->capacity = capacity;
+	header->slot_size = slot_size;
+	header->key_size = key_size;
+	header->value_size = value_size;
+	header->magic.store(REGSTORE_MIRROR_MAGIC, std::memory_order_release);
+	return seg;
+}
+
+regstore::export_segment::~export_segment()
+{
+	header->magic.store(0, std::memory_order_release);
+	munmap(header, size);
+	shm_unlink(name.c_str());
+}
+
+std::size_t regstore::export_segment::add(const std::string& key)
+{
+	const std::size_t slot = header->count.load(std::memory_order_relaxed);
+	if (slot == header->capacity || key.size() > header->key_size) {
+		return npos;
+	}
+	const auto s = regstore_mirror_slot_at(header, slot);
+	s->key_len = key.size();
+	std::memcpy(regstore_mirror_key(s), key.data(), key.size());
+	return slot;
+}
+
+void regstore::export_segment::publish(std::size_t slot)
+{
+	header->count.store(slot + 1, std::memory_order_release);
+}
+
+void regstore::export_segment::write(std::size_t slot, const std::string *value)
+{
+	const auto s = regstore_mirror_slot_at(header, slot);
+	const auto d = regstore_mirror_words(header, s);
+	const auto seq = s->seq.load(std::memory_order_relaxed);
+	s->seq.store(seq + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	const std::size_t n = value ? std::min<std::size_t>(value->size(), header->value_size) : 0;
+	for (std::size_t w = 0; w * sizeof(std::uint64_t) < n; w++) {
+		std::uint64_t word = 0;
+		const auto begin = w * sizeof(word);
+		std::memcpy(&word, value->data() + begin, std::min(n - begin, sizeof(word)));
+		d[w].store(word, std::memory_order_relaxed);
+	}
+	s->value_len.store(value ? static_cast<std::uint32_t>(std::min<std::size_t>(value->size(), REGSTORE_MIRROR_REMOVED - 1)) : REGSTORE_MIRROR_REMOVED, std::memory_order_relaxed);
+	s->seq.store(seq + 2, std::memory_order_release);
+}
+
+bool regstore::export_open(const std::string& name, std::size_t capacity, std::size_t key_size, std::size_t value_size)
+{
+	std::lock_guard<store_mutex> lock(mx);
+	mirror = nullptr;
+	for (const auto& e : _table().order) {
+		e->export_slot = export_segment::npos;
+	}
+	if (name.empty()) {
+		return true;
+	}
+	mirror = export_segment::create(name, capacity, key_size, value_size);
+	return mirror != nullptr;
+}
+
+bool regstore::export_register(const std::string& key)
+{
+	std::lock_guard<store_mutex> lock(mx);
+	const auto e = _find(_table(), key);
+	if (!e || !mirror || e->export_slot != export_segment::npos) {
+		return false;
+	}
+	const auto slot = mirror->add(key);
+	if (slot == export_segment::npos) {
+		return false;
+	}
+	/* Readers find the slot once it holds the current value, if readable */
+	std::string value;
+	if (_get(*e, value) == err::ok) {
+		mirror->write(slot, &value);
+	}
+	mirror->publish(slot);
+	e->export_slot = slot;
+	return true;
+}
+
+/*
+ * Snapshot file: snapshot_magic, then one record per saved value, later ones
+ * replacing earlier ones for the same key.  A record is the key and value
+ * lengths (uint32_t, native byte order), then the key and the value, each
+ * followed by a NUL.
+ */
+static const char snapshot_magic[] = "regsnap1";
+static constexpr std::size_t snapshot_magic_len = sizeof(snapshot_magic) - 1;
+
+/* Registers which cannot be both read and written back are skipped */
+bool regstore::_snapshot_write(std::FILE *f, const reg_entry& e)
+{
+	std::string value;
+	if (e.get == nullptr || e.set == nullptr || _get(e, value) != err::ok) {
+		return true;
+	}
+	const std::uint32_t len[2] = { static_cast<std::uint32_t>(e.name.size()), static_cast<std::uint32_t>(value.size()) };
+	return std::fwrite(len, sizeof(len), 1, f) == 1 &&
+		std::fwrite(e.name.c_str(), 1, len[0] + 1, f) == len[0] + 1 &&
+		std::fwrite(value.c_str(), 1, len[1] + 1, f) == len[1] + 1;
+}
+
+std::uint64_t regstore::snapshot_save(const std::string& path, std::uint64_t since) const
+{
+	std::lock_guard<store_mutex> lock(mx);
+	/*
+	 * Append to the file the last save wrote, or if there is none, write a
+	 * new one beside it and rename it into place
+	 */
+	const auto tmp = path + ".tmp";
+	int fd = since ? open(path.c_str(), O_WRONLY | O_APPEND) : -1;
+	if (fd < 0) {
+		since = 0;
+		fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	}
+	std::FILE *f = fd < 0 ? nullptr : fdopen(fd, "w");
+	if (!f && fd >= 0) {
+		close(fd);
+	}
+	bool ok = f != nullptr;
+	if (ok && since) {
+		for (auto e = _changed_since(since); ok && e && e->version > since; e = e->newer) {
+			ok = _snapshot_write(f, *e);
+		}
+	} else if (ok) {
+		ok = std::fwrite(snapshot_magic, snapshot_magic_len, 1, f) == 1;
+		const auto& order = _table().order;
+		for (auto it = order.begin(); ok && it != order.end(); ++it) {
+			ok = _snapshot_write(f, **it);
+		}
+	}
+	ok = ok && std::fflush(f) == 0 && fsync(fileno(f)) == 0;
+	if (f && std::fclose(f) != 0) {
+		ok = false;
+	}
+	if (!since) {
+		ok = ok && std::rename(tmp.c_str(), path.c_str()) == 0;
+		if (!ok) {
+			unlink(tmp.c_str());
+		}
+	}
+	if (!ok) {
+		log_error("Failed to save snapshot \"%s\": %s", path.c_str(), std::strerror(errno));
+	}
+	return ok ? seq : 0;
+}
+
+bool regstore::snapshot_restore(const std::string& path, std::size_t *restored)
+{
+	const int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		log_error("Failed to open snapshot \"%s\": %s", path.c_str(), std::strerror(errno));
+		return false;
+	}
+	struct stat st;
+	void *p = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && static_cast<std::size_t>(st.st_size) >= snapshot_magic_len) {
+		p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	} else {
+		errno = EINVAL;
+	}
+	close(fd);
+	if (p == MAP_FAILED) {
+		log_error("Failed to read snapshot \"%s\": %s", path.c_str(), std::strerror(errno));
+		return false;
+	}
+	const auto data = static_cast<const char *>(p);
+	const std::size_t size = st.st_size;
+	if (std::memcmp(data, snapshot_magic, snapshot_magic_len) != 0) {
+		log_error("Not a snapshot: \"%s\"", path.c_str());
+		munmap(p, size);
+		return false;
+	}
+	using record = std::pair<std::string, std::string>;
+	std::vector<record> values;
+	std::uint32_t len[2];
+	/* A record cut short by an interrupted save ends the file */
+	for (std::size_t pos = snapshot_magic_len; size - pos >= sizeof(len); pos += sizeof(len) + len[0] + len[1] + 2) {
+		std::memcpy(len, data + pos, sizeof(len));
+		const auto key = data + pos + sizeof(len);
+		const auto value = key + len[0] + 1;
+		if (std::size_t(len[0]) + len[1] + 2 > size - pos - sizeof(len) || key[len[0]] || value[len[1]]) {
+			break;
+		}
+		values.emplace_back(std::piecewise_construct, std::forward_as_tuple(key, len[0]), std::forward_as_tuple(value, len[1]));
+	}
+	munmap(p, size);
+	/*
+	 * The full save which starts the file is in key order: sort what was
+	 * appended and merge it in, keeping each key's last value
+	 */
+	const auto by_key = [] (const record& a, const record& b) { return a.first < b.first; };
+	const auto appended = std::adjacent_find(values.begin(), values.end(), [&by_key] (const record& a, const record& b) { return !by_key(a, b); });
+	if (appended != values.end()) {
+		std::stable_sort(appended + 1, values.end(), by_key);
+		std::inplace_merge(values.begin(), appended + 1, values.end(), by_key);
+		std::size_t n = 0;
+		for (std::size_t i = 0; i < values.size(); i++) {
+			if (i + 1 < values.size() && values[i].first == values[i + 1].first) {
+				continue;
+			}
+			if (n != i) {
+				values[n] = std::move(values[i]);
+			}
+			n++;
+		}
+		values.resize(n);
+	}
+	const auto res = set_many(values);
+	if (restored) {
+		*restored = std::count(res.begin(), res.end(), err::ok);
+	}
+	return true;
+}
+
+std::uint64_t regstore::histogram::count() const
+{
+	std::uint64_t n = 0;
+	for (const auto b : buckets) {
+		n += b;
+	}
+	return n;
+}
+
+std::uint64_t regstore::histogram::quantile_us(double q) const
+{
+	const auto n = count();
+	if (n == 0) {
+		return 0;
+	}
+	/* Rank of the quantile, rounded up */
+	const double pos = q * n;
+	const std::uint64_t rank = pos <= 1 ? 1 : pos >= n ? n : static_cast<std::uint64_t>(std::ceil(pos));
+	std::uint64_t seen = 0;
+	std::size_t i = 0;
+	for (; i < nbuckets - 1; i++) {
+		seen += buckets[i];
+		if (seen >= rank) {
+			break;
+		}
+	}
+	return std::uint64_t(1) << i;
+}
+
+void regstore::stats_histogram::record(std::chrono::steady_clock::time_point start)
+{
+	auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+	std::size_t i = 0;
+	while (us > 0 && i < histogram::nbuckets - 1) {
+		us >>= 1;
+		i++;
+	}
+	buckets[i].fetch_add(1, std::memory_order_relaxed);
+}
+
+regstore::histogram regstore::stats_histogram::load() const
+{
+	histogram h;
+	for (std::size_t i = 0; i < histogram::nbuckets; i++) {
+		h.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+	}
+	return h;
+}
+
+void regstore::stats_histogram::clear()
+{
+	for (auto& b : buckets) {
+		b.store(0, std::memory_order_relaxed);
+	}
+}
+
+regstore::register_stats regstore::stats_entry::load() const
+{
+	register_stats s;
+	s.gets = gets;
+	s.sets = sets;
+	s.notifies = notifies;
+	s.rate_limited = rate_limited;
+	s.get_us = get_us.load();
+	s.set_us = set_us.load();
+	s.observer_us = observer_us.load();
+	return s;
+}
+
+void regstore::enable_stats(bool enable)
+{
+	std::lock_guard<store_mutex> lock(mx);
+	stats_enabled = enable;
+	for (const auto& e : _table().order) {
+		if (!enable) {
+			e->timed = false;
+			std::atomic_store(&e->stats, std::shared_ptr<stats_entry>());
+		} else if (!e->timed) {
+			std::atomic_store(&e->stats, std::make_shared<stats_entry>());
+			e->timed = true;
+		}
+	}
+	mx.timed = enable;
+	if (!enable) {
+		mx.waits.clear();
+	}
+}
+
+bool regstore::stats(const std::string& key, register_stats& out) const
+{
+	std::shared_ptr<stats_entry> s;
+	{
+		read_guard t(*this);
+		const auto e = _find(*t, key);
+		if (e) {
+			s = _stats(*e);
+		}
+	}
+	if (!s) {
+		return false;
+	}
+	out = s->load();
+	return true;
+}
+
+bool regstore::lock_stats(histogram& out) const
+{
+	if (!mx.timed) {
+		return false;
+	}
+	out = mx.waits.load();
+	return true;
+}
+
+bool regstore::publish_stats(const std::string& key)
+{
+	using stat = std::function<std::uint64_t(const register_stats& s)>;
+	static const std::vector<std::pair<const char *, stat>> reg_stats = {
+		{ "gets", [] (const register_stats& s) { return s.gets; } },
+		{ "sets", [] (const register_stats& s) { return s.sets; } },
+		{ "notifies", [] (const register_stats& s) { return s.notifies; } },
+		{ "rate_limited", [] (const register_stats& s) { return s.rate_limited; } },
+		{ "get_p50_us", [] (const register_stats& s) { return s.get_us.quantile_us(0.5); } },
+		{ "get_p99_us", [] (const register_stats& s) { return s.get_us.quantile_us(0.99); } },
+		{ "set_p50_us", [] (const register_stats& s) { return s.set_us.quantile_us(0.5); } },
+		{ "set_p99_us", [] (const register_stats& s) { return s.set_us.quantile_us(0.99); } },
+		{ "observer_p50_us", [] (const register_stats& s) { return s.observer_us.quantile_us(0.5); } },
+		{ "observer_p99_us", [] (const register_stats& s) { return s.observer_us.quantile_us(0.99); } }
+	};
+	static const std::vector<std::pair<const char *, double>> wait_stats = {
+		{ "lock_wait_p50_us", 0.5 },
+		{ "lock_wait_p99_us", 0.99 }
+	};
+	std::lock_guard<store_mutex> lock(mx);
+	const auto& t = _table();
+	const auto prefix = key.empty() ? std::string("_stats.") : "_stats." + key + ".";
+	if (key.empty()) {
+		for (const auto& s : wait_stats) {
+			if (_find(t, prefix + s.first)) {
+				return false;
+			}
+		}
+		for (const auto& s : wait_stats) {
+			const auto q = s.second;
+			_add(prefix + s.first, [this, q] (std::string& value) {
+				histogram h;
+				if (!lock_stats(h)) {
+					return err::not_readable;
+				}
+				value = std::to_string(h.quantile_us(q));
+				return err::ok;
+			}, nullptr);
+		}
+		_publish();
+		return true;
+	}
+	/* Published stats follow this entry, not whichever later has the key */
+	const auto e = _find(t, key);
+	if (!e) {
+		return false;
+	}
+	for (const auto& s : reg_stats) {
+		if (_find(t, prefix + s.first)) {
+			return false;
+		}
+	}
+	const std::weak_ptr<reg_entry> target = e;
+	for (const auto& s : reg_stats) {
+		const auto& func = s.second;
+		_add(prefix + s.first, [target, &func] (std::string& value) {
+			const auto e = target.lock();
+			const auto stats = e && !e->removed ? _stats(*e) : nullptr;
+			if (!stats) {
+				return err::not_readable;
+			}
+			value = std::to_string(func(stats->load()));
+			return err::ok;
+		}, nullptr);
+	}
+	_publish();
+	return true;
+}
+
+std::vector<regstore::change> regstore::changes_since(std::uint64_t since, std::uint64_t *next) const
+{
+	std::lock_guard<store_mutex> lock(mx);
+	std::vector<change> changes;
+	for (auto it = _changed_since(since); it && it->version > since; it = it->newer) {
+		const auto& e = *it;
+		std::string value;
+		if (e.get != nullptr && _get(e, value) == err::ok) {
+			changes.push_back({ e.name, std::move(value) });
+		}
+	}
+	if (next) {
+		*next = seq;
+	}
+	return changes;
+}
+
+regstore::register_list regstore::list_subscriptions(const std::string& remote) const
+{
+	std::lock_guard<store_mutex> lock(mx);
 	register_list res;
-	for (const auto& kv : store) {
-		const auto& name = kv.first;
-		register_info info;
-		reg_type& rt = info.type;
-		rt = rt_none;
-		if (kv.second.first != nullptr) {
-			rt |= rt_readable;
-		}
-		if (kv.second.second != nullptr) {
-			rt |= rt_writeable;
-		}
-		info.subscribed = !remote.empty() && _query_observer(name, remote, info.sub_info);
-		res.emplace(name, info);
+	const auto regs = remote_regs.find(remote);
+	if (regs != remote_regs.end()) {
+		for (const auto& e : regs->second) {
+			/* Typed observers count too */
+			auto info = _info(*e, remote);
+			info.subscribed = true;
+			res.emplace(e->name, info);
+		}
 	}
 	return res;
 }
 
-void regstore::_add(const std::string& key, const regstore::getter& get, const regstore::setter& set)
+bool regstore::_query_observer(const table& t, const std::string& key, const std::string& remote, subscription_info& info)
 {
-	if (!store.emplace(key, std::make_pair(get, set)).second) {
-		throw std::logic_error("Attempted to add key \"" + key + "\" to register store twice");
+	const auto e = _find(t, key);
+	if (!e || remote.empty()) {
+		return false;
 	}
+	const auto rec = _info(*e, remote);
+	info = rec.sub_info;
+	return rec.subscribed;
 }
 
-regstore::err regstore::_set(const std::string& key, const std::string& value)
+regstore::scheduler *regstore::_scheduler() const
 {
-	/* Could be const, but intentionally not */
-	const auto& it = store.find(key);
-	if (it == store.end()) {
-		return err::invalid_key;
+	if (stopping) {
+		return nullptr;
 	}
-	const auto& func = it->second.second;
-	if (func == nullptr) {
-		return err::not_writeable;
+	std::call_once(timers_once, [this] { timers.reset(new scheduler()); });
+	return timers.get();
+}
+
+/* Stop a replaced/removed subscription's trailing delivery */
+void regstore::_cancel(observer_entry& ob)
+{
+	std::lock_guard<std::mutex> lock(ob.mx);
+	ob.cancelled = true;
+	ob.pending.reset();
+}
+
+/*
+ * Whether to deliver the value now.  Otherwise the subscription is inside its
+ * interval: the value replaces any pending one and is delivered by
+ * _trailing when the interval ends.
+ */
+bool regstore::_admit(const std::string& remote, const std::shared_ptr<observer_entry>& ob, const std::string& value, std::chrono::steady_clock::time_point now, const std::shared_ptr<stats_entry>& stats) const
+{
+	std::lock_guard<std::mutex> lock(ob->mx);
+	const auto next = std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(ob->next.load()));
+	if (now >= next) {
+		ob->pending.reset();
+		ob->next = (now + ob->min_interval).time_since_epoch().count();
+		return true;
 	}
-	err res;
-	try {
-		res = func(value);
-	} catch (const std::invalid_argument&) {
-		res = err::invalid_value;
+	ob->pending = std::make_shared<const std::string>(value);
+	if (stats) {
+		stats->rate_limited++;
 	}
-	if (res == err::ok) {
-		_send_notification(key, value);
+	const auto timer = ob->armed ? nullptr : _scheduler();
+	if (timer) {
+		ob->armed = true;
+		timer->at(next, [this, remote, ob, stats] { _trailing(remote, ob, stats); });
 	}
-	return res;
+	return false;
 }
 
-regstore::err regstore::_get(const std::string& key, std::string& value) const
+/* Runs on the timer thread once a subscription's interval has ended */
+void regstore::_trailing(const std::string& remote, const std::shared_ptr<observer_entry>& ob, const std::shared_ptr<stats_entry>& stats) const
 {
-	const auto& it = store.find(key);
-	if (it == store.end()) {
-		return err::invalid_key;
+	std::lock_guard<store_mutex> lock(mx);
+	std::shared_ptr<const std::string> value;
+	{
+		std::lock_guard<std::mutex> lock(ob->mx);
+		ob->armed = false;
+		if (ob->cancelled || !ob->pending) {
+			return;
+		}
+		value = std::move(ob->pending);
+		ob->next = (std::chrono::steady_clock::now() + ob->min_interval).time_since_epoch().count();
 	}
-	const auto& func = it->second.first;
-	if (func == nullptr) {
-		return err::not_readable;
+	if (async) {
+		async->post(remote, [ob, value, stats] { _timed(stats, [&] { ob->func(*value); }); });
+	} else {
+		_timed(stats, [&] { ob->func(*value); });
 	}
-	err res;
-	try {
-		res = func(value);
-	} catch (const std::invalid_argument&) {
-		res = err::invalid_value;
+}
+
+bool regstore::fingerprint::update(const std::string& value)
+{
+	const bool verbatim_fits = value.size() <= max_verbatim;
+	const auto h = verbatim_fits ? 0 : std::hash<std::string>()(value);
+	if (valid && size == value.size() && (verbatim_fits ? verbatim == value : hash == h)) {
+		return false;
 	}
-	return res;
+	valid = true;
+	size = value.size();
+	hash = h;
+	if (verbatim_fits) {
+		verbatim = value;
+	} else {
+		verbatim.clear();
+	}
+	return true;
 }
 
-void regstore::_observe(const std::string& key, const std::string& remote, const regstore::observer& obs, const std::chrono::steady_clock::duration& min_interval)
+void regstore::_send_notification(const std::shared_ptr<reg_entry>& e, const std::string& value) const
 {
-	if (obs == nullptr) {
-		_unobserve(key, remote);
+	if (e->suppress && !e->last.update(value)) {
 		return;
 	}
-	auto& ob = observers[key][remote];
-	ob.func = obs;
-	ob.next = {};
-	ob.min_interval = min_interval;
+	const auto stats = _stats(*e);
+	if (stats) {
+		stats->notifies++;
+	}
+	_touch(e);
+	if (journal) {
+		journal->write(e->version, e->name, value);
+	}
+	if (e->export_slot != export_segment::npos) {
+		mirror->write(e->export_slot, &value);
+	}
+	_deliver(e, value);
+	if (e->typed && e->typed->observed()) {
+		e->typed->deliver(*this, value, stats);
+	}
 }
 
-void regstore::_unobserve(const std::string& key, const std::string& remote)
+/* Next sequence number, moving the register to the newest end of the version order */
+void regstore::_touch(const std::shared_ptr<reg_entry>& e) const
+{
+	e->version = ++seq;
+	/* Removed registers are not ordered, though a handle may still set them */
+	if (e->removed || newest == e.get()) {
+		return;
+	}
+	if (e->older || oldest == e.get()) {
+		_unlink(*e);
+	}
+	e->older = newest;
+	*(newest ? &newest->newer : &oldest) = e.get();
+	newest = e.get();
+}
+
+void regstore::_unlink(reg_entry& e) const
+{
+	*(e.older ? &e.older->newer : &oldest) = e.newer;
+	*(e.newer ? &e.newer->older : &newest) = e.older;
+	e.older = nullptr;
+	e.newer = nullptr;
+}
+
+/* Oldest register changed after since, the rest following it through newer */
+regstore::reg_entry *regstore::_changed_since(std::uint64_t since) const
+{
+	auto e = newest;
+	while (e && e->older && e->older->version > since) {
+		e = e->older;
+	}
+	return e;
+}
+
+/* Schedule the next sample, unless one is due already or nobody observes the register */
+void regstore::_arm_sampler(const std::shared_ptr<reg_entry>& e) const
+{
+	const auto s = e->sampler;
+	if (!s || s->armed) {
+		return;
+	}
+	bool observed = !_patterns(*e)->empty() || (e->typed && e->typed->observed());
+	auto interval = s->period;
+	for (const auto& rem : *_observers(*e)) {
+		observed = true;
+		if (rem.second->min_interval > std::chrono::steady_clock::duration::zero()) {
+			interval = std::min(interval, rem.second->min_interval);
+		}
+	}
+	const auto timer = observed ? _scheduler() : nullptr;
+	if (!timer) {
+		return;
+	}
+	s->armed = true;
+	timer->at(std::chrono::steady_clock::now() + interval, [this, e, s] {
+		std::lock_guard<store_mutex> lock(mx);
+		_sample(e, s);
+	});
+}
+
+void regstore::_sample(const std::shared_ptr<reg_entry>& e, const std::shared_ptr<sampler_entry>& s) const
 {
-	const auto for_reg = observers.find(key);
-	if (for_reg == observers.end()) {
+	s->armed = false;
+	if (e->sampler != s) {
 		return;
 	}
-	const auto for_rem = for_reg->second.find(remote);
-	if (for_rem == for_reg->second.end()) {
+	/* Left disarmed until observed again, without calling the getter */
+	if (e->removed || (!_string_observed(*e) && !(e->typed && e->typed->observed()))) {
+		return;
+	}
+	std::string value;
+	if (_get(*e, value) == err::ok && (!s->sampled || value != s->last)) {
+		s->sampled = true;
+		s->last = value;
+		_send_notification(e, value);
+	}
+	_arm_sampler(e);
+}
+
+bool regstore::_string_observed(reg_entry& e) const
+{
+	return !_observers(e)->empty() || !_patterns(e)->empty();
+}
+
+void regstore::_deliver(const std::shared_ptr<reg_entry>& e, const std::string& value) const
+{
+	if (async) {
+		dispatcher *d = async.get();
+		auto val = std::make_shared<const std::string>(value);
+		d->post([this, d, e, val] { _fan_out(*d, e, val); });
 		return;
 	}
-	for_reg->second.erase(for_rem);
-	if (for_reg->second.empty()) {
-		observers.erase(for_reg);
+	const auto observers = _observers(*e);
+	const auto stats = _stats(*e);
+	const auto now = std::chrono::steady_clock::now();
+	for (const auto& rem : *observers) {
+		if (!_queue(rem.first, e->name, value) && _admit(rem.first, rem.second, value, now, stats)) {
+			_timed(stats, [&] { rem.second->func(value); });
+		}
+	}
+	for (const auto& rem : *_patterns(*e)) {
+		if (!_queue(rem.first, e->name, value)) {
+			(*rem.second)(e->name, value);
+		}
+	}
+}
+
+/* Runs on the dispatcher's fan-out strand, so in notification order */
+void regstore::_fan_out(dispatcher& d, const std::shared_ptr<reg_entry>& e, const std::shared_ptr<const std::string>& value) const
+{
+	const auto observers = _observers(*e);
+	const auto stats = _stats(*e);
+	const auto now = std::chrono::steady_clock::now();
+	for (const auto& rem : *observers) {
+		auto ob = rem.second;
+		if (!_queue(rem.first, e->name, *value) && _admit(rem.first, ob, *value, now, stats)) {
+			d.post(rem.first, [ob, value, stats] { _timed(stats, [&] { ob->func(*value); }); });
+		}
+	}
+	for (const auto& rem : *_patterns(*e)) {
+		auto func = rem.second;
+		if (!_queue(rem.first, e->name, *value)) {
+			d.post(rem.first, [func, e, value] { (*func)(e->name, *value); });
+		}
 	}
 }
 
-bool regstore::_query_observer(const std::string& key, const std::string& remote, subscription_info& info) const
+/* Queue the change if remote is batched, returns false if it is not */
+bool regstore::_queue(const std::string& remote, const std::string& key, const std::string& value) const
 {
-	const auto for_reg = observers.find(key);
-	if (for_reg == observers.end()) {
+	if (!batching) {
 		return false;
 	}
-	const auto for_rem = for_reg->second.find(remote);
-	if (for_rem == for_reg->second.end()) {
+	std::lock_guard<std::mutex> lock(batches_mx);
+	const auto it = batches.find(remote);
+	if (it == batches.end()) {
 		return false;
 	}
-	const auto& rec = for_rem->second;
-	/* Slice */
-	info = rec;
+	const auto b = it->second;
+	const auto at = b->index.find(key);
+	if (at != b->index.end()) {
+		b->pending[at->second].value = value;
+		return true;
+	}
+	b->index.emplace(key, b->pending.size());
+	b->pending.push_back(change{key, value});
+	const auto timer = b->interval != std::chrono::steady_clock::duration::zero() && !b->armed ? _scheduler() : nullptr;
+	if (timer) {
+		b->armed = true;
+		timer->at(std::chrono::steady_clock::now() + b->interval, [this, b] {
+			std::lock_guard<store_mutex> lock(mx);
+			{
+				std::lock_guard<std::mutex> lock(batches_mx);
+				b->armed = false;
+			}
+			_flush(b);
+		});
+	}
 	return true;
 }
 
-void regstore::_send_notification(const std::string& key, const std::string& value) const
+/* Take the queued changes, which an observer may add to while they are delivered */
+std::vector<regstore::change> regstore::_take(batch_entry& b) const
 {
-	const auto for_reg = observers.find(key);
-	if (for_reg == observers.end()) {
+	std::lock_guard<std::mutex> lock(batches_mx);
+	std::vector<change> changes;
+	changes.swap(b.pending);
+	b.index.clear();
+	return changes;
+}
+
+/*
+ * Caller holds the lock.  With the dispatcher, the flush is itself queued on
+ * the fan-out strand, behind notifications which may still add to the batch.
+ */
+void regstore::_flush(const std::shared_ptr<batch_entry>& b) const
+{
+	if (async) {
+		dispatcher *d = async.get();
+		d->post([this, d, b] {
+			auto changes = std::make_shared<const std::vector<change>>(_take(*b));
+			if (!changes->empty()) {
+				d->post(b->remote, [b, changes] { b->func(*changes); });
+			}
+		});
 		return;
 	}
-	const auto now = std::chrono::steady_clock::now();
-	for (auto rem : for_reg->second) {
-		observer_entry& ob = rem.second;
-		if (now < ob.next) {
-			continue;
+	const auto changes = _take(*b);
+	if (!changes.empty()) {
+		b->func(changes);
+	}
+}
+
+void regstore::_flush_all() const
+{
+	if (!batching) {
+		return;
+	}
+	std::vector<std::shared_ptr<batch_entry>> all;
+	{
+		std::lock_guard<std::mutex> lock(batches_mx);
+		for (const auto& b : batches) {
+			all.push_back(b.second);
+		}
+	}
+	for (const auto& b : all) {
+		_flush(b);
+	}
+}
+
+void regstore::flush(const std::string& remote) const
+{
+	std::lock_guard<store_mutex> lock(mx);
+	std::shared_ptr<batch_entry> b;
+	{
+		std::lock_guard<std::mutex> lock(batches_mx);
+		const auto it = batches.find(remote);
+		if (it == batches.end()) {
+			return;
+		}
+		b = it->second;
+	}
+	_flush(b);
+}
+
+void regstore::_batch(const std::string& remote, const batch_observer& obs, const std::chrono::steady_clock::duration& interval)
+{
+	auto b = std::make_shared<batch_entry>();
+	b->remote = remote;
+	b->func = obs;
+	b->interval = interval;
+	std::shared_ptr<batch_entry> old;
+	{
+		std::lock_guard<std::mutex> lock(batches_mx);
+		auto& slot = batches[remote];
+		old = std::move(slot);
+		slot = std::move(b);
+		batching = true;
+	}
+	if (old) {
+		_flush(old);
+	}
+}
+
+void regstore::unbatch(const std::string& remote)
+{
+	std::lock_guard<store_mutex> lock(mx);
+	std::shared_ptr<batch_entry> b;
+	{
+		std::lock_guard<std::mutex> lock(batches_mx);
+		const auto it = batches.find(remote);
+		if (it == batches.end()) {
+			return;
+		}
+		b = std::move(it->second);
+		batches.erase(it);
+		batching = !batches.empty();
+	}
+	_flush(b);
+}
+
+/* Find the end of the dotted segment starting at pos, returns true if it is the last */
+bool regstore::_segment(const std::string& s, std::size_t pos, std::size_t& end)
+{
+	end = s.find('.', pos);
+	if (end == std::string::npos) {
+		end = s.size();
+		return true;
+	}
+	return false;
+}
+
+/* Collect pattern observers matching key from its segment at pos onwards */
+void regstore::_match(const pattern_node& node, const std::string& key, std::size_t pos, bool done, pattern_matches& out)
+{
+	out.insert(out.end(), node.rest.begin(), node.rest.end());
+	if (done) {
+		out.insert(out.end(), node.here.begin(), node.here.end());
+		return;
+	}
+	std::size_t end;
+	const bool last = _segment(key, pos, end);
+	const auto child = node.children.find(key.substr(pos, end - pos));
+	if (child != node.children.end()) {
+		_match(*child->second, key, end + 1, last, out);
+	}
+	if (node.any) {
+		_match(*node.any, key, end + 1, last, out);
+	}
+}
+
+/* Pattern observers matching the register, recomputed only when patterns change */
+std::shared_ptr<const regstore::pattern_matches> regstore::_patterns(reg_entry& e) const
+{
+	std::lock_guard<std::mutex> lock(patterns_mx);
+	if (e.patterns_gen != patterns_gen) {
+		auto matches = std::make_shared<pattern_matches>();
+		_match(patterns, e.name, 0, false, *matches);
+		e.patterns = std::move(matches);
+		e.patterns_gen = patterns_gen;
+	}
+	return e.patterns;
+}
+
+void regstore::observe_pattern(const std::string& pattern, const std::string& remote, const pattern_observer& obs)
+{
+	if (obs == nullptr) {
+		unobserve_pattern(pattern, remote);
+		return;
+	}
+	std::lock_guard<store_mutex> lock(mx);
+	{
+		std::lock_guard<std::mutex> lock(patterns_mx);
+		pattern_node *node = &patterns;
+		std::size_t pos = 0;
+		while (true) {
+			std::size_t end;
+			const bool last = _segment(pattern, pos, end);
+			const auto segment = pattern.substr(pos, end - pos);
+			if (last && segment == "**") {
+				node->rest[remote] = std::make_shared<const pattern_observer>(obs);
+				break;
+			}
+			auto& child = segment == "*" ? node->any : node->children[segment];
+			if (!child) {
+				child.reset(new pattern_node());
+			}
+			node = child.get();
+			if (last) {
+				node->here[remote] = std::make_shared<const pattern_observer>(obs);
+				break;
+			}
+			pos = end + 1;
+		}
+		remote_patterns[remote].insert(pattern);
+		patterns_gen++;
+	}
+	/* Sampled registers may now be observed */
+	for (const auto& e : sampled) {
+		_arm_sampler(e);
+	}
+}
+
+/* Returns true if node is left empty, for its parent to remove */
+bool regstore::_unobserve_pattern(pattern_node& node, const std::string& pattern, std::size_t pos, const std::string& remote)
+{
+	std::size_t end;
+	const bool last = _segment(pattern, pos, end);
+	const auto segment = pattern.substr(pos, end - pos);
+	if (last && segment == "**") {
+		node.rest.erase(remote);
+		return node.empty();
+	}
+	pattern_node *child = node.any.get();
+	if (segment != "*") {
+		const auto it = node.children.find(segment);
+		child = it == node.children.end() ? nullptr : it->second.get();
+	}
+	if (!child) {
+		return node.empty();
+	}
+	if (last) {
+		child->here.erase(remote);
+	} else {
+		_unobserve_pattern(*child, pattern, end + 1, remote);
+	}
+	if (child->empty()) {
+		if (segment == "*") {
+			node.any.reset();
+		} else {
+			node.children.erase(segment);
 		}
-		ob.next = now;
-		ob.next += ob.min_interval;
-		ob.func(value);
 	}
+	return node.empty();
 }
 
-regstore::err regstore::_notify(const std::string& key) const
+void regstore::unobserve_pattern(const std::string& pattern, const std::string& remote)
+{
+	std::lock_guard<std::mutex> lock(patterns_mx);
+	_unobserve_pattern(patterns, pattern, 0, remote);
+	const auto pats = remote_patterns.find(remote);
+	if (pats != remote_patterns.end()) {
+		pats->second.erase(pattern);
+		if (pats->second.empty()) {
+			remote_patterns.erase(pats);
+		}
+	}
+	patterns_gen++;
+}
+
+regstore::err regstore::_notify(const std::shared_ptr<reg_entry>& e) const
 {
 	std::string value;
-	auto res = _get(key, value);
+	auto res = _get(*e, value);
 	if (res == err::ok) {
-		_send_notification(key, value);
+		_send_notification(e, value);
 	}
 	return res;
 }
 
+regstore::err regstore::_notify(const table& t, const std::string& key) const
+{
+	const auto e = _find(t, key);
+	if (!e) {
+		return err::invalid_key;
+	}
+	return _notify(e);
+}
+
+}
+
+#if defined BENCH_regstore
+using namespace mark;
+
+static constexpr std::size_t nregs = 1000;
+
+static std::vector<std::string> static_keys;
+static regstore::static_reg static_regs[nregs];
+
+static regstore::err static_getter(std::string& out)
+{
+	out = "static";
+	return regstore::ok;
+}
+
+/*
+ * Replaced for the whole program, so that check_typed_set can count
+ * allocations.  Kept out of line, so that gcc does not pair the free with a
+ * new it cannot see is malloc.
+ */
+static std::atomic<unsigned long> allocations{0};
+
+__attribute__((noinline)) void *operator new(std::size_t size)
+{
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	if (void *p = std::malloc(size ? size : 1)) {
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept
+{
+	std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, std::size_t) noexcept
+{
+	std::free(p);
+}
+
+/* Typed sets with only a typed observer pass the raw value, so must not allocate */
+static bool check_typed_set()
+{
+	regstore rs;
+	int stored = 0;
+	int seen = 0;
+	const auto reg = rs.add_typed<int>("typed", [&] (int& v) { v = stored; return regstore::ok; }, [&] (const int& v) { stored = v; return regstore::ok; });
+	rs.observe(reg, "remote", [&] (const int& v) { seen = v; });
+	/* The first set caches the register's (empty) pattern matches */
+	rs.set(reg, 0);
+	const auto before = allocations.load();
+	for (int i = 1; i <= 100; i++) {
+		rs.set(reg, i);
+	}
+	const auto count = allocations.load() - before;
+	if (count != 0 || seen != 100) {
+		std::printf("Typed set allocated %lu times in 100 sets\n", count);
+		return false;
+	}
+	return true;
+}
+
+/* Read throughput of get() from a varying number of threads, optionally with the registers in a static table */
+static double bench_get(regstore::concurrency mode, unsigned threads, std::chrono::milliseconds duration, const regstore::static_table<nregs> *table = nullptr)
+{
+	regstore rs(mode);
+	if (table) {
+		rs.mount(*table);
+	}
+	for (std::size_t i = 0; i < nregs && !table; i++) {
+		const auto value = std::to_string(i);
+		rs.add("reg." + value, [value] (std::string& out) { out = value; return regstore::ok; }, nullptr);
+	}
+	std::atomic<bool> run{true};
+	std::atomic<unsigned long> total{0};
+	std::vector<std::thread> workers;
+	for (unsigned t = 0; t < threads; t++) {
+		workers.emplace_back([&, t] {
+			std::string value;
+			unsigned long count = 0;
+			std::size_t i = t;
+			while (run.load(std::memory_order_relaxed)) {
+				rs.get("reg." + std::to_string(i++ % nregs), value);
+				count++;
+			}
+			total += count;
+		});
+	}
+	std::this_thread::sleep_for(duration);
+	run = false;
+	for (auto& w : workers) {
+		w.join();
+	}
+	return total / std::chrono::duration<double>(duration).count();
+}
+
+int main(int argc, char *argv[])
+{
+	const unsigned max_threads = argc > 1 ? std::stoul(argv[1]) : std::max(1u, std::thread::hardware_concurrency());
+	const std::chrono::milliseconds duration(500);
+	if (!check_typed_set()) {
+		return 1;
+	}
+	/* Built at runtime here, but looked up as a constexpr one would be */
+	for (std::size_t i = 0; i < nregs; i++) {
+		static_keys.push_back("reg." + std::to_string(i));
+	}
+	for (std::size_t i = 0; i < nregs; i++) {
+		static_regs[i] = { static_keys[i].c_str(), static_getter, nullptr };
+	}
+	std::unique_ptr<regstore::static_table<nregs>> table(new regstore::static_table<nregs>(static_regs));
+	std::printf("%8s %16s %16s %16s\n", "threads", "serialized/s", "concurrent/s", "static/s");
+	for (unsigned threads = 1; threads <= max_threads; threads *= 2) {
+		const auto ser = bench_get(regstore::concurrency::serialized, threads, duration);
+		const auto con = bench_get(regstore::concurrency::concurrent_reads, threads, duration);
+		const auto sta = bench_get(regstore::concurrency::concurrent_reads, threads, duration, table.get());
+		std::printf("%8u %16.0f %16.0f %16.0f\n", threads, ser, con, sta);
+	}
+	return 0;
 }
+#endif
@@ -1,5 +1,6 @@
 #pragma once
 #include <cstd/std.h>
+#include <pthread.h>
 #include <fixedstr/fixedstr.h>
 #include <cstruct/binary_tree.h>
 
@@ -18,6 +19,39 @@ const char *regstore_errstr(enum regstore_err error);
 typedef enum regstore_err regstore_getter(void *arg, struct fstr *value);
 typedef enum regstore_err regstore_setter(void *arg, const struct fstr *value);
 typedef void regstore_observer(void *arg, const struct fstr *value);
+typedef void regstore_pattern_observer(void *arg, const struct fstr *key, const struct fstr *value);
+
+/*
+ * Typed registers hold a raw value, which moves through the typed get/set/
+ * observe functions without formatting or heap allocation.  String callers
+ * still see the register: integers and floats as decimal, blobs as hex.
+ */
+#define REGSTORE_BLOB_MAX 32
+
+enum regstore_type {
+	regstore_type_string, /* Not a typed register */
+	regstore_type_int,
+	regstore_type_uint,
+	regstore_type_float,
+	regstore_type_blob
+};
+
+struct regstore_value {
+	enum regstore_type type;
+	union {
+		int64_t i;
+		uint64_t u;
+		double f;
+		struct {
+			size_t len;
+			uint8_t data[REGSTORE_BLOB_MAX];
+		} blob;
+	};
+};
+
+typedef enum regstore_err regstore_typed_getter(void *arg, struct regstore_value *value);
+typedef enum regstore_err regstore_typed_setter(void *arg, const struct regstore_value *value);
+typedef void regstore_typed_observer(void *arg, const struct regstore_value *value);
 
 /* Register type flags (used by register info */
 enum regstore_regtype {
@@ -40,39 +74,439 @@ struct regstore_reginfo {
 	struct regstore_subscription_info sub_info;
 	/* Not used in main tree, only for info listing */
 	bool subscribed;
+	/* Store sequence number of the register's last add, set or notify */
+	uint64_t version;
+	/* Reads served from / refilling the register's cache, if it has one */
+	uint64_t cache_hits;
+	uint64_t cache_misses;
+};
+
+struct observer;
+struct prefix_node;
+struct pattern_node;
+
+/*
+ * Register resolved once by key, shared and reference-counted.  Once the
+ * register is deleted, operations on the handle return
+ * regstore_err_invalid_key, and the handle must still be released.
+ */
+struct regstore_handle;
+
+/*
+ * Latency histogram: bucket 0 counts calls which took under 1 us, bucket i
+ * those from 2^(i-1) up to 2^i us, and the last any longer
+ */
+#define REGSTORE_HISTOGRAM_BUCKETS 24
+
+struct regstore_histogram {
+	uint64_t buckets[REGSTORE_HISTOGRAM_BUCKETS];
+};
+
+/* Count of calls recorded */
+uint64_t regstore_histogram_count(const struct regstore_histogram *h);
+
+/* Upper bound in us of the bucket holding the q quantile (0 to 1) of the calls recorded, 0 if none */
+uint64_t regstore_histogram_quantile(const struct regstore_histogram *h, double q);
+
+/* Register stats (query response) */
+struct regstore_stats {
+	uint64_t gets; /* Getter calls, not reads served from the cache */
+	uint64_t sets; /* Setter calls */
+	uint64_t notifies; /* Notifications sent, not those suppressed as unchanged */
+	uint64_t rate_limited; /* Values held back from observers by their min_interval */
+	struct regstore_histogram get_us;
+	struct regstore_histogram set_us;
+	/* The register's own observers, not pattern subscriptions or batches */
+	struct regstore_histogram observer_us;
 };
 
 /* Register store */
+struct regstore_journal;
+struct regstore_export;
+struct lock_stats;
+
 struct regstore {
 	struct binary_tree store; /* reg(name) */
+	size_t count;
+	/* Radix tree over key bytes, for prefix queries */
+	struct prefix_node *prefixes;
+	/* Trie over dot-separated segments of pattern subscriptions */
+	struct pattern_node *patterns;
+	/* What each remote subscribes to, remote_subs(remote) */
+	struct binary_tree remotes;
+	/* Remote names and patterns held once however many subscriptions use them, fstr */
+	struct binary_tree strings;
+	/* Batched remotes, interned, so ticks and flushes skip the others */
+	struct fstr *batched;
+	size_t batches;
+	size_t batched_cap;
+	/* Sequence number of the last change, registers ordered by their last */
+	uint64_t seq;
+	struct reg *oldest;
+	struct reg *newest;
+	struct regstore_journal *journal; /* Set if journaling */
+	struct regstore_export *exported; /* Set if exporting to shared memory */
+	bool stats; /* Set by regstore_stats_enable */
+	/* Registers polled by regstore_tick */
+	struct reg **sampled;
+	size_t sampled_len;
+	size_t sampled_cap;
+	/* Set by regstore_init_concurrent */
+	bool concurrent;
+	pthread_rwlock_t lock;
+	/* Guards register caches, which readers fill in parallel */
+	pthread_mutex_t cache_lock;
+	pthread_cond_t cache_fetched;
+	/* Time spent waiting for lock, recorded while stats are enabled */
+	struct lock_stats *lock_stats;
+	/* Observer calls queued under the write lock, made once it is released */
+	struct deferred_call *deferred;
+	size_t deferred_len;
+	size_t deferred_cap;
+	/*
+	 * Writes' calls are made in turn, in the order the writes took tickets
+	 * (under the write lock)
+	 */
+	pthread_mutex_t delivery_lock;
+	pthread_cond_t delivery_done;
+	uint64_t delivery_next;
+	uint64_t delivery_turn; /* Guarded by delivery_lock */
+	/* Min-heap by next_ms of observers holding a trailing value */
+	struct observer **deadlines;
+	size_t deadlines_len;
+	size_t deadlines_cap;
 };
 
 void regstore_init(struct regstore *inst);
+
+/*
+ * Initialise a store which may be used from several threads.  Reads (get,
+ * list, each, changes_since, query and the like) run in parallel under a
+ * shared lock, everything else under an exclusive one.  Getters, setters and
+ * visitors are called with the lock held and must not call into the store.
+ * Observers are called once the exclusive lock is released, so they may.
+ * Changes' calls are made one change at a time, in the order of the
+ * changes, so an observer ends with the latest value.  Once a call which
+ * removes or replaces observers (delete, observe, unobserve, batch and the
+ * like) returns, calls made before it are complete and the observers it
+ * removed are not called again, so their args may be freed; not so when it
+ * is made from within an observer, as that observer's own change's calls
+ * are still being made.  Handles must not be used once a concurrent store is
+ * destroyed.
+ */
+void regstore_init_concurrent(struct regstore *inst);
 void regstore_destroy(struct regstore *inst);
 
 /* List registers (pass uninitialised/zero-filled binary_tree in, tree<regstore_reginfo> returned) */
 bool regstore_list(struct regstore *inst, struct binary_tree *out, const struct fstr *remote, bool values);
 
+/*
+ * Visitor for regstore_each, return false to stop.  Strings in info refer to
+ * the store and are only valid during the call.
+ */
+typedef bool regstore_visitor(void *arg, const struct regstore_reginfo *info);
+
+/*
+ * Visit registers in key order without copying them.  Only keys starting
+ * with prefix and sorting after cursor are visited (either may be NULL), so
+ * a large store can be paged through by passing the last key seen as the
+ * next cursor.  Returns false if the visitor stopped the walk.
+ */
+bool regstore_each(struct regstore *inst, const struct fstr *prefix, const struct fstr *cursor, const struct fstr *remote, bool values, regstore_visitor *visitor, void *arg);
+
+/* Sequence number of the store's last change */
+uint64_t regstore_seq(const struct regstore *inst);
+
+/*
+ * Visit readable registers added, set or notified after sequence number
+ * since, least recently changed first, with their values.  Costs time in
+ * proportion to the registers changed, not the size of the store, so a
+ * reconnecting remote can resync by passing the value returned last time.
+ * Removed registers are not reported.  Returns the current sequence number,
+ * or if the visitor stops, the one to resume after the register it stopped at.
+ */
+uint64_t regstore_changes_since(struct regstore *inst, uint64_t since, const struct fstr *remote, regstore_visitor *visitor, void *arg);
+
 /* Add a register */
 bool regstore_add(struct regstore *inst, const struct fstr *key, regstore_getter *getter, void *getter_arg, regstore_setter *setter, void *setter_arg);
 bool regstore_add_s(struct regstore *inst, const char *key, regstore_getter *getter, void *getter_arg, regstore_setter *setter, void *setter_arg);
 
+/* One register for regstore_add_many */
+struct regstore_def {
+	struct fstr key;
+	regstore_getter *getter;
+	void *getter_arg;
+	regstore_setter *setter;
+	void *setter_arg;
+};
+
+/*
+ * Add several registers under one lock, returns how many were added (keys
+ * already present are skipped, as is any repeat of a key, so the first of
+ * repeated keys is the one added).  Keys sorted by fstr_cmp are inserted
+ * median first, so the store's tree is built balanced however it treats
+ * sorted insertion.
+ */
+size_t regstore_add_many(struct regstore *inst, size_t count, const struct regstore_def *defs);
+
+/* Add a typed register, the getter fills in the value but not its type */
+bool regstore_add_typed(struct regstore *inst, const struct fstr *key, enum regstore_type type, regstore_typed_getter *getter, void *getter_arg, regstore_typed_setter *setter, void *setter_arg);
+
 /* Delete a register */
 bool regstore_delete(struct regstore *inst, const struct fstr *key);
 
+/* Delete / notify all registers whose keys start with prefix, returns count */
+size_t regstore_delete_prefix(struct regstore *inst, const struct fstr *prefix);
+size_t regstore_notify_prefix(struct regstore *inst, const struct fstr *prefix);
+
 /* Set a register */
 enum regstore_err regstore_set(struct regstore *inst, const struct fstr *key, const struct fstr *value);
 
 /* Get a register */
 enum regstore_err regstore_get(struct regstore *inst, const struct fstr *key, struct fstr *value);
 
+/*
+ * Typed access, regstore_err_invalid_value if the register is not typed or
+ * (for set) value's type does not match it
+ */
+enum regstore_err regstore_get_typed(struct regstore *inst, const struct fstr *key, struct regstore_value *value);
+enum regstore_err regstore_set_typed(struct regstore *inst, const struct fstr *key, const struct regstore_value *value);
+enum regstore_err regstore_get_typed_h(struct regstore_handle *handle, struct regstore_value *value);
+enum regstore_err regstore_set_typed_h(struct regstore_handle *handle, const struct regstore_value *value);
+
+/* Subscribe to a typed register's raw values, not rate-limited */
+bool regstore_observe_typed(struct regstore *inst, const struct fstr *key, const struct fstr *remote, regstore_typed_observer *observer, void *observer_arg);
+bool regstore_unobserve_typed(struct regstore *inst, const struct fstr *key, const struct fstr *remote);
+
+/*
+ * Drop notifications which repeat the register's last notified value.  A
+ * fingerprint of it is kept: the value itself if small, otherwise its length
+ * and hash.  Returns false if the register does not exist.
+ */
+bool regstore_suppress_unchanged(struct regstore *inst, const struct fstr *key, bool enable);
+
+/*
+ * Keep the register's value for max_age_ms after reading it, and serve get,
+ * list, notify and the like from that copy meanwhile.  Any set discards it.
+ * Typed gets are not cached.  A max_age_ms of 0 stops caching.  Returns
+ * false if the register does not exist.
+ */
+bool regstore_cache(struct regstore *inst, const struct fstr *key, int64_t max_age_ms);
+
+/*
+ * Poll the register from regstore_tick while anyone observes it, notifying
+ * when its value changes: for read-only registers which nothing else
+ * notifies.  It is polled as often as its most frequent subscriber's
+ * min_interval allows, or every period_ms for subscribers without one (and
+ * pattern and typed subscribers).  Nothing is polled while unobserved, so
+ * call regstore_tick after subscribing.  A period_ms of 0 stops sampling.
+ * Returns false if the register does not exist.
+ */
+bool regstore_sample(struct regstore *inst, const struct fstr *key, int64_t period_ms);
+
 /* Subscribe / unsubscribe */
 bool regstore_observe(struct regstore *inst, const struct fstr *key, const struct fstr *remote, regstore_observer *observer, void *observer_arg, int64_t min_interval);
 
 bool regstore_unobserve(struct regstore *inst, const struct fstr *key, const struct fstr *remote);
 
+/*
+ * Subscribe to every register matching a dot-separated pattern, including
+ * those added later.  "*" matches one segment and a final "**" matches any
+ * remainder, so "eps.*.voltage" and "eps.**" are both valid.  Pattern
+ * subscriptions are not rate-limited.
+ */
+bool regstore_observe_pattern(struct regstore *inst, const struct fstr *pattern, const struct fstr *remote, regstore_pattern_observer *observer, void *observer_arg);
+
+bool regstore_unobserve_pattern(struct regstore *inst, const struct fstr *pattern, const struct fstr *remote);
+
+/*
+ * Drop every register, typed and pattern subscription of remote, e.g. on
+ * disconnect, returns how many there were.  Its batch is discarded with
+ * any changes still queued, unflushed.  Like list_subscriptions, it costs
+ * time proportional to the remote's subscriptions, not the store.
+ */
+size_t regstore_unobserve_all(struct regstore *inst, const struct fstr *remote);
+
+/*
+ * List registers remote observes, string or typed, out as for regstore_list.
+ * Registers it only matches through pattern subscriptions are not listed,
+ * as finding them would mean walking the whole store.
+ */
+bool regstore_list_subscriptions(struct regstore *inst, struct binary_tree *out, const struct fstr *remote, bool values);
+
+/* One change in a batch, strings are only valid during the call */
+struct regstore_change {
+	struct fstr key;
+	struct fstr value;
+};
+
+typedef void regstore_batch_observer(void *arg, const struct regstore_change *changes, size_t count);
+
+/*
+ * Deliver remote's register and pattern notifications in batches: changes
+ * are queued (the newest value per key, in first-change order) and passed
+ * to observer in one call per flush.  Batches are flushed by regstore_flush,
+ * at the end of regstore_set_many and, if interval_ms is positive, by
+ * regstore_tick once that long has passed since the batch's first change.
+ * Rate limits do not apply to a batched remote.  A batch observer may set
+ * registers, but must not change subscriptions or batching.
+ */
+bool regstore_batch(struct regstore *inst, const struct fstr *remote, regstore_batch_observer *observer, void *observer_arg, int64_t interval_ms);
+
+/* Flush remote's batch and deliver its notifications individually again */
+bool regstore_unbatch(struct regstore *inst, const struct fstr *remote);
+
+/* Flush remote's batch, or every batch if remote is NULL */
+void regstore_flush(struct regstore *inst, const struct fstr *remote);
+
+/* One change recorded in the journal, strings refer to the cursor */
+struct regstore_journal_record {
+	uint64_t seq;
+	int64_t time_ms; /* Wall clock */
+	struct fstr key;
+	struct fstr value;
+	/* Key and value did not fit the journal's record size and were cut short */
+	bool truncated;
+};
+
+/* Position in the journal, each reader uses its own */
+struct regstore_journal_cursor {
+	struct regstore_journal *journal; /* NULL if there was none */
+	uint64_t pos;
+	uint64_t lost; /* Records overwritten before they could be read */
+	char *buf; /* Key and value of the last record */
+};
+
+/*
+ * Record each set and notify (unless suppressed as unchanged) in a journal of
+ * the last capacity changes, each keeping up to record_size bytes of key and
+ * value.  Replaces any previous journal, whose cursors carry on reading it; a
+ * capacity of 0 stops journaling.
+ *
+ * The journal is a ring with the store as its only writer.  Each slot is a
+ * seqlock, so cursors read it without locking from any thread, skipping
+ * records overwritten while they copy them, and never hold up the store.
+ */
+void regstore_journal_enable(struct regstore *inst, size_t capacity, size_t record_size);
+
+/* Cursor at the oldest record kept, to replay history, or at the next change, to tail it */
+void regstore_journal_replay(struct regstore *inst, struct regstore_journal_cursor *cursor);
+void regstore_journal_tail(struct regstore *inst, struct regstore_journal_cursor *cursor);
+
+/* Next record, false once caught up.  Takes no lock. */
+bool regstore_journal_next(struct regstore_journal_cursor *cursor, struct regstore_journal_record *rec);
+
+void regstore_journal_cursor_destroy(struct regstore_journal_cursor *cursor);
+
+/*
+ * Export registers to a shared-memory segment (a shm_open name, e.g.
+ * "/regs") for other processes to read through regstore_mirror.h without
+ * locks or system calls.  The segment has capacity slots, each holding up
+ * to key_size bytes of key and value_size of value.  An exported
+ * register's slot is rewritten on each set and notify (unless suppressed as
+ * unchanged).  Replaces any previous segment; a NULL name stops exporting.
+ */
+bool regstore_export_open(struct regstore *inst, const char *name, size_t capacity, size_t key_size, size_t value_size);
+
+/*
+ * Add a register to the segment, false if not found, already exported, its
+ * key is too long or the segment is full
+ */
+bool regstore_export_register(struct regstore *inst, const struct fstr *key);
+
+/*
+ * Count and time each register's getter, setter and observer calls, and
+ * waits for a concurrent store's lock.  While enabled this costs two clock
+ * reads per call; disabling it discards the stats.
+ */
+void regstore_stats_enable(struct regstore *inst, bool enable);
+
+/* Stats of key, false if it does not exist or stats are not enabled */
+bool regstore_stats(struct regstore *inst, const struct fstr *key, struct regstore_stats *out);
+
+/* Waits for the lock, false if the store is not concurrent or stats are not enabled */
+bool regstore_lock_stats(struct regstore *inst, struct regstore_histogram *out);
+
+/*
+ * Publish key's stats as read-only registers "_stats.<key>.<stat>": gets,
+ * sets, notifies, rate_limited, and get_, set_ and observer_ p50_us and
+ * p99_us.  A NULL key publishes a concurrent store's lock waits as
+ * "_stats.lock_wait_p50_us" and "_stats.lock_wait_p99_us".  They are read
+ * like any other register, so remotes may subscribe to them and have them
+ * sampled, and are not readable while stats are disabled or key does not
+ * exist.  Returns false if any of them already exists.
+ */
+bool regstore_stats_publish(struct regstore *inst, const struct fstr *key);
+
 /* Get observer info */
 bool regstore_query_observer(struct regstore *inst, const struct fstr *key, const struct fstr *remote, struct regstore_subscription_info *out);
 
 /* Notify that register has changed */
 enum regstore_err regstore_notify(struct regstore *inst, const struct fstr *key);
+
+/*
+ * Get/set several registers, one result per key.  Keys sorted by fstr_cmp
+ * may be resolved by one in-order walk of the store instead of a lookup
+ * each.  set_many sends notifications once every value has been set.
+ */
+void regstore_get_many(struct regstore *inst, size_t count, const struct fstr *keys, struct fstr *values, enum regstore_err *results);
+void regstore_set_many(struct regstore *inst, size_t count, const struct fstr *keys, const struct fstr *values, enum regstore_err *results);
+
+/*
+ * Save the values of readable and writeable registers to a snapshot file.
+ * A since of 0 writes every such register to a new file, replacing path
+ * once complete; otherwise only those added, set or notified after sequence
+ * number since are appended to it, so saves cost time in proportion to what
+ * changed.  Returns the sequence number to pass to the next save, or 0 on
+ * failure, which makes the next save start a new file.  Appending grows the
+ * file until a save with since 0 compacts it.
+ */
+uint64_t regstore_snapshot_save(struct regstore *inst, const char *path, uint64_t since);
+
+/*
+ * Set registers to their last values in a snapshot file, as one
+ * regstore_set_many.  Keys no longer present or not writeable are skipped;
+ * restored (if not NULL) is set to the count of registers set.  Returns
+ * false if the file cannot be read or is not a snapshot.
+ */
+bool regstore_snapshot_restore(struct regstore *inst, const char *path, size_t *restored);
+
+/* Sets staged for regstore_txn_commit, applied in order */
+struct regstore_txn {
+	struct fstr *keys;
+	struct fstr *values;
+	size_t count;
+	size_t cap;
+};
+
+void regstore_txn_init(struct regstore_txn *txn);
+void regstore_txn_destroy(struct regstore_txn *txn);
+
+/* Stage a set, key and value are copied */
+void regstore_txn_set(struct regstore_txn *txn, const struct fstr *key, const struct fstr *value);
+
+/*
+ * Apply a transaction atomically.  If any setter fails, the registers already
+ * set are restored to the values read before the commit, so every register
+ * in the transaction must be readable.  Each changed register is notified
+ * once, after every set has been applied.  On failure, failed (if not NULL)
+ * is set to the index of the set which caused it.
+ */
+enum regstore_err regstore_txn_commit(struct regstore *inst, const struct regstore_txn *txn, size_t *failed);
+
+/* Resolve key to a handle (NULL if not found), release when done with it */
+struct regstore_handle *regstore_resolve(struct regstore *inst, const struct fstr *key);
+void regstore_release(struct regstore_handle *handle);
+
+/* Get/set/notify without looking the key up */
+enum regstore_err regstore_set_h(struct regstore_handle *handle, const struct fstr *value);
+enum regstore_err regstore_get_h(struct regstore_handle *handle, struct fstr *value);
+enum regstore_err regstore_notify_h(struct regstore_handle *handle);
+
+/*
+ * Changes inside a subscription's min_interval are coalesced, and the newest
+ * value is sent when the interval ends.  Call this to send those which are
+ * due, flush batches whose interval has passed and poll sampled registers.
+ * It returns ms until the next one is due or -1 if none are pending.
+ */
+int64_t regstore_tick(struct regstore *inst);
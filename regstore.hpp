@@ -1,12 +1,164 @@
 #pragma once
 /* Register store, supporting read/write-only dynamic registers and observers */
 #include <cstd/std.hpp>
+#include "regstore_mirror.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <future>
+#include <limits>
+#include <memory>
+#include <set>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <vector>
 
 namespace mark {
 
+/*
+ * Text form of typed register values, used only when a string-based caller
+ * reads, writes or observes a typed register.  Integers and floats are
+ * decimal, byte arrays are hex.  Specialise for other types.
+ */
+template <typename T, typename Enable = void>
+struct regstore_codec;
+
+template <typename T>
+struct regstore_codec<T, typename std::enable_if<std::is_integral<T>::value>::type> {
+	static void format(const T& value, std::string& out)
+		{ out = std::to_string(value); }
+	static bool parse(const std::string& in, T& value)
+	{
+		if (in.empty() || (!std::is_signed<T>::value && in[0] == '-')) {
+			return false;
+		}
+		char *end;
+		errno = 0;
+		if (std::is_signed<T>::value) {
+			const auto v = std::strtoll(in.c_str(), &end, 10);
+			if (v < std::numeric_limits<T>::min() || v > std::numeric_limits<T>::max()) {
+				return false;
+			}
+			value = static_cast<T>(v);
+		} else {
+			const auto v = std::strtoull(in.c_str(), &end, 10);
+			if (v > std::numeric_limits<T>::max()) {
+				return false;
+			}
+			value = static_cast<T>(v);
+		}
+		return errno == 0 && *end == 0;
+	}
+};
+
+template <typename T>
+struct regstore_codec<T, typename std::enable_if<std::is_floating_point<T>::value>::type> {
+	static void format(const T& value, std::string& out)
+	{
+		char buf[64];
+		std::snprintf(buf, sizeof(buf), "%.*Lg", std::numeric_limits<T>::max_digits10, static_cast<long double>(value));
+		out = buf;
+	}
+	static bool parse(const std::string& in, T& value)
+	{
+		char *end;
+		errno = 0;
+		value = static_cast<T>(std::strtold(in.c_str(), &end));
+		return !in.empty() && errno == 0 && *end == 0;
+	}
+};
+
+template <std::size_t N>
+struct regstore_codec<std::array<std::uint8_t, N>> {
+	static void format(const std::array<std::uint8_t, N>& value, std::string& out)
+	{
+		static const char digits[] = "0123456789abcdef";
+		out.resize(N * 2);
+		for (std::size_t i = 0; i < N; i++) {
+			out[i * 2] = digits[value[i] >> 4];
+			out[i * 2 + 1] = digits[value[i] & 0xf];
+		}
+	}
+	static bool parse(const std::string& in, std::array<std::uint8_t, N>& value)
+	{
+		if (in.size() != N * 2) {
+			return false;
+		}
+		for (std::size_t i = 0; i < N * 2; i++) {
+			const char c = in[i];
+			const int d = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+			if (d < 0) {
+				return false;
+			}
+			value[i / 2] = static_cast<std::uint8_t>(i % 2 ? (value[i / 2] << 4) | d : d);
+		}
+		return true;
+	}
+};
+
 /*
  * Observers are called from within a lock so do not call any methods on the
- * regstore from within an observer
+ * regstore from within an observer.  Once start_dispatcher has been called,
+ * observers are instead called from the dispatcher's worker threads with no
+ * lock held, in order for each remote, and may call back into the regstore
+ * (but not start_dispatcher/stop_dispatcher).
+ *
+ * A subscription's min_interval throttles it without losing the final value:
+ * changes inside the interval are coalesced and the newest is delivered once
+ * the interval ends, from the store's timer thread.
+ *
+ * In concurrent_reads mode, get/list/query_observer do not take the lock.
+ * They read an immutable snapshot of the register table, which add/remove
+ * replace, and each register's observer set, which observe/unobserve
+ * replace.  Getters may then be called concurrently with each other and with
+ * setters, and must not call add/remove/observe/unobserve.
+ *
+ * A pattern subscription covers every register matching a dotted pattern,
+ * where "*" matches one segment and a final "**" matches any remainder
+ * (e.g. "eps.*.v", "eps.**").  It is stored once, in a trie of patterns,
+ * and each register caches the patterns it matches until the set of
+ * patterns changes.  Pattern subscriptions are not rate-limited.
+ *
+ * With suppress_unchanged, a register remembers a fingerprint of the last
+ * value it notified (the value itself if small, otherwise its hash and size)
+ * and drops notifications which repeat it.
+ *
+ * commit applies a transaction's sets under one lock acquisition.  If any
+ * setter fails, those already applied are restored to the values read before
+ * the commit, so every register in a transaction must be readable.  Each
+ * changed register is notified once, after every set has been applied.  In
+ * concurrent_reads mode, get may still see a transaction part-way through.
+ *
+ * A batched remote (batch) has its register and pattern notifications queued
+ * rather than delivered, and receives them in one call per flush.  Flushes
+ * run like other observers: inline under the lock, or on the remote's strand
+ * once the dispatcher is started.  Rate limits do not apply to a batched
+ * remote, its flush interval does.
+ *
+ * Typed registers (add_typed) hold a T, read and written through a typed<T>
+ * handle without formatting or heap allocation.  Typed observers receive the
+ * raw value and are not rate-limited.  String callers still see the register,
+ * converted by regstore_codec<T> only when they use it.
+ *
+ * Async registers (add_async) start their get/set and complete it later
+ * through a callback, e.g. for a slow bus transaction.  get_async/set_async
+ * start them with no lock held and report completion through a callback or
+ * future, so neither the store nor a thread waits on the operation.
+ *
+ * A handle from resolve() reaches its register without looking the key up.
+ * Once the register is removed, operations on the handle return invalid_key.
+ *
+ * A static_table holds registers known at build time, with a lookup the
+ * compiler builds.  Once mounted, its keys are found through that rather
+ * than the store's index, and its registers otherwise behave like any other.
+ * Mounting allocates their entries in one block, though each still takes a
+ * node in the key order used for listing.
  */
 class regstore {
 public:
@@ -16,14 +168,48 @@ public:
 		invalid_value,
 		unknown,
 		not_readable,
-		not_writeable
+		not_writeable,
+		/* From a setter: value accepted but unchanged, so observers are not notified */
+		no_change
 	};
 	static const char *errstr(err error);
 	using getter = std::function<err(std::string&)>;
 	using setter = std::function<err(const std::string&)>;
 	using observer = std::function<void(const std::string& value)>;
+	using pattern_observer = std::function<void(const std::string& key, const std::string& value)>;
+	struct change {
+		std::string key;
+		std::string value;
+	};
+	/* Changes queued for a remote since its last flush, newest value per key in first-change order */
+	using batch_observer = std::function<void(const std::vector<change>& changes)>;
+	/* Completion of an async get/set, called on whichever thread finishes it */
+	using get_callback = std::function<void(err res, const std::string& value)>;
+	using set_callback = std::function<void(err res)>;
+	/* Start a get/set and return at once, calling done exactly once on completion */
+	using async_getter = std::function<void(const get_callback& done)>;
+	using async_setter = std::function<void(const std::string& value, const set_callback& done)>;
+	struct get_result {
+		err res;
+		std::string value;
+	};
+	template <typename T>
+	using typed_getter = std::function<err(T&)>;
+	template <typename T>
+	using typed_setter = std::function<err(const T&)>;
+	template <typename T>
+	using typed_observer = std::function<void(const T&)>;
 	using reg_type = int;
 	static constexpr reg_type rt_none = 0, rt_readable = 1, rt_writeable = 2;
+	/*
+	 * In concurrent_reads mode each add, remove or remove_prefix copies the
+	 * register table, so adding n registers one at a time costs O(n^2).  Add
+	 * them with add_many (or mount a static table), which copies it once.
+	 */
+	enum class concurrency {
+		serialized,
+		concurrent_reads
+	};
 	struct subscription_info {
 		std::chrono::steady_clock::time_point next;
 		std::chrono::steady_clock::duration min_interval;
@@ -32,62 +218,1256 @@ public:
 		reg_type type = rt_none;
 		bool subscribed = false;
 		subscription_info sub_info;
+		/* Store sequence number of the register's last add, set or notify */
+		std::uint64_t version = 0;
+		/* Reads served from / refilling the register's cache, if it has one */
+		std::uint64_t cache_hits = 0;
+		std::uint64_t cache_misses = 0;
 	};
 	using register_list = std::unordered_map<std::string, register_info>;
+	/*
+	 * Latency histogram: bucket 0 counts calls which took under 1 us, bucket
+	 * i those from 2^(i-1) up to 2^i us, and the last any longer
+	 */
+	struct histogram {
+		static constexpr std::size_t nbuckets = 24;
+		std::array<std::uint64_t, nbuckets> buckets{};
+		/* Count of calls recorded */
+		std::uint64_t count() const;
+		/* Upper bound in us of the bucket holding the q quantile (0 to 1), 0 if none */
+		std::uint64_t quantile_us(double q) const;
+	};
+	struct register_stats {
+		/* Getter calls, not reads served from the cache */
+		std::uint64_t gets = 0;
+		std::uint64_t sets = 0;
+		/* Notifications sent, not those suppressed as unchanged */
+		std::uint64_t notifies = 0;
+		/* Values held back from observers by their min_interval */
+		std::uint64_t rate_limited = 0;
+		histogram get_us;
+		histogram set_us;
+		/* The register's own observers, not pattern subscriptions or batches */
+		histogram observer_us;
+	};
+	/* Return false to stop.  Called with the lock held or in a read section. */
+	using visitor = std::function<bool(const std::string& key, const register_info& info)>;
+	/* Register of a static_table, fixed at compile time */
+	struct static_reg {
+		const char *key;
+		err (*get)(std::string& value);
+		err (*set)(const std::string& value);
+	};
+	template <std::size_t N>
+	class static_table;
+	/* e.g. static constexpr auto table = regstore::make_table(regs); */
+	template <std::size_t N>
+	static constexpr static_table<N> make_table(const static_reg (&regs)[N]);
 private:
-	struct observer_entry : subscription_info {
+	/* Two-phase read domain: readers only touch their own slot's counters */
+	class read_domain {
+		static constexpr std::size_t nslots = 32;
+		struct alignas(64) slot {
+			std::atomic<unsigned long> readers[2];
+		};
+		slot slots[nslots];
+		std::atomic<unsigned> phase{0};
+		static std::size_t this_slot();
+		void drain(unsigned p) const;
+	public:
+		read_domain();
+		unsigned enter();
+		void leave(unsigned token);
+		void synchronize();
+	};
+	/* Single thread running jobs at their deadlines, from a min-heap */
+	class scheduler {
+		using clock = std::chrono::steady_clock;
+		struct timer {
+			clock::time_point when;
+			std::function<void()> job;
+			bool operator < (const timer& t) const { return when > t.when; }
+		};
+		std::mutex mx;
+		std::condition_variable cv;
+		bool stopping = false;
+		std::vector<timer> timers;
+		std::thread thread;
+		void run();
+	public:
+		scheduler();
+		/* Pending jobs are dropped */
+		~scheduler();
+		/* Wait for the job in progress, if any, and run no more */
+		void stop();
+		void at(clock::time_point when, std::function<void()> job);
+	};
+	/* Histogram recorded by any thread, as histogram */
+	struct stats_histogram {
+		std::array<std::atomic<std::uint64_t>, histogram::nbuckets> buckets{};
+		void record(std::chrono::steady_clock::time_point start);
+		histogram load() const;
+		void clear();
+	};
+	/* Counters of a register, updated by readers in parallel */
+	struct stats_entry {
+		std::atomic<std::uint64_t> gets{0};
+		std::atomic<std::uint64_t> sets{0};
+		std::atomic<std::uint64_t> notifies{0};
+		std::atomic<std::uint64_t> rate_limited{0};
+		stats_histogram get_us;
+		stats_histogram set_us;
+		stats_histogram observer_us;
+		register_stats load() const;
+	};
+	/* The store's mutex, timing waits for it while stats are enabled */
+	class store_mutex {
+		std::mutex m;
+	public:
+		std::atomic<bool> timed{false};
+		stats_histogram waits;
+		void lock();
+		bool try_lock() { return m.try_lock(); }
+		void unlock() { m.unlock(); }
+	};
+	struct observer_entry {
 		observer func;
+		std::chrono::steady_clock::duration min_interval;
+		std::atomic<std::chrono::steady_clock::rep> next{0};
+		/* Trailing-edge state, guarded by mx */
+		std::mutex mx;
+		std::shared_ptr<const std::string> pending;
+		bool armed = false;
+		bool cancelled = false;
+	};
+	/* Remote name, observer */
+	using remote_map = std::unordered_map<std::string, std::shared_ptr<observer_entry>>;
+	/* Remote name, pattern observer */
+	using pattern_map = std::unordered_map<std::string, std::shared_ptr<const pattern_observer>>;
+	/* Pattern trie, one level per key segment */
+	struct pattern_node {
+		std::unordered_map<std::string, std::unique_ptr<pattern_node>> children;
+		std::unique_ptr<pattern_node> any;
+		/* Patterns ending at this node, and ending in "**" at this node */
+		pattern_map here;
+		pattern_map rest;
+		bool empty() const { return children.empty() && !any && here.empty() && rest.empty(); }
+	};
+	using pattern_matches = std::vector<std::pair<std::string, std::shared_ptr<const pattern_observer>>>;
+	/*
+	 * Last notified value: small values verbatim, others by size and hash.
+	 * The limit is MAX_VERBATIM of the C store, so both compare alike.
+	 */
+	struct fingerprint {
+		static constexpr std::size_t max_verbatim = 16;
+		bool valid = false;
+		std::size_t size = 0;
+		std::size_t hash = 0;
+		std::string verbatim;
+		/* Record value, returns false if it matches the previous one */
+		bool update(const std::string& value);
+	};
+	/* Typed side of a typed register, type-erased in reg_entry */
+	struct typed_base {
+		virtual ~typed_base() = default;
+		virtual bool observed() const = 0;
+		virtual bool observes(const std::string& remote) const = 0;
+		virtual void unobserve(const std::string& remote) const = 0;
+		virtual std::vector<std::string> remotes() const = 0;
+		/* Deliver a value set through the string interface to typed observers */
+		virtual void deliver(const regstore& rs, const std::string& value, const std::shared_ptr<stats_entry>& stats) const = 0;
+	};
+	template <typename T>
+	struct typed_reg : typed_base {
+		typed_getter<T> get;
+		typed_setter<T> set;
+		/* Remote name, observer, guarded by mx */
+		mutable std::unordered_map<std::string, std::shared_ptr<const typed_observer<T>>> observers;
+		bool observed() const override { return !observers.empty(); }
+		bool observes(const std::string& remote) const override { return observers.count(remote) != 0; }
+		void unobserve(const std::string& remote) const override { observers.erase(remote); }
+		std::vector<std::string> remotes() const override
+		{
+			std::vector<std::string> res;
+			for (const auto& rem : observers) {
+				res.push_back(rem.first);
+			}
+			return res;
+		}
+		void deliver(const regstore& rs, const std::string& value, const std::shared_ptr<stats_entry>& stats) const override
+			{ T v{}; if (regstore_codec<T>::parse(value, v)) { rs._deliver(*this, v, stats); } }
+	};
+	/* Polling of a register while observed, guarded by mx */
+	struct sampler_entry {
+		explicit sampler_entry(std::chrono::steady_clock::duration period) : period(period) { }
+		const std::chrono::steady_clock::duration period;
+		bool armed = false;
+		/* Last value sampled, to notify only changes */
+		bool sampled = false;
+		std::string last;
+	};
+	/* Getter result kept for max_age, guarded by its own mutex */
+	struct value_cache {
+		explicit value_cache(std::chrono::steady_clock::duration max_age) : max_age(max_age) { }
+		const std::chrono::steady_clock::duration max_age;
+		std::mutex mx;
+		/* Signalled when a fetch completes, for misses waiting on it */
+		std::condition_variable fetched;
+		bool fetching = false;
+		/* Thread calling the getter, whose own gets of the register bypass the cache */
+		std::thread::id fetcher;
+		/* Count of completed fetches */
+		unsigned long fetches = 0;
+		/* Bumped by each set, a fetch started before one is not kept */
+		unsigned long epoch = 0;
+		/* The last fetch completed with no set since it started, so waiters may use it */
+		bool current = false;
+		/* Last fetch, which is fresh until time + max_age if valid */
+		err result = err::ok;
+		std::string value;
+		std::chrono::steady_clock::time_point time;
+		bool valid = false;
+		std::uint64_t hits = 0;
+		std::uint64_t misses = 0;
+	};
+	/* Shared-memory segment registers are exported to, laid out as in regstore_mirror.h */
+	class export_segment {
+		regstore_mirror_header *header = nullptr;
+		std::size_t size = 0;
+		std::string name;
+		export_segment() = default;
+	public:
+		static constexpr std::size_t npos = static_cast<std::size_t>(-1);
+		/* Null if it cannot be created */
+		static std::unique_ptr<export_segment> create(const std::string& name, std::size_t capacity, std::size_t key_size, std::size_t value_size);
+		/* Readers' mappings stay valid, and see the segment is no longer written */
+		~export_segment();
+		/* Claim the next slot for key, npos if full or key is too long */
+		std::size_t add(const std::string& key);
+		/* Make a claimed slot visible, once its initial value is written */
+		void publish(std::size_t slot);
+		/* Seqlock write of the slot's value, or of its removal if null */
+		void write(std::size_t slot, const std::string *value);
+	};
+	struct batch_entry {
+		std::string remote;
+		batch_observer func;
+		std::chrono::steady_clock::duration interval;
+		/* Guarded by batches_mx */
+		std::vector<change> pending;
+		/* Key, position in pending */
+		std::unordered_map<std::string, std::size_t> index;
+		bool armed = false;
+	};
+	struct reg_entry {
+		std::string name;
+		getter get;
+		setter set;
+		/* Replaced (never modified) under the lock, loaded atomically */
+		std::shared_ptr<const remote_map> observers;
+		std::atomic<bool> removed{false};
+		/* Pattern subscriptions matching this key, guarded by patterns_mx */
+		std::shared_ptr<const pattern_matches> patterns;
+		unsigned long patterns_gen = 0;
+		/* Guarded by mx */
+		bool suppress = false;
+		fingerprint last;
+		/* Set for typed registers, get/set then convert to and from it */
+		std::unique_ptr<const typed_base> typed;
+		/* Written under the lock, read by _info without it */
+		std::atomic<std::uint64_t> version{0};
+		/* Neighbours in version order until removed, guarded by mx */
+		reg_entry *older = nullptr;
+		reg_entry *newer = nullptr;
+		/* Null if not caching, replaced under the lock and loaded atomically */
+		std::shared_ptr<value_cache> cache;
+		/* Null if not sampled, guarded by mx */
+		std::shared_ptr<sampler_entry> sampler;
+		/* Set for async registers, get/set then wait for them */
+		async_getter async_get;
+		async_setter async_set;
+		/* Slot in mirror if exported, guarded by mx */
+		std::size_t export_slot = export_segment::npos;
+		/* Null unless stats are enabled, replaced under the lock and loaded atomically */
+		std::shared_ptr<stats_entry> stats;
+		/* Set while stats is, so calls need not load it while stats are disabled */
+		std::atomic<bool> timed{false};
+	};
+	struct by_name {
+		using is_transparent = void;
+		using entry = std::shared_ptr<reg_entry>;
+		bool operator () (const entry& a, const entry& b) const { return a->name < b->name; }
+		bool operator () (const entry& a, const std::string& b) const { return a->name < b; }
+		bool operator () (const std::string& a, const entry& b) const { return a < b->name; }
+	};
+	/* Static table added to the store, with its registers' entries by index, in place of store entries */
+	struct mounted_table {
+		const void *table;
+		std::size_t (*find)(const void *table, const std::string& key);
+		/* One block, shared by copies of the table */
+		std::shared_ptr<std::vector<reg_entry>> entries;
+		/* Least and greatest key, so that lookups outside them skip the table */
+		std::string first;
+		std::string last;
+	};
+	struct table {
+		/* Register name, entry, for registers not in mounted tables */
+		std::unordered_map<std::string, std::shared_ptr<reg_entry>> store;
+		/*
+		 * Entries of store in key order: a prefix's registers are one
+		 * contiguous range, found in O(log n)
+		 */
+		std::set<std::shared_ptr<reg_entry>, by_name> order;
+		/* Mounted static tables, searched before store */
+		std::vector<mounted_table> mounted;
+	};
+public:
+	/* One change recorded in the journal */
+	struct journal_record {
+		std::uint64_t seq = 0;
+		std::chrono::system_clock::time_point time;
+		std::string key;
+		std::string value;
+		/* Key and value did not fit the journal's record size and were cut short */
+		bool truncated = false;
 	};
-	mutable std::mutex mx;
-	/* Register name, getter/setter */
-	std::unordered_map<std::string, std::pair<getter, setter>> store;
-	/* Register name, remote name, observer */
-	std::unordered_map<std::string, std::unordered_map<std::string, observer_entry>> observers;
-
-	register_list _list(const std::string& remote) const;
-	void _add(const std::string& key, const getter& get, const setter& set);
-	err _set(const std::string& key, const std::string& value);
-	err _get(const std::string& key, std::string& value) const;
-	void _observe(const std::string& key, const std::string& remote, const observer& obs, const std::chrono::steady_clock::duration& min_interval);
-	void _send_notification(const std::string& key, const std::string& value) const;
+private:
+	/*
+	 * Bounded ring of changes with one writer (under the lock) and any number
+	 * of lock-free readers.  Each slot is a seqlock over atomic words, so a
+	 * reader copying a record which is overwritten meanwhile sees it changed
+	 * and skips it, and the writer never waits for readers.
+	 */
+	class journal_ring {
+		struct slot {
+			/* 2 * pos + 1 while record pos is written, 2 * pos + 2 once written */
+			std::atomic<std::uint64_t> stamp{0};
+			std::atomic<std::uint64_t> seq{0};
+			std::atomic<std::chrono::system_clock::rep> time{0};
+			std::atomic<std::uint32_t> key_len{0};
+			std::atomic<std::uint32_t> value_len{0};
+			std::atomic<bool> truncated{false};
+		};
+		/* Words of key and value per slot */
+		const std::size_t words;
+		std::unique_ptr<slot[]> slots;
+		std::unique_ptr<std::atomic<std::uint64_t>[]> data;
+	public:
+		journal_ring(std::size_t capacity, std::size_t record_size);
+		void write(std::uint64_t seq, const std::string& key, const std::string& value);
+		/* False if the record at pos was overwritten */
+		bool read(std::uint64_t pos, journal_record& rec) const;
+		const std::size_t capacity;
+		/* Count of records written */
+		std::atomic<std::uint64_t> head{0};
+	};
+public:
+	/* Position in the journal, each reader uses its own */
+	class journal_cursor {
+		friend class regstore;
+		std::shared_ptr<const journal_ring> ring;
+		std::uint64_t pos = 0;
+		std::uint64_t skipped = 0;
+	public:
+		explicit operator bool () const { return ring != nullptr; }
+		/* Next record, false once caught up.  Takes no lock. */
+		bool next(journal_record& rec);
+		/* Records overwritten before this cursor could read them */
+		std::uint64_t lost() const { return skipped; }
+	};
+	class handle {
+		friend class regstore;
+		std::shared_ptr<reg_entry> entry;
+	public:
+		explicit operator bool () const { return entry != nullptr; }
+	};
+	/* Sets staged for commit, applied in order */
+	class transaction {
+		friend class regstore;
+		std::vector<std::pair<std::string, std::string>> writes;
+	public:
+		transaction& set(const std::string& key, const std::string& value)
+			{ writes.emplace_back(key, value); return *this; }
+		bool empty() const { return writes.empty(); }
+	};
+	template <typename T>
+	class typed {
+		friend class regstore;
+		std::shared_ptr<reg_entry> entry;
+		const typed_reg<T> *reg = nullptr;
+	public:
+		using value_type = T;
+		using observer = typed_observer<T>;
+		explicit operator bool () const { return entry != nullptr; }
+	};
+private:
+	/* Holds the lock (serialized) or a read-side section (concurrent_reads) */
+	class read_guard {
+		const regstore& rs;
+		std::unique_lock<store_mutex> lock;
+		unsigned token = 0;
+		const table *tab;
+	public:
+		explicit read_guard(const regstore& rs);
+		~read_guard();
+		const table& operator * () const { return *tab; }
+	};
+	/* Worker pool running jobs in FIFO order per strand, strands in parallel */
+	class dispatcher {
+		struct strand {
+			std::string name;
+			std::deque<std::function<void()>> jobs;
+			bool scheduled = false;
+		};
+		std::mutex mx;
+		std::condition_variable cv;
+		bool stopping = false;
+		std::deque<strand *> ready;
+		strand fan_out;
+		std::unordered_map<std::string, std::unique_ptr<strand>> remotes;
+		std::vector<std::thread> workers;
+		void _post(strand& s, std::function<void()> job);
+		void run();
+	public:
+		explicit dispatcher(std::size_t workers);
+		/* Runs all queued jobs before returning */
+		~dispatcher();
+		void post(std::function<void()> job);
+		void post(const std::string& remote, std::function<void()> job);
+	};
+	const concurrency mode;
+	mutable store_mutex mx;
+	mutable read_domain readers;
+	/* Published table, replaced by writers in concurrent_reads mode */
+	std::atomic<table *> current;
+	/* Copy being modified by the writer which holds the lock */
+	std::unique_ptr<table> staged;
+	std::unique_ptr<dispatcher> async;
+	/* Registers each remote observes (string or typed), guarded by mx */
+	std::unordered_map<std::string, std::set<std::shared_ptr<reg_entry>, by_name>> remote_regs;
+	mutable std::mutex patterns_mx;
+	pattern_node patterns;
+	/* Patterns each remote observes, guarded by patterns_mx */
+	std::unordered_map<std::string, std::set<std::string>> remote_patterns;
+	/* Batched remotes, guarded by batches_mx */
+	mutable std::mutex batches_mx;
+	std::unordered_map<std::string, std::shared_ptr<batch_entry>> batches;
+	std::atomic<bool> batching{false};
+	/* Sequence number of the last change, and registers ordered by their last, guarded by mx */
+	mutable std::uint64_t seq = 0;
+	mutable reg_entry *oldest = nullptr;
+	mutable reg_entry *newest = nullptr;
+	/* Set if journaling, guarded by mx */
+	std::shared_ptr<journal_ring> journal;
+	/* Set if exporting to shared memory, guarded by mx */
+	std::unique_ptr<export_segment> mirror;
+	/* Bumped when patterns change, to invalidate each register's matches */
+	unsigned long patterns_gen = 1;
+	mutable std::once_flag timers_once;
+	mutable std::unique_ptr<scheduler> timers;
+	/* Set once destruction begins, so jobs still running arm no more */
+	std::atomic<bool> stopping{false};
+	/* Registers with a sampler, guarded by mx */
+	std::set<std::shared_ptr<reg_entry>, by_name> sampled;
+	/* Set by enable_stats, guarded by mx */
+	bool stats_enabled = false;
+
+	const table& _table() const;
+	table& _writable();
+	void _publish();
+
+	static std::shared_ptr<reg_entry> _find(const table& t, const std::string& key);
+	static std::shared_ptr<reg_entry> _find_mounted(const table& t, const std::string& key);
+	static std::shared_ptr<const remote_map> _observers(const reg_entry& e);
+	static std::shared_ptr<stats_entry> _stats(const reg_entry& e);
+	using order_range = std::pair<std::set<std::shared_ptr<reg_entry>, by_name>::const_iterator, std::set<std::shared_ptr<reg_entry>, by_name>::const_iterator>;
+	static order_range _range(const table& t, const std::string& prefix);
+	static register_list _list(const table& t, const std::string& remote, const std::string& prefix);
+	static register_info _info(const reg_entry& e, const std::string& remote);
+	static bool _each(const table& t, const std::string& prefix, const std::string& cursor, const std::string& remote, const visitor& v);
+	std::shared_ptr<reg_entry> _add(const std::string& key, const getter& get, const setter& set, std::unique_ptr<const typed_base> typed = nullptr);
+	void _remove(const std::string& key);
+	std::size_t _remove_prefix(const std::string& prefix);
+	err _set(const std::shared_ptr<reg_entry>& e, const std::string& value);
+	err _apply(reg_entry& e, const std::string& value);
+	static err _get(const reg_entry& e, std::string& value);
+	static err _call_get(const reg_entry& e, std::string& value);
+	static err _cached_get(const reg_entry& e, value_cache& c, std::string& value);
+	static void _invalidate(const reg_entry& e);
+	bool _observe(const std::string& key, const std::string& remote, const observer& obs, const std::chrono::steady_clock::duration& min_interval);
+	/* Null once destruction begins */
+	scheduler *_scheduler() const;
+	static void _cancel(observer_entry& ob);
+	bool _admit(const std::string& remote, const std::shared_ptr<observer_entry>& ob, const std::string& value, std::chrono::steady_clock::time_point now, const std::shared_ptr<stats_entry>& stats) const;
+	void _trailing(const std::string& remote, const std::shared_ptr<observer_entry>& ob, const std::shared_ptr<stats_entry>& stats) const;
+	/* Call an observer, timing it if stats is set */
+	template <typename F>
+	static void _timed(const std::shared_ptr<stats_entry>& stats, const F& call);
+	void _send_notification(const std::shared_ptr<reg_entry>& e, const std::string& value) const;
+	void _touch(const std::shared_ptr<reg_entry>& e) const;
+	void _unlink(reg_entry& e) const;
+	reg_entry *_changed_since(std::uint64_t since) const;
+	bool _queue(const std::string& remote, const std::string& key, const std::string& value) const;
+	std::vector<change> _take(batch_entry& b) const;
+	void _flush(const std::shared_ptr<batch_entry>& b) const;
+	void _flush_all() const;
+	void _batch(const std::string& remote, const batch_observer& obs, const std::chrono::steady_clock::duration& interval);
+	template <typename T>
+	void _send_notification(const std::shared_ptr<reg_entry>& e, const typed_reg<T>& reg, const T& value) const;
+	bool _string_observed(reg_entry& e) const;
+	void _arm_sampler(const std::shared_ptr<reg_entry>& e) const;
+	void _sample(const std::shared_ptr<reg_entry>& e, const std::shared_ptr<sampler_entry>& s) const;
+	void _deliver(const std::shared_ptr<reg_entry>& e, const std::string& value) const;
+	template <typename T>
+	void _deliver(const typed_reg<T>& reg, const T& value, const std::shared_ptr<stats_entry>& stats) const;
+	void _fan_out(dispatcher& d, const std::shared_ptr<reg_entry>& e, const std::shared_ptr<const std::string>& value) const;
+	static bool _segment(const std::string& s, std::size_t pos, std::size_t& end);
+	static void _match(const pattern_node& node, const std::string& key, std::size_t pos, bool done, pattern_matches& out);
+	std::shared_ptr<const pattern_matches> _patterns(reg_entry& e) const;
+	static bool _unobserve_pattern(pattern_node& node, const std::string& pattern, std::size_t pos, const std::string& remote);
 	void _unobserve(const std::string& key, const std::string& remote);
-	bool _query_observer(const std::string& key, const std::string& remote, subscription_info& info) const;
-	err _notify(const std::string& key) const;
+	void _unobserve(const std::shared_ptr<reg_entry>& e, const std::string& remote);
+	void _unindex(const std::shared_ptr<reg_entry>& e, const std::string& remote);
+	static bool _query_observer(const table& t, const std::string& key, const std::string& remote, subscription_info& info);
+	err _notify(const std::shared_ptr<reg_entry>& e) const;
+	static bool _snapshot_write(std::FILE *f, const reg_entry& e);
+	err _notify(const table& t, const std::string& key) const;
 	template <typename... T>
-	void _notify(const std::string& key, const T&... keys) const
-		{ _notify(key); _notify(std::forward<const T&>(keys)...); }
+	void _notify(const table& t, const std::string& key, const T&... keys) const
+		{ _notify(t, key); _notify(t, std::forward<const T&>(keys)...); }
+	void _swap_dispatcher(std::unique_ptr<dispatcher>& d);
+	static constexpr std::size_t _pow2(std::size_t n)
+		{ std::size_t p = 1; while (p < n) { p <<= 1; } return p; }
 
 public:
+	explicit regstore(concurrency mode = concurrency::serialized);
+	~regstore();
+
+	/* Deliver notifications asynchronously from a pool of worker threads */
+	void start_dispatcher(std::size_t workers);
+	/* Deliver notifications inline again, after flushing queued ones */
+	void stop_dispatcher();
+
+	register_list list(const std::string& remote = "", const std::string& prefix = "") const
+		{ read_guard t(*this); return _list(*t, remote, prefix); }
 
-	register_list list(const std::string& remote = "")
-		{ std::lock_guard<std::mutex> lock(mx); return _list(remote); }
+	/*
+	 * Visit registers in key order without copying them.  Only keys starting
+	 * with prefix and sorting after cursor (if not empty) are visited, so a
+	 * large store can be paged through by passing the last key seen as the
+	 * next cursor.  Returns false if the visitor stopped the walk.
+	 */
+	bool each(const visitor& v, const std::string& prefix = "", const std::string& cursor = "", const std::string& remote = "") const
+		{ read_guard t(*this); return _each(*t, prefix, cursor, remote, v); }
+
+	/* Sequence number of the store's last change */
+	std::uint64_t sequence() const
+		{ std::lock_guard<store_mutex> lock(mx); return seq; }
+
+	/*
+	 * Readable registers added, set or notified after sequence number since,
+	 * least recently changed first, with their values.  Costs time in
+	 * proportion to the registers changed, not the size of the store, so a
+	 * reconnecting remote can resync by passing the number stored in next
+	 * last time.  Removed registers are not reported.
+	 */
+	std::vector<change> changes_since(std::uint64_t since, std::uint64_t *next = nullptr) const;
 
 	void add(const std::string& key, getter get, setter set)
-		{ std::lock_guard<std::mutex> lock(mx); _add(key, get, set); }
+		{ std::lock_guard<store_mutex> lock(mx); _add(key, get, set); _publish(); }
+
+	/* One register for add_many */
+	struct definition {
+		std::string key;
+		getter get;
+		setter set;
+	};
+
+	/*
+	 * Add several registers under one lock, reserving the index for them
+	 * once.  Keys in sorted order after any already present are appended to
+	 * the key order in constant time.  Throws, adding none of them, if any
+	 * key is already present or repeated, as add would for the repeat.
+	 */
+	void add_many(const std::vector<definition>& regs);
+
+	/*
+	 * Add every register of a static table, which must outlive the store.
+	 * Lookups of its keys then cost its perfect hash rather than the store's
+	 * index.  Throws, adding none of them, if any key is already present.
+	 */
+	template <std::size_t N>
+	void mount(const static_table<N>& t);
+
+	/*
+	 * Add a register whose getter/setter complete asynchronously.  Only
+	 * get_async/set_async avoid waiting for them: get, set, notify and the like
+	 * still work, but wait with the store locked.  The store must outlive any
+	 * operation in progress.
+	 */
+	void add_async(const std::string& key, async_getter get, async_setter set);
+
+	/*
+	 * Get/set any register, calling done on completion without the lock held
+	 * (before returning for other than async registers).  A set notifies
+	 * observers once it completes successfully.  Sets of one register which
+	 * are in progress at the same time may complete in any order.
+	 */
+	void get_async(const std::string& key, get_callback done) const;
+	void set_async(const std::string& key, const std::string& value, set_callback done);
+	std::future<get_result> get_async(const std::string& key) const;
+	std::future<err> set_async(const std::string& key, const std::string& value);
+
+	void remove(const std::string& key)
+		{ std::lock_guard<store_mutex> lock(mx); _remove(key); _publish(); }
+
+	/* Remove / notify all registers whose keys start with prefix, returns count */
+	std::size_t remove_prefix(const std::string& prefix)
+		{ std::lock_guard<store_mutex> lock(mx); const auto n = _remove_prefix(prefix); _publish(); return n; }
+
+	std::size_t notify_prefix(const std::string& prefix) const;
+
+	err set(const std::string& key, const std::string& value);
+
+	err get(const std::string& key, std::string& value) const;
+
+	/* Add a register holding a T, also accessible as a string through regstore_codec<T> */
+	template <typename T>
+	typed<T> add_typed(const std::string& key, typed_getter<T> get, typed_setter<T> set);
+
+	/* Empty handle if not found or not a typed register of type T */
+	template <typename T>
+	typed<T> resolve_typed(const std::string& key) const;
+
+	template <typename T>
+	err get(const typed<T>& h, T& value) const;
+
+	template <typename T>
+	err set(const typed<T>& h, const T& value);
+
+	template <typename T>
+	err notify(const typed<T>& h) const;
+
+	/* Returns false if the register no longer exists */
+	template <typename T>
+	bool observe(const typed<T>& h, const std::string& remote, typename typed<T>::observer obs);
+
+	template <typename T>
+	void unobserve(const typed<T>& h, const std::string& remote);
+
+	/* Drop notifications which repeat the register's last value, returns false if key not found */
+	bool suppress_unchanged(const std::string& key, bool enable = true);
 
-	err set(const std::string& key, const std::string& value)
-		{ std::lock_guard<std::mutex> lock(mx); return _set(key, value); }
+	/*
+	 * Keep the register's value for max_age after reading it, and serve get,
+	 * notify and the like from that copy meanwhile.  Misses while a read is
+	 * in progress wait for its result rather than calling the getter again,
+	 * unless a set overtakes the read, and any set discards the copy.  A get
+	 * of the register from within its own getter is not cached.  Typed gets
+	 * are not cached.  A max_age of zero stops caching.  Returns false if key
+	 * not found.
+	 */
+	bool cache(const std::string& key, std::chrono::steady_clock::duration max_age);
 
-	err get(const std::string& key, std::string& value) const
-		{ std::lock_guard<std::mutex> lock(mx); return _get(key, value); }
+	/*
+	 * Poll the register from the store's timer thread while anyone observes
+	 * it, notifying when its value changes: for read-only registers which
+	 * nothing else notifies.  It is polled as often as its most frequent
+	 * subscriber's min_interval allows, or every period for subscribers
+	 * without one (and pattern and typed subscribers).  A period of zero
+	 * stops sampling.  Returns false if key not found.
+	 */
+	bool sample(const std::string& key, std::chrono::steady_clock::duration period);
 
+	/*
+	 * Get/set several registers under one lock acquisition, one result per
+	 * key.  set_many sends notifications once every value has been set.
+	 */
+	std::vector<err> get_many(const std::vector<std::string>& keys, std::vector<std::string>& values) const;
+
+	std::vector<err> set_many(const std::vector<std::pair<std::string, std::string>>& values);
+
+	/*
+	 * Apply a transaction atomically.  On failure nothing remains applied and
+	 * failed (if given) is set to the key which caused it.
+	 */
+	err commit(const transaction& t, std::string *failed = nullptr);
+
+	/* Resolve key once for the handle overloads, empty handle if not found */
+	handle resolve(const std::string& key) const;
+
+	err set(const handle& h, const std::string& value);
+
+	err get(const handle& h, std::string& value) const;
+
+	/* Returns false if the register does not exist */
 	template <typename Rep, typename Period>
-	void observe(const std::string& key, const std::string& remote, const observer& obs, const std::chrono::duration<Rep, Period>& min_interval)
-		{ std::lock_guard<std::mutex> lock(mx); _observe(key, remote, obs, std::chrono::duration_cast<std::chrono::steady_clock::duration>(min_interval)); }
+	bool observe(const std::string& key, const std::string& remote, const observer& obs, const std::chrono::duration<Rep, Period>& min_interval)
+		{ std::lock_guard<store_mutex> lock(mx); return _observe(key, remote, obs, std::chrono::duration_cast<std::chrono::steady_clock::duration>(min_interval)); }
 
 	void unobserve(const std::string& key, const std::string& remote)
-		{ std::lock_guard<std::mutex> lock(mx); _unobserve(key, remote); }
+		{ std::lock_guard<store_mutex> lock(mx); _unobserve(key, remote); }
+
+	/* Subscribe remote to every register matching pattern, replacing any previous observer for the pattern */
+	void observe_pattern(const std::string& pattern, const std::string& remote, const pattern_observer& obs);
+
+	void unobserve_pattern(const std::string& pattern, const std::string& remote);
 
 	bool query_observer(const std::string& key, const std::string& remote, subscription_info& info) const
-		{ return _query_observer(key, remote, info); }
+		{ read_guard t(*this); return _query_observer(*t, key, remote, info); }
+
+	/*
+	 * Drop every register, typed and pattern subscription of remote, e.g. on
+	 * disconnect, returns how many there were.  Its batch is discarded with
+	 * any changes still queued, unflushed.  Like list_subscriptions, it costs
+	 * time proportional to the remote's subscriptions, not the store.
+	 */
+	std::size_t unobserve_all(const std::string& remote);
+
+	/*
+	 * Registers remote observes, string or typed.  As in the C store, those
+	 * it only matches through pattern subscriptions are not listed.
+	 */
+	register_list list_subscriptions(const std::string& remote) const;
+
+	/*
+	 * Deliver remote's notifications to obs in batches.  Queued changes are
+	 * flushed by flush(), at the end of set_many, and after interval (if not
+	 * zero) from the first change of each batch.
+	 */
+	template <typename Rep, typename Period>
+	void batch(const std::string& remote, const batch_observer& obs, const std::chrono::duration<Rep, Period>& interval)
+		{ std::lock_guard<store_mutex> lock(mx); _batch(remote, obs, std::chrono::duration_cast<std::chrono::steady_clock::duration>(interval)); }
+
+	/* Flush remote's batch and deliver its notifications individually again */
+	void unbatch(const std::string& remote);
+
+	void flush(const std::string& remote) const;
+
+	void flush() const
+		{ std::lock_guard<store_mutex> lock(mx); _flush_all(); }
+
+	/*
+	 * Record each set and notify (unless suppressed as unchanged) in a journal
+	 * of the last capacity changes, each keeping up to record_size bytes of
+	 * key and value.  Replaces any previous journal, whose cursors carry on
+	 * reading it; a capacity of 0 stops journaling.
+	 */
+	void enable_journal(std::size_t capacity, std::size_t record_size = 256);
+
+	/* Cursor at the oldest record kept, to replay history, or at the next change, to tail it */
+	journal_cursor journal_replay() const;
+	journal_cursor journal_tail() const;
+
+	/*
+	 * Export registers to a shared-memory segment (a shm_open name, e.g.
+	 * "/regs") for other processes to read through regstore_mirror.h without
+	 * locks or system calls.  The segment has capacity slots, each holding up
+	 * to key_size bytes of key and value_size of value.  An exported
+	 * register's slot is rewritten on each set and notify (unless suppressed
+	 * as unchanged).  Replaces any previous segment; an empty name stops
+	 * exporting.  Returns false if the segment cannot be created.
+	 */
+	bool export_open(const std::string& name, std::size_t capacity, std::size_t key_size = 64, std::size_t value_size = 64);
+
+	/*
+	 * Add a register to the segment, false if not found, already exported,
+	 * its key is too long or the segment is full
+	 */
+	bool export_register(const std::string& key);
+
+	/*
+	 * Save the values of readable and writeable registers to a snapshot file.
+	 * A since of 0 writes every such register to a new file, replacing path
+	 * once complete; otherwise only those added, set or notified after
+	 * sequence number since are appended to it.  Returns the sequence number
+	 * to pass to the next save, or 0 on failure, which makes the next save
+	 * start a new file.  Files are those of the C store, so either restores.
+	 */
+	std::uint64_t snapshot_save(const std::string& path, std::uint64_t since = 0) const;
+
+	/*
+	 * Set registers to their last values in a snapshot file, as one set_many.
+	 * Keys no longer present or not writeable are skipped; restored (if
+	 * given) is set to the count set.  Returns false if the file cannot be
+	 * read or is not a snapshot.
+	 */
+	bool snapshot_restore(const std::string& path, std::size_t *restored = nullptr);
+
+	/*
+	 * Count and time each register's getter, setter and observer calls, and
+	 * waits for the store's lock (which readers only take in serialized
+	 * mode).  While enabled this costs two clock reads per call; disabling it
+	 * discards the stats.
+	 */
+	void enable_stats(bool enable = true);
+
+	/* False if key not found or stats are not enabled */
+	bool stats(const std::string& key, register_stats& out) const;
+
+	/* Waits for the store's lock, false if stats are not enabled */
+	bool lock_stats(histogram& out) const;
+
+	/*
+	 * Publish key's stats as read-only registers "_stats.<key>.<stat>": gets,
+	 * sets, notifies, rate_limited, and get_, set_ and observer_ p50_us and
+	 * p99_us.  An empty key publishes the lock waits as
+	 * "_stats.lock_wait_p50_us" and "_stats.lock_wait_p99_us".  They are read
+	 * like any other register, so remotes may subscribe to them and have them
+	 * sampled, and are not readable while stats are disabled or once key is
+	 * removed.  Returns false if key not found or any of them already exists.
+	 */
+	bool publish_stats(const std::string& key);
 
 	err notify(const std::string& key) const
-		{ std::lock_guard<std::mutex> lock(mx); return _notify(key); }
+		{ std::lock_guard<store_mutex> lock(mx); return _notify(_table(), key); }
+
+	err notify(const handle& h) const;
 
 	template <typename... T>
-	void notify(const T&... keys)
-		{ std::lock_guard<std::mutex> lock(mx); _notify(std::forward<const T&>(keys)...); }
+	void notify(const T&... keys) const
+		{ std::lock_guard<store_mutex> lock(mx); _notify(_table(), std::forward<const T&>(keys)...); }
 
 };
 
+/*
+ * Registers fixed at compile time, found by a two-level perfect hash which
+ * the constructor builds: each key's bucket holds a seed for which every key
+ * in the bucket hashes to a distinct slot.  A lookup is then one pass over
+ * the key to hash it and one to compare it, with no allocation.  Declare
+ * tables constexpr, so building them costs nothing at startup and an empty,
+ * malformed or repeated key (or index() of a missing one) fails to compile.
+ */
+template <std::size_t N>
+class regstore::static_table {
+	static_assert(N > 0, "Static register table is empty");
+	friend class regstore;
+	static constexpr std::size_t nbuckets = _pow2(N);
+	static constexpr std::size_t nslots = _pow2(N * 2);
+	static_reg regs[N];
+	std::size_t lens[N];
+	std::uint64_t seeds[nbuckets];
+	/* Index in regs, N if empty */
+	std::size_t slots[nslots];
+	static constexpr std::uint64_t hash(const char *s, std::size_t len);
+	static constexpr std::uint64_t mix(std::uint64_t h);
+	static constexpr std::size_t slot(std::uint64_t h, std::uint64_t seed)
+		{ return mix(h ^ (seed * 0x9e3779b97f4a7c15)) & (nslots - 1); }
+	static constexpr bool equal(const char *a, std::size_t al, const char *b, std::size_t bl);
+	static constexpr std::size_t validate(const char *key);
+public:
+	constexpr explicit static_table(const static_reg (&regs)[N]);
+	static constexpr std::size_t size() { return N; }
+	constexpr const char *key(std::size_t i) const { return regs[i].key; }
+	/* Index of key, N if not found */
+	constexpr std::size_t find(const char *key, std::size_t len) const;
+	std::size_t find(const std::string& key) const { return find(key.data(), key.size()); }
+	/* Index of key, which must be present */
+	constexpr std::size_t index(const char *key) const;
+};
+
+/* FNV-1a, mixed so that low bits depend on every byte */
+template <std::size_t N>
+constexpr std::uint64_t regstore::static_table<N>::hash(const char *s, std::size_t len)
+{
+	std::uint64_t h = 0xcbf29ce484222325;
+	for (std::size_t i = 0; i < len; i++) {
+		h ^= static_cast<unsigned char>(s[i]);
+		h *= 0x100000001b3;
+	}
+	return mix(h);
+}
+
+template <std::size_t N>
+constexpr std::uint64_t regstore::static_table<N>::mix(std::uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccd;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53;
+	h ^= h >> 33;
+	return h;
+}
+
+template <std::size_t N>
+constexpr bool regstore::static_table<N>::equal(const char *a, std::size_t al, const char *b, std::size_t bl)
+{
+	if (al != bl) {
+		return false;
+	}
+	for (std::size_t i = 0; i < al; i++) {
+		if (a[i] != b[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Keys must be non-empty dotted names without wildcards, returns length */
+template <std::size_t N>
+constexpr std::size_t regstore::static_table<N>::validate(const char *key)
+{
+	std::size_t len = 0;
+	bool segment = false;
+	for (; key[len]; len++) {
+		if (key[len] == '*') {
+			throw std::logic_error("Static register key contains a wildcard");
+		}
+		if (key[len] == '.') {
+			if (!segment) {
+				throw std::logic_error("Static register key has an empty segment");
+			}
+			segment = false;
+		} else {
+			segment = true;
+		}
+	}
+	if (!segment) {
+		throw std::logic_error("Static register key is empty or ends in a dot");
+	}
+	return len;
+}
+
+template <std::size_t N>
+constexpr regstore::static_table<N>::static_table(const static_reg (&r)[N]) :
+	regs{}, lens{}, seeds{}, slots{}
+{
+	/* Keys by bucket (counting sort), then buckets placed largest first */
+	std::uint64_t hashes[N] = {};
+	std::size_t bucket[N] = {};
+	std::size_t start[nbuckets + 1] = {};
+	for (std::size_t i = 0; i < N; i++) {
+		regs[i] = r[i];
+		lens[i] = validate(r[i].key);
+		hashes[i] = hash(r[i].key, lens[i]);
+		bucket[i] = hashes[i] & (nbuckets - 1);
+		start[bucket[i] + 1]++;
+	}
+	std::size_t largest = 0;
+	for (std::size_t b = 0; b < nbuckets; b++) {
+		largest = std::max(largest, start[b + 1]);
+		start[b + 1] += start[b];
+	}
+	std::size_t order[N] = {};
+	std::size_t fill[nbuckets] = {};
+	for (std::size_t i = 0; i < N; i++) {
+		order[start[bucket[i]] + fill[bucket[i]]++] = i;
+	}
+	for (std::size_t i = 0; i < nslots; i++) {
+		slots[i] = N;
+	}
+	for (std::size_t size = largest; size > 0; size--) {
+		for (std::size_t b = 0; b < nbuckets; b++) {
+			const std::size_t *keys = &order[start[b]];
+			if (start[b + 1] - start[b] != size) {
+				continue;
+			}
+			/* Keys which share a bucket could also be the same key */
+			for (std::size_t i = 0; i < size; i++) {
+				for (std::size_t j = 0; j < i; j++) {
+					if (equal(regs[keys[i]].key, lens[keys[i]], regs[keys[j]].key, lens[keys[j]])) {
+						throw std::logic_error("Static register key appears twice");
+					}
+				}
+			}
+			std::size_t placed[N] = {};
+			for (std::uint64_t seed = 1; ; seed++) {
+				if (seed > nslots * 64) {
+					throw std::logic_error("No perfect hash found for static register table");
+				}
+				std::size_t i = 0;
+				for (; i < size; i++) {
+					placed[i] = slot(hashes[keys[i]], seed);
+					bool taken = slots[placed[i]] != N;
+					for (std::size_t j = 0; j < i; j++) {
+						taken = taken || placed[j] == placed[i];
+					}
+					if (taken) {
+						break;
+					}
+				}
+				if (i == size) {
+					seeds[b] = seed;
+					for (i = 0; i < size; i++) {
+						slots[placed[i]] = keys[i];
+					}
+					break;
+				}
+			}
+		}
+	}
+}
+
+template <std::size_t N>
+constexpr std::size_t regstore::static_table<N>::find(const char *key, std::size_t len) const
+{
+	const std::uint64_t h = hash(key, len);
+	const std::size_t i = slots[slot(h, seeds[h & (nbuckets - 1)])];
+	return i != N && equal(regs[i].key, lens[i], key, len) ? i : N;
+}
+
+template <std::size_t N>
+constexpr std::size_t regstore::static_table<N>::index(const char *key) const
+{
+	std::size_t len = 0;
+	while (key[len]) {
+		len++;
+	}
+	const std::size_t i = find(key, len);
+	if (i == N) {
+		throw std::logic_error("Key is not in static register table");
+	}
+	return i;
+}
+
+template <std::size_t N>
+constexpr regstore::static_table<N> regstore::make_table(const static_reg (&regs)[N])
+{
+	return static_table<N>(regs);
+}
+
+template <std::size_t N>
+void regstore::mount(const static_table<N>& t)
+{
+	mounted_table m;
+	m.table = &t;
+	m.find = [] (const void *table, const std::string& key) { return static_cast<const static_table<N> *>(table)->find(key); };
+	m.entries = std::make_shared<std::vector<reg_entry>>(N);
+	/* Shared, as the entries are not observed yet */
+	const auto unobserved = std::make_shared<const remote_map>();
+	std::lock_guard<store_mutex> lock(mx);
+	for (const auto& r : t.regs) {
+		if (_find(_table(), r.key)) {
+			throw std::logic_error(std::string("Attempted to add key \"") + r.key + "\" to register store twice");
+		}
+	}
+	auto& tab = _writable();
+	for (std::size_t i = 0; i < N; i++) {
+		const auto& r = t.regs[i];
+		const std::shared_ptr<reg_entry> e(m.entries, &(*m.entries)[i]);
+		e->name = r.key;
+		e->get = r.get;
+		e->set = r.set;
+		e->observers = unobserved;
+		if (stats_enabled) {
+			e->stats = std::make_shared<stats_entry>();
+			e->timed = true;
+		}
+		_touch(e);
+		tab.order.insert(e);
+		if (m.first.empty() || m.first > e->name) {
+			m.first = e->name;
+		}
+		if (m.last < e->name) {
+			m.last = e->name;
+		}
+	}
+	tab.mounted.push_back(std::move(m));
+	_publish();
+}
+
+template <typename T>
+regstore::typed<T> regstore::add_typed(const std::string& key, typed_getter<T> get, typed_setter<T> set)
+{
+	std::unique_ptr<typed_reg<T>> reg(new typed_reg<T>());
+	reg->get = std::move(get);
+	reg->set = std::move(set);
+	const typed_reg<T> *r = reg.get();
+	getter sget = nullptr;
+	if (r->get) {
+		sget = [r] (std::string& value) {
+			T v{};
+			const auto res = r->get(v);
+			if (res == err::ok) {
+				regstore_codec<T>::format(v, value);
+			}
+			return res;
+		};
+	}
+	setter sset = nullptr;
+	if (r->set) {
+		sset = [r] (const std::string& value) {
+			T v{};
+			if (!regstore_codec<T>::parse(value, v)) {
+				return err::invalid_value;
+			}
+			return r->set(v);
+		};
+	}
+	typed<T> h;
+	std::lock_guard<store_mutex> lock(mx);
+	h.entry = _add(key, sget, sset, std::move(reg));
+	h.reg = r;
+	_publish();
+	return h;
+}
+
+template <typename T>
+regstore::typed<T> regstore::resolve_typed(const std::string& key) const
+{
+	read_guard t(*this);
+	typed<T> h;
+	const auto e = _find(*t, key);
+	const auto reg = e ? dynamic_cast<const typed_reg<T> *>(e->typed.get()) : nullptr;
+	if (reg) {
+		h.entry = e;
+		h.reg = reg;
+	}
+	return h;
+}
+
+template <typename T>
+regstore::err regstore::get(const typed<T>& h, T& value) const
+{
+	read_guard t(*this);
+	if (!h.entry || h.entry->removed) {
+		return err::invalid_key;
+	}
+	if (h.reg->get == nullptr) {
+		return err::not_readable;
+	}
+	const auto stats = _stats(*h.entry);
+	const auto start = stats ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+	err res;
+	try {
+		res = h.reg->get(value);
+	} catch (const std::invalid_argument&) {
+		res = err::invalid_value;
+	}
+	if (stats) {
+		stats->gets++;
+		stats->get_us.record(start);
+	}
+	return res;
+}
+
+template <typename T>
+regstore::err regstore::set(const typed<T>& h, const T& value)
+{
+	std::lock_guard<store_mutex> lock(mx);
+	if (!h.entry || h.entry->removed) {
+		return err::invalid_key;
+	}
+	if (h.reg->set == nullptr) {
+		return err::not_writeable;
+	}
+	const auto stats = _stats(*h.entry);
+	const auto start = stats ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+	err res;
+	try {
+		res = h.reg->set(value);
+	} catch (const std::invalid_argument&) {
+		res = err::invalid_value;
+	}
+	if (stats) {
+		stats->sets++;
+		stats->set_us.record(start);
+	}
+	_invalidate(*h.entry);
+	if (res == err::ok) {
+		_send_notification(h.entry, *h.reg, value);
+	}
+	return res == err::no_change ? err::ok : res;
+}
+
+template <typename T>
+regstore::err regstore::notify(const typed<T>& h) const
+{
+	T value{};
+	const auto res = get(h, value);
+	if (res != err::ok) {
+		return res;
+	}
+	std::lock_guard<store_mutex> lock(mx);
+	if (h.entry->removed) {
+		return err::invalid_key;
+	}
+	_send_notification(h.entry, *h.reg, value);
+	return err::ok;
+}
+
+template <typename T>
+bool regstore::observe(const typed<T>& h, const std::string& remote, typename typed<T>::observer obs)
+{
+	std::lock_guard<store_mutex> lock(mx);
+	if (!h.entry || h.entry->removed) {
+		return false;
+	}
+	auto& observers = h.reg->observers;
+	if (obs == nullptr) {
+		observers.erase(remote);
+		_unindex(h.entry, remote);
+	} else {
+		observers[remote] = std::make_shared<const typed_observer<T>>(std::move(obs));
+		remote_regs[remote].insert(h.entry);
+		_arm_sampler(h.entry);
+	}
+	return true;
+}
+
+template <typename T>
+void regstore::unobserve(const typed<T>& h, const std::string& remote)
+{
+	std::lock_guard<store_mutex> lock(mx);
+	if (h.entry) {
+		h.reg->observers.erase(remote);
+		_unindex(h.entry, remote);
+	}
+}
+
+/* Text is only formatted if something other than typed observers needs it */
+template <typename T>
+void regstore::_send_notification(const std::shared_ptr<reg_entry>& e, const typed_reg<T>& reg, const T& value) const
+{
+	const bool deliver = e->suppress || _string_observed(*e);
+	const bool exported = e->export_slot != export_segment::npos;
+	std::string text;
+	if (deliver || journal || exported) {
+		regstore_codec<T>::format(value, text);
+		if (e->suppress && !e->last.update(text)) {
+			return;
+		}
+	}
+	const auto stats = _stats(*e);
+	if (stats) {
+		stats->notifies++;
+	}
+	_touch(e);
+	if (journal) {
+		journal->write(e->version, e->name, text);
+	}
+	if (exported) {
+		mirror->write(e->export_slot, &text);
+	}
+	if (deliver) {
+		_deliver(e, text);
+	}
+	_deliver(reg, value, stats);
+}
+
+template <typename T>
+void regstore::_deliver(const typed_reg<T>& reg, const T& value, const std::shared_ptr<stats_entry>& stats) const
+{
+	for (const auto& rem : reg.observers) {
+		if (async) {
+			auto func = rem.second;
+			async->post(rem.first, [func, value, stats] { _timed(stats, [&] { (*func)(value); }); });
+		} else {
+			_timed(stats, [&] { (*rem.second)(value); });
+		}
+	}
+}
+
+template <typename F>
+void regstore::_timed(const std::shared_ptr<stats_entry>& stats, const F& call)
+{
+	if (!stats) {
+		call();
+		return;
+	}
+	const auto start = std::chrono::steady_clock::now();
+	call();
+	stats->observer_us.record(start);
+}
+
 }
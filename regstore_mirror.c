@@ -0,0 +1,114 @@
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "regstore_mirror.h"
+
+/* Copies overtaken by a write are retried this many times */
+#define READ_ATTEMPTS 16
+
+bool regstore_mirror_open(struct regstore_mirror *mirror, const char *name)
+{
+	mirror->header = NULL;
+	mirror->size = 0;
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat st;
+	void *p = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(struct regstore_mirror_header)) {
+		p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if (p == MAP_FAILED) {
+		return false;
+	}
+	/* The writer sizes the segment before setting magic */
+	const struct regstore_mirror_header *header = p;
+	if (atomic_load_explicit(&header->magic, memory_order_acquire) != REGSTORE_MIRROR_MAGIC || sizeof(*header) + (size_t) header->capacity * header->slot_size > (size_t) st.st_size) {
+		munmap(p, st.st_size);
+		return false;
+	}
+	mirror->header = header;
+	mirror->size = st.st_size;
+	return true;
+}
+
+void regstore_mirror_close(struct regstore_mirror *mirror)
+{
+	if (mirror->header) {
+		munmap((void *) mirror->header, mirror->size);
+	}
+	mirror->header = NULL;
+	mirror->size = 0;
+}
+
+bool regstore_mirror_valid(const struct regstore_mirror *mirror)
+{
+	return mirror->header && atomic_load_explicit(&mirror->header->magic, memory_order_acquire) == REGSTORE_MIRROR_MAGIC;
+}
+
+/* Slots whose registers were removed keep their keys, so the live one is last */
+ptrdiff_t regstore_mirror_find(const struct regstore_mirror *mirror, const char *key, size_t len)
+{
+	const struct regstore_mirror_header *header = mirror->header;
+	size_t count = atomic_load_explicit(&header->count, memory_order_acquire);
+	for (size_t i = count; i-- > 0; ) {
+		struct regstore_mirror_slot *slot = regstore_mirror_slot_at(header, i);
+		if (slot->key_len == len && memcmp(regstore_mirror_key(slot), key, len) == 0) {
+			return atomic_load_explicit(&slot->value_len, memory_order_relaxed) == REGSTORE_MIRROR_REMOVED ? -1 : (ptrdiff_t) i;
+		}
+	}
+	return -1;
+}
+
+uint64_t regstore_mirror_version(const struct regstore_mirror *mirror, size_t slot)
+{
+	return atomic_load_explicit(&regstore_mirror_slot_at(mirror->header, slot)->seq, memory_order_acquire) / 2;
+}
+
+bool regstore_mirror_read(const struct regstore_mirror *mirror, size_t slot, char *buf, size_t size, struct regstore_mirror_value *value)
+{
+	const struct regstore_mirror_header *header = mirror->header;
+	if (slot >= atomic_load_explicit(&header->count, memory_order_acquire)) {
+		return false;
+	}
+	struct regstore_mirror_slot *s = regstore_mirror_slot_at(header, slot);
+	_Atomic uint64_t *words = regstore_mirror_words(header, s);
+	for (int attempt = 0; attempt < READ_ATTEMPTS; attempt++) {
+		uint64_t seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+		if (seq == 0) {
+			return false;
+		}
+		if (seq & 1) {
+			continue;
+		}
+		uint32_t value_len = atomic_load_explicit(&s->value_len, memory_order_relaxed);
+		size_t n = value_len == REGSTORE_MIRROR_REMOVED ? 0 : value_len;
+		if (n > header->value_size) {
+			n = header->value_size;
+		}
+		if (n > size) {
+			n = size;
+		}
+		for (size_t i = 0; i * sizeof(uint64_t) < n; i++) {
+			uint64_t word = atomic_load_explicit(&words[i], memory_order_relaxed);
+			size_t begin = i * sizeof(word);
+			memcpy(buf + begin, &word, n - begin < sizeof(word) ? n - begin : sizeof(word));
+		}
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&s->seq, memory_order_relaxed) != seq) {
+			continue;
+		}
+		if (value_len == REGSTORE_MIRROR_REMOVED) {
+			return false;
+		}
+		value->len = n;
+		value->truncated = n < value_len;
+		value->version = seq / 2;
+		return true;
+	}
+	return false;
+}
@@ -0,0 +1,95 @@
+#pragma once
+/*
+ * Shared-memory mirror of registers exported by a regstore (C or C++), read
+ * by other processes without locks or system calls.  Link regstore_mirror.c
+ * to read; the layout below is shared with the stores which write it.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#if defined __cplusplus
+#include <atomic>
+#define REGSTORE_MIRROR_ATOMIC(T) std::atomic<T>
+extern "C" {
+#else
+#include <stdatomic.h>
+#include <stdbool.h>
+#define REGSTORE_MIRROR_ATOMIC(T) _Atomic T
+#endif
+
+#define REGSTORE_MIRROR_MAGIC UINT64_C(0x72656773746f7231)
+/* Value length of a slot whose register was removed */
+#define REGSTORE_MIRROR_REMOVED UINT32_MAX
+
+/* Start of the segment, followed by capacity slots of slot_size bytes */
+struct regstore_mirror_header {
+	/* Set once the segment is initialised, cleared when its writer closes it */
+	REGSTORE_MIRROR_ATOMIC(uint64_t) magic;
+	uint32_t capacity;
+	uint32_t slot_size;
+	/* Bytes of key and value per slot, multiples of 8 */
+	uint32_t key_size;
+	uint32_t value_size;
+	/* Slots in use, each complete before it is counted */
+	REGSTORE_MIRROR_ATOMIC(uint32_t) count;
+};
+
+/* Followed by key_size bytes of key, then the value as value_size / 8 words */
+struct regstore_mirror_slot {
+	/* Twice the count of writes, plus one while one is in progress */
+	REGSTORE_MIRROR_ATOMIC(uint64_t) seq;
+	/* Of the whole value, which is cut short to value_size */
+	REGSTORE_MIRROR_ATOMIC(uint32_t) value_len;
+	uint32_t key_len;
+};
+
+static inline struct regstore_mirror_slot *regstore_mirror_slot_at(const struct regstore_mirror_header *header, size_t i)
+{
+	return (struct regstore_mirror_slot *) ((char *) header + sizeof(*header) + i * header->slot_size);
+}
+
+static inline char *regstore_mirror_key(struct regstore_mirror_slot *slot)
+{
+	return (char *) (slot + 1);
+}
+
+static inline REGSTORE_MIRROR_ATOMIC(uint64_t) *regstore_mirror_words(const struct regstore_mirror_header *header, struct regstore_mirror_slot *slot)
+{
+	return (REGSTORE_MIRROR_ATOMIC(uint64_t) *) (regstore_mirror_key(slot) + header->key_size);
+}
+
+/* Reader's mapping of a segment */
+struct regstore_mirror {
+	const struct regstore_mirror_header *header;
+	size_t size;
+};
+
+/* Map the segment exported under name (as passed to shm_open), false if absent or not ready */
+bool regstore_mirror_open(struct regstore_mirror *mirror, const char *name);
+void regstore_mirror_close(struct regstore_mirror *mirror);
+
+/* False once the writer has closed or replaced the segment, which should then be reopened */
+bool regstore_mirror_valid(const struct regstore_mirror *mirror);
+
+/* Slot of key, -1 if not exported.  Scans the segment: look keys up once and keep their slots. */
+ptrdiff_t regstore_mirror_find(const struct regstore_mirror *mirror, const char *key, size_t len);
+
+/* Count of writes to the slot, for cheap polling: unchanged means the value is too */
+uint64_t regstore_mirror_version(const struct regstore_mirror *mirror, size_t slot);
+
+/* Value read from a slot into the caller's buffer */
+struct regstore_mirror_value {
+	size_t len; /* Bytes copied */
+	bool truncated; /* Cut short by the slot's value_size or the buffer */
+	uint64_t version; /* Write it came from, as regstore_mirror_version */
+};
+
+/*
+ * Copy up to size bytes of the slot's value into buf.  Fails if the value
+ * was never written, its register was removed, or writes kept overtaking
+ * the copy.
+ */
+bool regstore_mirror_read(const struct regstore_mirror *mirror, size_t slot, char *buf, size_t size, struct regstore_mirror_value *value);
+
+#if defined __cplusplus
+}
+#endif